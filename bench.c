@@ -0,0 +1,466 @@
+/* TRON Multiplayer microbenchmarks.
+ * Times the functions on the tick path of the server (simulation, move and
+ * snapshot encoding) and the setup of a game, for several board sizes and
+ * player counts. Every case uses the same seed on every run, so two builds
+ * can be compared line by line.
+ *
+ * The results are printed as CSV to stdout, one line per case:
+ *   benchmark,width,height,players,iterations,ns_per_op,allocs_per_op,ops_per_s,mb_per_s
+ * mb_per_s is empty for the cases that don't process a byte stream.
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (see the Makefile), the ones made inside the C library are not seen.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+// Custom libraries
+#include "codes.h"
+#include "tron_simulation.h"
+#include "step_kernel.h"
+#include "strip_simulation.h"
+
+// Default minimum time spent measuring each case, in ms
+#define MIN_TIME 200
+#define DEFAULT_SEED 1
+// Largest board written to a file for the board_from_file benchmark
+#define MAX_FILE_BOARD 1024
+
+///// Structure definitions
+
+// Everything a benchmark body may need, built before the clock starts
+typedef struct bench_case_struct {
+  const char * name;
+  int width;
+  int height;
+  int players;
+  board_t * board;
+  game_t game;
+  // Threads sharing the simulation, for the strip cases
+  strip_simulation_t * strips;
+  char * message;
+  char filename[64];
+  // Bytes consumed or produced by one operation, 0 if it doesn't apply
+  size_t bytes_per_op;
+} bench_case_t;
+
+typedef void (* bench_body_t)(bench_case_t * bench, long long iterations);
+
+// State of the clock (in ns) and the allocation counter of the running case
+typedef struct bench_timer_struct {
+  long long elapsed;
+  long long started;
+  unsigned long long allocations;
+  unsigned long long allocations_started;
+  int running;
+} bench_timer_t;
+
+
+// Every allocation of the process, counted by the wrappers below
+unsigned long long allocation_count = 0;
+bench_timer_t timer;
+unsigned int seed = DEFAULT_SEED;
+int min_time = MIN_TIME;
+char * filter = NULL;
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+long long monotonicNanos();
+void startTimer();
+void stopTimer();
+void runBenchmark(bench_case_t * bench, bench_body_t body);
+void setupGame(bench_case_t * bench, int width, int height, int players);
+void resetGame(bench_case_t * bench);
+void freeGame(bench_case_t * bench);
+void writeBoardFile(bench_case_t * bench, int width, int height);
+void benchSimulation(bench_case_t * bench, long long iterations);
+void benchStepPlayers(bench_case_t * bench, long long iterations);
+void benchStripSimulation(bench_case_t * bench, long long iterations);
+void benchNewCoordinates(bench_case_t * bench, long long iterations);
+void benchCompress(bench_case_t * bench, long long iterations);
+void benchDecompress(bench_case_t * bench, long long iterations);
+void benchStartPosition(bench_case_t * bench, long long iterations);
+void benchBoardFromFile(bench_case_t * bench, long long iterations);
+
+// Replacements of the allocator, the linker sends every call here
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * pointer, size_t size);
+
+void * __wrap_malloc(size_t size) {
+  allocation_count++;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size) {
+  allocation_count++;
+  return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * pointer, size_t size) {
+  allocation_count++;
+  return __real_realloc(pointer, size);
+}
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[]) {
+  int sizes[] = {BOARD_WIDTH, 256, 1024, 8192};
+  int player_counts[] = {2, 8, 64};
+  int size_count = sizeof(sizes) / sizeof(*sizes);
+  int player_count = sizeof(player_counts) / sizeof(*player_counts);
+  // Enough players for the step kernels to matter
+  int crowd_counts[] = {1024, 4096};
+  int crowd_count = sizeof(crowd_counts) / sizeof(*crowd_counts);
+  const char * kernels[] = {"avx2", "scalar"};
+  int kernel_count = sizeof(kernels) / sizeof(*kernels);
+  int thread_counts[] = {1, 2, 4, 8};
+  int thread_count = sizeof(thread_counts) / sizeof(*thread_counts);
+  char kernel_name[64];
+  bench_case_t bench;
+  int option;
+
+  while ((option = getopt(argc, argv, "t:s:f:")) != -1) {
+    switch (option) {
+      case 't': min_time = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      case 'f': filter = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || min_time <= 0) {
+    usage(argv[0]);
+  }
+
+  printf("benchmark,width,height,players,iterations,ns_per_op,allocs_per_op,ops_per_s,mb_per_s\n");
+
+  // The tick path
+  for (int i = 0; i < size_count; i++) {
+    for (int j = 0; j < player_count; j++) {
+      setupGame(&bench, sizes[i], sizes[i], player_counts[j]);
+      bench.name = "game_simulation";
+      runBenchmark(&bench, benchSimulation);
+      freeGame(&bench);
+    }
+  }
+  // The same step with every kernel this CPU can run
+  for (int k = 0; k < kernel_count; k++) {
+    if (!select_step_kernel(kernels[k])) {
+      continue;
+    }
+    snprintf(kernel_name, sizeof(kernel_name), "step_players/%s", kernels[k]);
+    for (int j = 0; j < crowd_count; j++) {
+      setupGame(&bench, 8192, 8192, crowd_counts[j]);
+      bench.name = kernel_name;
+      runBenchmark(&bench, benchStepPlayers);
+      freeGame(&bench);
+    }
+  }
+  // The same steps split between threads, back to the widest kernel
+  select_step_kernel(kernels[0]);
+  for (int t = 0; t < thread_count; t++) {
+    snprintf(kernel_name, sizeof(kernel_name), "strip_simulation/%d", thread_counts[t]);
+    for (int j = 0; j < crowd_count; j++) {
+      setupGame(&bench, 8192, 8192, crowd_counts[j]);
+      bench.strips = create_strip_simulation(bench.board, thread_counts[t]);
+      bench.name = kernel_name;
+      runBenchmark(&bench, benchStripSimulation);
+      free_strip_simulation(bench.strips);
+      freeGame(&bench);
+    }
+  }
+
+  setupGame(&bench, BOARD_WIDTH, BOARD_HEIGHT, 1);
+  bench.name = "getNewCoordinates";
+  runBenchmark(&bench, benchNewCoordinates);
+  freeGame(&bench);
+
+  // The text snapshots
+  for (int j = 0; j < player_count; j++) {
+    setupGame(&bench, BOARD_WIDTH, BOARD_HEIGHT, player_counts[j]);
+    bench.message = compressGame(&bench.game);
+    bench.bytes_per_op = strlen(bench.message) + 1;
+    bench.name = "compressGame";
+    runBenchmark(&bench, benchCompress);
+    bench.name = "decompressGame";
+    runBenchmark(&bench, benchDecompress);
+    free(bench.message);
+    freeGame(&bench);
+  }
+
+  // Starting a game
+  for (int i = 0; i < size_count; i++) {
+    for (int j = 0; j < player_count; j++) {
+      setupGame(&bench, sizes[i], sizes[i], player_counts[j]);
+      bench.name = "getStartPosition/random";
+      runBenchmark(&bench, benchStartPosition);
+      freeGame(&bench);
+    }
+
+    // Board files take a byte per cell, too slow to parse for the largest boards
+    if (sizes[i] > MAX_FILE_BOARD) {
+      continue;
+    }
+    writeBoardFile(&bench, sizes[i], sizes[i]);
+    bench.board = board_from_file(bench.filename);
+    bench.players = 2;
+    bench.name = "getStartPosition/marked";
+    runBenchmark(&bench, benchStartPosition);
+    free_board(bench.board);
+    bench.name = "board_from_file";
+    runBenchmark(&bench, benchBoardFromFile);
+    unlink(bench.filename);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program) {
+  printf("Usage:\n");
+  printf("\t%s [-t min_time_ms] [-s seed] [-f filter]\n", program);
+  printf("\t-t: minimum time measuring each case (default %d ms)\n", MIN_TIME);
+  printf("\t-s: seed for the random positions (default %d)\n", DEFAULT_SEED);
+  printf("\t-f: only run the benchmarks whose name contains this text\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+    Time in ns, the operations are too short for the us of the tick scheduler
+*/
+long long monotonicNanos() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Start or resume measuring time and allocations
+    Bodies stop the timer around work that is not part of the operation
+*/
+void startTimer() {
+  if (!timer.running) {
+    timer.running = 1;
+    timer.allocations_started = allocation_count;
+    timer.started = monotonicNanos();
+  }
+}
+
+void stopTimer() {
+  if (timer.running) {
+    timer.elapsed += monotonicNanos() - timer.started;
+    timer.allocations += allocation_count - timer.allocations_started;
+    timer.running = 0;
+  }
+}
+
+/*
+    Run a body with more and more iterations until it takes at least
+    min_time, then print its results
+*/
+void runBenchmark(bench_case_t * bench, bench_body_t body) {
+  long long iterations = 1;
+  double ns_per_op;
+  double seconds;
+
+  if (filter != NULL && strstr(bench->name, filter) == NULL) {
+    return;
+  }
+  while (1) {
+    memset(&timer, 0, sizeof(timer));
+    // Same random numbers for every round and every run
+    seed_random(&bench->game.random_state, seed);
+    startTimer();
+    body(bench, iterations);
+    stopTimer();
+    if (timer.elapsed >= min_time * 1000000LL || iterations >= (1LL << 40)) {
+      break;
+    }
+    // Aim a little past the target from the last measurement
+    if (timer.elapsed <= 0) {
+      iterations *= 100;
+    } else {
+      long long next = (long long)((double)iterations * min_time * 1200000.0 / timer.elapsed);
+      iterations = next > iterations * 100 ? iterations * 100 : next > iterations ? next : iterations + 1;
+    }
+  }
+
+  ns_per_op = (double)timer.elapsed / iterations;
+  seconds = timer.elapsed / 1e9;
+  printf("%s,%d,%d,%d,%lld,%.2f,%.2f,%.0f,", bench->name, bench->width, bench->height,
+    bench->players, iterations, ns_per_op, (double)timer.allocations / iterations,
+    iterations / seconds);
+  if (bench->bytes_per_op > 0) {
+    printf("%.2f", bench->bytes_per_op * iterations / seconds / (1024 * 1024));
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/*
+    Prepare a game with the players spread over the rows of the board,
+    all of them going right so they never meet
+*/
+void setupGame(bench_case_t * bench, int width, int height, int players) {
+  memset(bench, 0, sizeof(*bench));
+  bench->width = width;
+  bench->height = height;
+  bench->players = players;
+  bench->board = create_board(width, height);
+  bench->game.board = bench->board;
+  bench->game.players = calloc(1, sizeof(*bench->game.players));
+  bench->game.players->player_count = players;
+  bench->game.stati = calloc(players, sizeof(*bench->game.stati));
+  resetGame(bench);
+}
+
+/*
+    Clear the trails and put the players back at the start of their rows
+*/
+void resetGame(bench_case_t * bench) {
+  clear_board(bench->board);
+  for (int i = 0; i < bench->players; i++) {
+    bench->game.stati[i].player_number = i + 1;
+    bench->game.stati[i].current_direction = RIGHT;
+    bench->game.stati[i].status = 1;
+    bench->game.stati[i].coordinates.x_position = 0;
+    bench->game.stati[i].coordinates.y_position = i * bench->height / bench->players;
+  }
+}
+
+void freeGame(bench_case_t * bench) {
+  free_board(bench->board);
+  free(bench->game.players);
+  free(bench->game.stati);
+}
+
+/*
+    Write a board file of the given size with the start of both players
+    marked in opposite corners, as in the example of tron_simulation.h
+*/
+void writeBoardFile(bench_case_t * bench, int width, int height) {
+  FILE * file;
+
+  memset(bench, 0, sizeof(*bench));
+  bench->width = width;
+  bench->height = height;
+  snprintf(bench->filename, sizeof(bench->filename), "/tmp/tron_bench_%d.txt", (int)getpid());
+  file = fopen(bench->filename, "w");
+  if (file == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(file, "%d %d\n", width, height);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      fprintf(file, j == 0 ? "%d" : " %d", i == 0 && j == 0 ? 1 : i == height - 1 && j == width - 1 ? 2 : 0);
+    }
+    fprintf(file, "\n");
+  }
+  bench->bytes_per_op = ftell(file);
+  fclose(file);
+}
+
+/*
+    One operation is one tick of every player
+    The players can only go around the board once before they
+    meet their own trail, so the board is cleared with the timer stopped
+*/
+void benchSimulation(bench_case_t * bench, long long iterations) {
+  int laps = bench->width - 1;
+
+  for (long long i = 0; i < iterations; i++) {
+    if (i % laps == 0) {
+      stopTimer();
+      resetGame(bench);
+      startTimer();
+    }
+    game_simulation(bench->board, bench->game.stati, bench->players);
+  }
+}
+
+/*
+    Same as benchSimulation, without copying the players in and out of
+    the store of the board
+*/
+void benchStepPlayers(bench_case_t * bench, long long iterations) {
+  int laps = bench->width - 1;
+
+  for (long long i = 0; i < iterations; i++) {
+    if (i % laps == 0) {
+      stopTimer();
+      resetGame(bench);
+      load_players(&bench->board->store, bench->game.stati, bench->players);
+      startTimer();
+    }
+    step_players(bench->board, &bench->board->store);
+  }
+}
+
+/*
+    Same as benchSimulation, with the board split between threads
+*/
+void benchStripSimulation(bench_case_t * bench, long long iterations) {
+  int laps = bench->width - 1;
+
+  for (long long i = 0; i < iterations; i++) {
+    if (i % laps == 0) {
+      stopTimer();
+      resetGame(bench);
+      startTimer();
+    }
+    strip_simulation(bench->strips, bench->game.stati, bench->players);
+  }
+}
+
+// One operation is one step of one player, wrapping around the board
+void benchNewCoordinates(bench_case_t * bench, long long iterations) {
+  for (long long i = 0; i < iterations; i++) {
+    getNewCoordinates(&bench->game.stati[0], bench->width, bench->height);
+  }
+}
+
+void benchCompress(bench_case_t * bench, long long iterations) {
+  for (long long i = 0; i < iterations; i++) {
+    free(compressGame(&bench->game));
+  }
+}
+
+void benchDecompress(bench_case_t * bench, long long iterations) {
+  for (long long i = 0; i < iterations; i++) {
+    decompressGame(bench->message, &bench->game);
+  }
+}
+
+/*
+    One operation finds the start of every player of a game,
+    taking each cell so the next player gets another one
+*/
+void benchStartPosition(bench_case_t * bench, long long iterations) {
+  player_coordinates_t position;
+
+  for (long long i = 0; i < iterations; i++) {
+    for (int j = 1; j <= bench->players; j++) {
+      position = getStartPosition(bench->board, j, &bench->game.random_state);
+      board_occupy(bench->board, position.x_position, position.y_position, j);
+    }
+    stopTimer();
+    clear_board(bench->board);
+    startTimer();
+  }
+}
+
+void benchBoardFromFile(bench_case_t * bench, long long iterations) {
+  for (long long i = 0; i < iterations; i++) {
+    free_board(board_from_file(bench->filename));
+  }
+}
@@ -0,0 +1,486 @@
+/*
+ * Spectators of the games.
+ * See broadcast.h for how the snapshots are shared between spectators.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "broadcast.h"
+#include "sockets.h"
+#include "protocol.h"
+#include "tick_scheduler.h"
+#include "metrics.h"
+#include "logger.h"
+#include "fatal_error.h"
+
+#define BROADCAST_EVENTS 256
+// Longest sleep of a thread, to check the lag of blocked spectators, in ms
+#define BROADCAST_IDLE 100
+// Iovecs per writev, enough for the whole ring and a partial buffer
+#define BROADCAST_IOV (BROADCAST_RING + 1)
+
+static void * broadcastThread(void * arg);
+static void takeSpectators(broadcaster_t * thread);
+static void serveChannel(broadcaster_t * thread, subscription_t * subscription);
+static int sendSnapshots(broadcaster_t * thread, spectator_t * spectator, shared_buffer_t ** snapshots,
+                         uint32_t oldest, uint32_t written, long long now);
+static void closeSpectator(broadcaster_t * thread, subscription_t * subscription, int index);
+static void writeLatest(broadcast_channel_t * channel);
+
+void initBroadcast(broadcast_t * broadcast, int thread_count, long long lag_budget) {
+  struct epoll_event event;
+  sigset_t signals;
+  sigset_t previous;
+
+  broadcast->thread_count = thread_count > MAX_BROADCAST_THREADS ? MAX_BROADCAST_THREADS : thread_count;
+  broadcast->threads = calloc(broadcast->thread_count, sizeof(*broadcast->threads));
+  broadcast->next_thread = 0;
+  broadcast->lag_budget = lag_budget;
+  broadcast->stopping = 0;
+  if (broadcast->threads == NULL) {
+    fatalError("ERROR: calloc");
+  }
+  // Signals must wake up the main thread, like with the workers
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  for (int i = 0; i < broadcast->thread_count; i++) {
+    broadcaster_t * thread = &broadcast->threads[i];
+    thread->id = i;
+    thread->broadcast = broadcast;
+    pthread_mutex_init(&thread->lock, NULL);
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    thread->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->epoll_fd == -1 || thread->wakeup_fd == -1) {
+      fatalError("ERROR: creating the spectator threads");
+    }
+    // The wakeup is told apart from the spectators by its address
+    event.events = EPOLLIN;
+    event.data.ptr = &thread->wakeup_fd;
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->wakeup_fd, &event) == -1) {
+      fatalError("ERROR: epoll_ctl");
+    }
+    if (pthread_create(&thread->tid, NULL, broadcastThread, thread) != 0) {
+      fatalError("ERROR: pthread_create");
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+void stopBroadcast(broadcast_t * broadcast) {
+  uint64_t one = 1;
+
+  __atomic_store_n(&broadcast->stopping, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < broadcast->thread_count; i++) {
+    if (write(broadcast->threads[i].wakeup_fd, &one, sizeof(one)) == -1) {
+      // The counter is already set, the thread wakes up anyway
+    }
+  }
+  for (int i = 0; i < broadcast->thread_count; i++) {
+    broadcaster_t * thread = &broadcast->threads[i];
+    pthread_join(thread->tid, NULL);
+    close(thread->epoll_fd);
+    close(thread->wakeup_fd);
+    pthread_mutex_destroy(&thread->lock);
+  }
+  free(broadcast->threads);
+}
+
+broadcast_channel_t * openChannel(broadcast_t * broadcast, frame_publisher_t * frames, int room_id,
+                                  int player_count, int width, int height, long long tick_period) {
+  broadcast_channel_t * channel = calloc(1, sizeof(*channel));
+
+  if (channel == NULL) {
+    fatalError("ERROR: calloc");
+  }
+  pthread_mutex_init(&channel->lock, NULL);
+  channel->references = 1;
+  channel->room_id = room_id;
+  channel->player_count = player_count;
+  channel->width = width;
+  channel->height = height;
+  channel->tick_period = tick_period;
+  channel->frames = frames;
+  channel->broadcast = broadcast;
+  return channel;
+}
+
+void notifyChannel(broadcast_channel_t * channel) {
+  uint64_t watchers = __atomic_load_n(&channel->watchers, __ATOMIC_ACQUIRE);
+  uint64_t one = 1;
+  int thread;
+
+  while (watchers != 0) {
+    thread = __builtin_ctzll(watchers);
+    watchers &= watchers - 1;
+    if (write(channel->broadcast->threads[thread].wakeup_fd, &one, sizeof(one)) == -1) {
+      // The counter is already set, the thread wakes up anyway
+    }
+  }
+}
+
+void closeChannel(broadcast_channel_t * channel) {
+  pthread_mutex_lock(&channel->lock);
+  // The threads may not have seen the last step yet
+  writeLatest(channel);
+  channel->frames = NULL;
+  channel->closed = 1;
+  pthread_mutex_unlock(&channel->lock);
+  notifyChannel(channel);
+  releaseChannel(channel);
+}
+
+broadcast_channel_t * retainChannel(broadcast_channel_t * channel) {
+  __atomic_add_fetch(&channel->references, 1, __ATOMIC_RELAXED);
+  return channel;
+}
+
+void releaseChannel(broadcast_channel_t * channel) {
+  if (__atomic_sub_fetch(&channel->references, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  for (int i = 0; i < BROADCAST_RING; i++) {
+    if (channel->ring[i] != NULL) {
+      releaseSharedBuffer(channel->ring[i]);
+    }
+  }
+  pthread_mutex_destroy(&channel->lock);
+  free(channel);
+}
+
+void addSpectator(broadcast_t * broadcast, broadcast_channel_t * channel, int fd) {
+  broadcaster_t * thread = &broadcast->threads[broadcast->next_thread];
+  spectator_t * spectator = calloc(1, sizeof(*spectator));
+  char answer[128];
+  uint64_t one = 1;
+
+  if (spectator == NULL) {
+    fatalError("ERROR: calloc");
+  }
+  broadcast->next_thread = (broadcast->next_thread + 1) % broadcast->thread_count;
+  spectator->fd = fd;
+  spectator->channel = channel;
+  // Spectators are player 0, and always get full snapshots
+  snprintf(answer, sizeof(answer), "%d,%d,%d,%d,%d,%lld", channel->player_count, channel->width,
+    channel->height, PROTOCOL_BINARY, 0, channel->tick_period);
+  spectator->partial = sharedBufferFromString(answer);
+
+  pthread_mutex_lock(&thread->lock);
+  spectator->next_new = thread->added;
+  thread->added = spectator;
+  pthread_mutex_unlock(&thread->lock);
+  if (write(thread->wakeup_fd, &one, sizeof(one)) == -1) {
+    // The counter is already set, the thread wakes up anyway
+  }
+}
+
+/*
+    Write the step published last into the ring, unless it is already there
+    The lock of the channel must be held
+*/
+static void writeLatest(broadcast_channel_t * channel) {
+  shared_buffer_t ** slot;
+  shared_buffer_t * snapshot;
+  game_frame_t * frame;
+
+  if (channel->frames == NULL || (frame = acquireFrame(channel->frames)) == NULL) {
+    return;
+  }
+  // The frame of step 0 is the start of the game, the players get step 1 first
+  if (frame->step > 0 && (channel->written == 0 || frame->step != channel->last_step)) {
+    snapshot = createSharedBuffer(snapshotFrameSize(frame->player_count));
+    encodePlayersSnapshot(frame->stati, frame->player_count, frame->step,
+      (unsigned char *)snapshot->data, snapshot->length);
+    slot = &channel->ring[channel->written % BROADCAST_RING];
+    if (*slot != NULL) {
+      releaseSharedBuffer(*slot);
+    }
+    *slot = snapshot;
+    channel->last_step = frame->step;
+    __atomic_store_n(&channel->written, channel->written + 1, __ATOMIC_RELEASE);
+  }
+  if (frame->finished) {
+    channel->closed = 1;
+  }
+  releaseFrame(frame);
+}
+
+// Send the snapshots of every channel to its spectators as they come
+static void * broadcastThread(void * arg) {
+  broadcaster_t * thread = arg;
+  struct epoll_event events[BROADCAST_EVENTS];
+  spectator_t * spectator;
+  uint64_t wakeups;
+  int event_count;
+
+  while (!__atomic_load_n(&thread->broadcast->stopping, __ATOMIC_ACQUIRE)) {
+    event_count = epoll_wait(thread->epoll_fd, events, BROADCAST_EVENTS, BROADCAST_IDLE);
+    for (int i = 0; i < event_count; i++) {
+      if (events[i].data.ptr == &thread->wakeup_fd) {
+        if (read(thread->wakeup_fd, &wakeups, sizeof(wakeups)) == -1) {
+          // Another event already reset the counter
+        }
+        continue;
+      }
+      // The socket of a spectator is only watched for hang ups and for
+      // taking data again, the data is sent below
+      spectator = events[i].data.ptr;
+      if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        spectator->closing = 1;
+      }
+    }
+    takeSpectators(thread);
+    // Closing a spectator may remove its subscription, go backwards
+    for (int i = thread->subscription_count - 1; i >= 0; i--) {
+      serveChannel(thread, &thread->subscriptions[i]);
+    }
+  }
+
+  for (int i = thread->subscription_count - 1; i >= 0; i--) {
+    subscription_t * subscription = &thread->subscriptions[i];
+    for (int j = subscription->count - 1; j >= 0; j--) {
+      closeSpectator(thread, subscription, j);
+    }
+  }
+  free(thread->subscriptions);
+  thread->subscriptions = NULL;
+  // Spectators added while stopping are closed right away
+  takeSpectators(thread);
+  return NULL;
+}
+
+/*
+    Start watching the spectators added since the last pass
+    Once stopping, they are closed right away
+*/
+static void takeSpectators(broadcaster_t * thread) {
+  struct epoll_event event;
+  subscription_t * subscription;
+  spectator_t * spectator;
+  spectator_t * added;
+  uint32_t written;
+
+  pthread_mutex_lock(&thread->lock);
+  added = thread->added;
+  thread->added = NULL;
+  pthread_mutex_unlock(&thread->lock);
+
+  while ((spectator = added) != NULL) {
+    added = spectator->next_new;
+    if (__atomic_load_n(&thread->broadcast->stopping, __ATOMIC_ACQUIRE)) {
+      close(spectator->fd);
+      releaseSharedBuffer(spectator->partial);
+      releaseChannel(spectator->channel);
+      free(spectator);
+      continue;
+    }
+
+    subscription = NULL;
+    for (int i = 0; i < thread->subscription_count; i++) {
+      if (thread->subscriptions[i].channel == spectator->channel) {
+        subscription = &thread->subscriptions[i];
+      }
+    }
+    if (subscription == NULL) {
+      if (thread->subscription_count == thread->subscription_capacity) {
+        thread->subscription_capacity = thread->subscription_capacity ? thread->subscription_capacity * 2 : 16;
+        thread->subscriptions = realloc(thread->subscriptions,
+          thread->subscription_capacity * sizeof(*thread->subscriptions));
+        if (thread->subscriptions == NULL) {
+          fatalError("ERROR: realloc");
+        }
+      }
+      subscription = &thread->subscriptions[thread->subscription_count++];
+      memset(subscription, 0, sizeof(*subscription));
+      subscription->channel = spectator->channel;
+      __atomic_or_fetch(&spectator->channel->watchers, 1ULL << thread->id, __ATOMIC_RELEASE);
+    }
+    if (subscription->count == subscription->capacity) {
+      subscription->capacity = subscription->capacity ? subscription->capacity * 2 : 16;
+      subscription->spectators = realloc(subscription->spectators,
+        subscription->capacity * sizeof(*subscription->spectators));
+      if (subscription->spectators == NULL) {
+        fatalError("ERROR: realloc");
+      }
+    }
+    subscription->spectators[subscription->count++] = spectator;
+
+    // A spectator joining in the middle starts at the newest snapshot
+    written = __atomic_load_n(&spectator->channel->written, __ATOMIC_ACQUIRE);
+    spectator->next = written > 0 ? written - 1 : 0;
+    event.events = EPOLLRDHUP;
+    event.data.ptr = spectator;
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, spectator->fd, &event) == -1) {
+      fatalError("ERROR: epoll_ctl");
+    }
+    logMessage(LEVEL_DEBUG, "Room %d: spectator joined", spectator->channel->room_id);
+  }
+}
+
+/*
+    Write the newest step of a channel if no thread did yet, and send the
+    snapshots to every spectator of the channel in this thread
+*/
+static void serveChannel(broadcaster_t * thread, subscription_t * subscription) {
+  broadcast_channel_t * channel = subscription->channel;
+  shared_buffer_t * snapshots[BROADCAST_RING];
+  spectator_t * spectator;
+  long long now = monotonicMicros();
+  uint32_t written;
+  uint32_t oldest;
+  int closed;
+
+  // The buffers still needed are retained, so the ring can move on while
+  // they are being sent
+  pthread_mutex_lock(&channel->lock);
+  writeLatest(channel);
+  written = channel->written;
+  closed = channel->closed;
+  oldest = written;
+  for (int i = 0; i < subscription->count; i++) {
+    if (subscription->spectators[i]->next < oldest) {
+      oldest = subscription->spectators[i]->next;
+    }
+  }
+  if (written - oldest > BROADCAST_RING) {
+    oldest = written - BROADCAST_RING;
+  }
+  for (uint32_t step = oldest; step != written; step++) {
+    snapshots[step - oldest] = retainSharedBuffer(channel->ring[step % BROADCAST_RING]);
+  }
+  pthread_mutex_unlock(&channel->lock);
+
+  for (int i = subscription->count - 1; i >= 0; i--) {
+    spectator = subscription->spectators[i];
+    if (spectator->closing
+        || !sendSnapshots(thread, spectator, snapshots, oldest, written, now)
+        || (closed && spectator->partial == NULL && spectator->next == written)) {
+      closeSpectator(thread, subscription, i);
+    }
+  }
+  for (uint32_t step = oldest; step != written; step++) {
+    releaseSharedBuffer(snapshots[step - oldest]);
+  }
+}
+
+/*
+    Send a spectator what it is missing, snapshots holds the ones from
+    oldest to written - 1
+    Returns 0 if the spectator must be closed
+*/
+static int sendSnapshots(broadcaster_t * thread, spectator_t * spectator, shared_buffer_t ** snapshots,
+                         uint32_t oldest, uint32_t written, long long now) {
+  struct iovec iov[BROADCAST_IOV];
+  struct epoll_event event;
+  shared_buffer_t * snapshot;
+  ssize_t sent;
+  size_t left;
+  int count = 0;
+  int pending;
+
+  if (spectator->next < oldest) {
+    spectator->next = oldest;
+  }
+  // Behind: the snapshots it didn't start are replaced by the newest one
+  if (spectator->backlog_since != 0 && written - spectator->next > 1) {
+    spectator->next = written - 1;
+  }
+  if (spectator->partial != NULL) {
+    iov[count].iov_base = spectator->partial->data + spectator->offset;
+    iov[count].iov_len = spectator->partial->length - spectator->offset;
+    count++;
+  }
+  for (uint32_t step = spectator->next; step != written; step++) {
+    iov[count].iov_base = snapshots[step - oldest]->data;
+    iov[count].iov_len = snapshots[step - oldest]->length;
+    count++;
+  }
+  if (count == 0) {
+    return 1;
+  }
+
+  sent = writev(spectator->fd, iov, count);
+  if (sent == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return 0;
+    }
+    sent = 0;
+  }
+  addCounter(COUNTER_SPECTATOR_BYTES_OUT, sent);
+
+  if (spectator->partial != NULL) {
+    left = spectator->partial->length - spectator->offset;
+    if ((size_t)sent < left) {
+      spectator->offset += sent;
+      sent = 0;
+    } else {
+      sent -= left;
+      releaseSharedBuffer(spectator->partial);
+      spectator->partial = NULL;
+    }
+  }
+  while (sent > 0) {
+    snapshot = snapshots[spectator->next - oldest];
+    spectator->next++;
+    if ((size_t)sent < snapshot->length) {
+      spectator->partial = retainSharedBuffer(snapshot);
+      spectator->offset = sent;
+      break;
+    }
+    sent -= snapshot->length;
+  }
+
+  pending = spectator->partial != NULL || spectator->next != written;
+  if (!pending) {
+    spectator->backlog_since = 0;
+  } else if (spectator->backlog_since == 0) {
+    spectator->backlog_since = now;
+  } else if (now - spectator->backlog_since > thread->broadcast->lag_budget) {
+    logMessage(LEVEL_WARNING, "Room %d: spectator fell behind", spectator->channel->room_id);
+    return 0;
+  }
+  // Wait for the socket to take data again only while something is left
+  if (pending != spectator->watching_out) {
+    event.events = pending ? EPOLLRDHUP | EPOLLOUT : EPOLLRDHUP;
+    event.data.ptr = spectator;
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, spectator->fd, &event);
+    spectator->watching_out = pending;
+  }
+  return 1;
+}
+
+/*
+    Close the spectator at index of a subscription, and the subscription
+    once it has no spectators
+*/
+static void closeSpectator(broadcaster_t * thread, subscription_t * subscription, int index) {
+  spectator_t * spectator = subscription->spectators[index];
+  broadcast_channel_t * channel = subscription->channel;
+  char discard[256];
+
+  epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, spectator->fd, NULL);
+  // Unread data would make the close reset the connection and lose the
+  // last snapshots
+  while (recv(spectator->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+  }
+  close(spectator->fd);
+  if (spectator->partial != NULL) {
+    releaseSharedBuffer(spectator->partial);
+  }
+  free(spectator);
+  logMessage(LEVEL_DEBUG, "Room %d: spectator left", channel->room_id);
+
+  subscription->spectators[index] = subscription->spectators[--subscription->count];
+  if (subscription->count == 0) {
+    __atomic_and_fetch(&channel->watchers, ~(1ULL << thread->id), __ATOMIC_RELEASE);
+    free(subscription->spectators);
+    *subscription = thread->subscriptions[--thread->subscription_count];
+  }
+  releaseChannel(channel);
+}
@@ -0,0 +1,144 @@
+/*
+ * Spectators of the games.
+ *
+ * Spectators never touch a room. Threads of their own take the steps the
+ * room publishes (see game_frame.h), write each one once as a full snapshot
+ * into a ring shared by every spectator of the room, and send the ring to
+ * the spectators with writev, so a viewer costs a few iovecs and not a
+ * snapshot. All the room does is wake up the threads with spectators of
+ * its game after each step, which costs the same for one spectator as for
+ * a thousand.
+ *
+ * A spectator that can't keep up only gets the newest snapshot once its
+ * socket takes data again, like a slow player, and is disconnected after
+ * the same lag budget. Spectators are closed once they have the last step
+ * of the game.
+ */
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "shared_buffer.h"
+#include "game_frame.h"
+
+// Snapshots kept by every channel, spectators further behind skip ahead
+#define BROADCAST_RING 16
+// Most threads sending to spectators
+#define MAX_BROADCAST_THREADS 64
+
+struct broadcast_struct;
+
+// The snapshots of one room, shared by its spectators
+typedef struct broadcast_channel_struct {
+  pthread_mutex_t lock;
+  // The room and every spectator hold one, freed at 0
+  int references;
+  // Settings of the game, for the handshake of the spectators
+  int room_id;
+  int player_count;
+  int width;
+  int height;
+  long long tick_period;
+  // Steps of the room, NULL once the room closed
+  frame_publisher_t * frames;
+  // Snapshots written so far, the last BROADCAST_RING are in the ring
+  uint32_t written;
+  uint32_t last_step;
+  shared_buffer_t * ring[BROADCAST_RING];
+  // Set once the last step of the game is in the ring
+  int closed;
+  // Bit i is set while thread i has spectators of the channel
+  uint64_t watchers;
+  struct broadcast_struct * broadcast;
+} broadcast_channel_t;
+
+typedef struct spectator_struct {
+  int fd;
+  broadcast_channel_t * channel;
+  // Next snapshot of the channel to send
+  uint32_t next;
+  // Buffer started and not finished, the handshake answer at first, and
+  // the bytes of it already sent
+  shared_buffer_t * partial;
+  size_t offset;
+  // Set while EPOLLOUT is part of the registered events
+  int watching_out;
+  // Time the socket stopped taking everything, 0 while it does
+  long long backlog_since;
+  // Set when the spectator hung up
+  int closing;
+  // Spectators waiting to be taken by their thread
+  struct spectator_struct * next_new;
+} spectator_t;
+
+// The spectators of one channel served by one thread
+typedef struct subscription_struct {
+  broadcast_channel_t * channel;
+  spectator_t ** spectators;
+  int count;
+  int capacity;
+} subscription_t;
+
+typedef struct broadcaster_struct {
+  int id;
+  pthread_t tid;
+  int epoll_fd;
+  // Readable when a room published a step or a spectator was added
+  int wakeup_fd;
+  // Spectators added and not taken yet, protected by the lock
+  pthread_mutex_t lock;
+  spectator_t * added;
+  // Only the thread touches these
+  subscription_t * subscriptions;
+  int subscription_count;
+  int subscription_capacity;
+  struct broadcast_struct * broadcast;
+} broadcaster_t;
+
+typedef struct broadcast_struct {
+  int thread_count;
+  broadcaster_t * threads;
+  // Thread for the next spectator
+  int next_thread;
+  // Time a spectator may stay behind before it is disconnected, in us
+  long long lag_budget;
+  int stopping;
+} broadcast_t;
+
+// Start thread_count threads sending to spectators
+void initBroadcast(broadcast_t * broadcast, int thread_count, long long lag_budget);
+
+// Close every spectator and stop the threads, every room must be closed
+void stopBroadcast(broadcast_t * broadcast);
+
+/*
+    Make the channel of a room, the room holds the reference returned
+    frames are the steps of the room, read until closeChannel
+*/
+broadcast_channel_t * openChannel(broadcast_t * broadcast, frame_publisher_t * frames, int room_id,
+                                  int player_count, int width, int height, long long tick_period);
+
+// Room side: a step was published, wake up the threads with spectators
+void notifyChannel(broadcast_channel_t * channel);
+
+/*
+    Room side: write the last step and stop reading the frames, which may
+    be freed afterwards, and drop the reference of the room
+*/
+void closeChannel(broadcast_channel_t * channel);
+
+broadcast_channel_t * retainChannel(broadcast_channel_t * channel);
+
+void releaseChannel(broadcast_channel_t * channel);
+
+/*
+    Hand a socket that asked to watch to the next thread, which answers
+    the handshake and sends it the snapshots of channel
+    The spectator keeps the reference to the channel given by the caller
+*/
+void addSpectator(broadcast_t * broadcast, broadcast_channel_t * channel, int fd);
+
+#endif
@@ -6,6 +6,7 @@
 // Sockets libraries
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/poll.h>
 // Ncurses for game visualization
 #include <ncurses.h>
 // Custom libraries
@@ -13,98 +14,211 @@
 #include "sockets.h"
 #include "fatal_error.h"
 #include "tron_simulation.h"
+#include "tick_scheduler.h"
+#include "protocol.h"
+#include "delta.h"
+#include "prediction.h"
+#include "renderer.h"
+#include "key_queue.h"
 
 #define BUFFER_SIZE 1024
+// Time between pings to measure the round trip, in us
+#define PING_INTERVAL 1000000
+// Time between connect frames until the server accepts, in ms
+#define CONNECT_RETRY 200
+#define CONNECT_ATTEMPTS 25
+// The game is taken as over after this long without snapshots over UDP, in us
+#define SERVER_TIMEOUT 3000000
+
+// Protocol agreed with the server in the handshake
+int protocol_version = PROTOCOL_TEXT;
+// Tick of the last snapshot received
+uint32_t last_tick = 0;
+// Number of this player and time between ticks, 0 if the server didn't tell
+int player_number = 0;
+long long tick_period = 0;
+// Set when playing over UDP
+int udp = 0;
+// Set when only watching, and the room watched, -1 for the game started last
+int watching = 0;
+int watched_room = -1;
+// Moves the server has not acknowledged yet, repeated in every inputs frame
+direction_t unacked[INPUT_REDUNDANCY];
+uint32_t first_unacked = 1;
+int unacked_count = 0;
+// Time the last datagram arrived from the server over UDP, in us
+long long last_heard = 0;
+// Datagrams received over UDP
+datagram_batch_t datagrams;
+// Steps that deltas can start from
+baseline_ring_t baselines;
 
 ///// FUNCTION DECLARATIONS
 void usage(char * program);
-void startGame(int connection_fd, game_t * game);
-void update(int connection_fd, game_t * game, direction_t move);
+void startGame(stream_t * stream, game_t * game);
+void startDatagramGame(int connection_fd, char * address, game_t * game);
+void initGameState(game_t * game, int width, int height);
+void sendMove(int connection_fd, direction_t move);
+void sendInputs(int connection_fd);
+void sendPing(int connection_fd);
+int update(stream_t * stream, game_t * game, prediction_t * prediction, renderer_t * renderer);
+int updateDatagrams(int connection_fd, game_t * game, prediction_t * prediction, renderer_t * renderer);
+void applySnapshot(game_t * game, prediction_t * prediction, renderer_t * renderer, uint32_t tick);
+void applyDeltaFrame(game_t * game, prediction_t * prediction, renderer_t * renderer,
+                     const unsigned char * payload, size_t length, uint32_t tick);
+void applyView(game_t * game, prediction_t * prediction, renderer_t * renderer,
+               const unsigned char * payload, size_t length, uint32_t tick);
 // Thread to catch keyboard strokes
 void * threadEntry (void * arg);
 
 ///// MAIN FUNCTION
 int main(int argc, char * argv[]) {
-  // Check the correct arguments
-  if (argc != 3) {
+  int fps = DEFAULT_FPS;
+  int option;
+
+  // Check the options and the correct arguments
+  while ((option = getopt(argc, argv, "f:uwr:")) != -1) {
+    switch (option) {
+      case 'f':
+        fps = atoi(optarg);
+        break;
+      case 'u':
+        udp = 1;
+        break;
+      case 'w':
+        watching = 1;
+        break;
+      case 'r':
+        watched_room = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || (watching && udp)) {
       usage(argv[0]);
   }
 
-  int * ch = malloc(sizeof(*ch));
+  key_queue_t keys;
+  key_event_t key;
   pthread_t tid;
-
-  initscr();
-  noecho();
-  curs_set(FALSE);
-  cbreak();	/* Line buffering disabled. pass on everything */
-  keypad(stdscr, TRUE);
-
-  int status = pthread_create(&tid, NULL, &threadEntry, ch);
-  if (status) {
-    fprintf(stderr, "ERROR: pthread_create %d\n", status);
-    exit(EXIT_FAILURE);
-  }
-
   int connection_fd;
+  stream_t stream;
   game_t * game;
+  prediction_t prediction;
+  renderer_t renderer;
+  struct pollfd test_fds[2];
   direction_t direction = RIGHT;
+  direction_t turn;
+  long long next_ping = 0;
+  int connected = 1;
+  int playing = 1;
 
-  // Start the server
-  connection_fd = connectSocket(argv[1], argv[2]);
   // Start the game
   game = malloc(sizeof *game);
-  startGame(connection_fd, game);
+  if (udp) {
+    connection_fd = connectUdpSocket(argv[optind], argv[optind + 1]);
+    memset(&stream, 0, sizeof(stream));
+    startDatagramGame(connection_fd, argv[optind], game);
+  } else {
+    connection_fd = connectSocket(argv[optind], argv[optind + 1]);
+    initStream(&stream, connection_fd, BUFFER_SIZE);
+    startGame(&stream, game);
+  }
+  initPrediction(&prediction, game->players->player_count, game->board->width, game->board->height,
+                 player_number, tick_period);
+  initRenderer(&renderer, game->board, game->players->player_count, fps);
 
-  int counter = 0;
-  int max_y = 0, max_x = 0;
+  initKeyQueue(&keys);
+  int status = pthread_create(&tid, NULL, &threadEntry, &keys);
+  if (status) {
+    fprintf(stderr, "ERROR: pthread_create %d\n", status);
+    exit(EXIT_FAILURE);
+  }
 
-  while(1) {
-    // Global var `stdscr` is created by the call to `initscr()`
-    getmaxyx(stdscr, max_y, max_x);
-    if (counter == 100) {
-      counter = 0;  
-    } else {
-      counter++;
-    }
+  // Every player starts going right
+  if (!watching) {
+    sendMove(connection_fd, direction);
+    predictInput(&prediction, direction, monotonicMicros());
+  }
 
-    switch(*ch) {
-      case KEY_LEFT:
-        if (direction != RIGHT) direction = LEFT;
-        *ch = 0;
-        break;
-      case KEY_RIGHT:
-        if (direction != LEFT) direction = RIGHT;
-        *ch = 0;
-        break;
-      case KEY_UP:
-        if (direction != DOWN) direction = UP;
-        *ch = 0;
-        break;
-      case KEY_DOWN:
-        if (direction != UP) direction = DOWN;
-        *ch = 0;
-        break;
-      default:
-        break;
+  test_fds[0].fd = keys.wakeup_fd;
+  test_fds[0].events = POLLIN;
+  test_fds[1].fd = connection_fd;
+  test_fds[1].events = POLLIN;
+  while (playing) {
+    // Sleep until a key is pressed, the server sends something
+    // or the next frame is due. Once the game is over only keys matter
+    if (poll(test_fds, connected ? 2 : 1,
+             connected ? renderTimeout(&renderer, monotonicMicros()) : -1) == -1) {
+      continue;
     }
-
-    for (int i = 0; i < game->players->player_count; i++) {
-      // Get actual coordinates for current window
-      int new_y = max_y * game->stati[i].coordinates.y_position / game->board->height;
-      int new_x = max_x * game->stati[i].coordinates.x_position / game->board->width;
-      mvprintw(new_y, new_x, "o");
+    if (connected && test_fds[1].revents
+        && !(udp ? updateDatagrams(connection_fd, game, &prediction, &renderer)
+                 : update(&stream, game, &prediction, &renderer))) {
+      connected = 0;
+    }
+    // Over UDP a lost close frame looks like silence
+    if (connected && udp && last_tick > 0 && monotonicMicros() - last_heard > SERVER_TIMEOUT) {
+      connected = 0;
+    }
+    if (!connected && test_fds[1].fd != -1) {
+      test_fds[1].fd = -1;
+      renderMessage(&renderer, "Game over, press q to quit");
+    }
+    if (test_fds[0].revents) {
+      clearKeyWakeup(&keys);
     }
 
-    refresh();
+    // Every key pressed since the last pass, in order
+    while (popKey(&keys, &key)) {
+      turn = direction;
+      switch(key.key) {
+        case KEY_LEFT:
+          if (direction != RIGHT) turn = LEFT;
+          break;
+        case KEY_RIGHT:
+          if (direction != LEFT) turn = RIGHT;
+          break;
+        case KEY_UP:
+          if (direction != DOWN) turn = UP;
+          break;
+        case KEY_DOWN:
+          if (direction != UP) turn = DOWN;
+          break;
+        case 'q':
+          if (!connected) playing = 0;
+          break;
+        default:
+          break;
+      }
+      // Only tell the server about actual turns, each one on its own so
+      // quick double turns are applied on consecutive ticks
+      if (turn != direction && connected && !watching) {
+        sendMove(connection_fd, turn);
+        predictInput(&prediction, turn, key.time);
+      }
+      direction = turn;
+    }
 
-    if (counter % 5 == 0) {
-      update(connection_fd, game, direction);
+    if (connected && !watching && protocol_version >= PROTOCOL_BINARY && monotonicMicros() >= next_ping) {
+      sendPing(connection_fd);
+      next_ping = monotonicMicros() + PING_INTERVAL;
     }
+
+    renderFrame(&renderer, &prediction, monotonicMicros());
   }
   // Close the socket
+  closeRenderer(&renderer);
+  closePrediction(&prediction);
+  closeBaselines(&baselines);
+  closeKeyQueue(&keys);
+  closeStream(&stream);
   close(connection_fd);
+  free_board(game->board);
+  free(game->stati);
+  free(game->players);
   free(game);
-  endwin();
   return EXIT_SUCCESS;
 }
 
@@ -115,31 +229,105 @@ int main(int argc, char * argv[]) {
 */
 void usage(char * program) {
   printf("Usage:\n");
-  printf("\t%s {server_address} {port_number}\n", program);
+  printf("\t%s [-f fps] [-u | -w [-r room]] {server_address} {port_number}\n", program);
+  printf("\t-f: most frames drawn per second (default %d)\n", DEFAULT_FPS);
+  printf("\t-u: play over UDP, the server must be started with -u\n");
+  printf("\t-w: only watch the game that started last, or the one waiting for players\n");
+  printf("\t-r: watch the game of this room instead\n");
   exit(EXIT_FAILURE);
 }
 
 
-void startGame(int connection_fd, game_t * game) {
+void startGame(stream_t * stream, game_t * game) {
   char buffer[BUFFER_SIZE];
+  char * message = NULL;
+  size_t length;
+  int width = 0, height = 0;
 
-  // Prepare the message to the server
-  sprintf(buffer, "%d", GAME);
+  // Prepare the message to the server, offering the newest protocol
+  if (watching) {
+    sprintf(buffer, "%d %d %d %d", GAME, PROTOCOL_VERSION, CONNECTION_SPECTATOR, watched_room);
+  } else {
+    sprintf(buffer, "%d %d", GAME, PROTOCOL_VERSION);
+  }
 
   game->players = malloc(sizeof *game->players);
 
   // SEND
   // Send the request
-  sendString(connection_fd, buffer);
-  if ( !recvString(connection_fd, buffer, BUFFER_SIZE) ) {
-    printf("Server closed the connection\n");
-    return;
+  sendString(stream->fd, buffer);
+  // RECV
+  // The first snapshots may arrive in the same read, they stay in the stream
+  while (streamNextMessage(stream, &message, &length) != 1) {
+    if (streamFill(stream) <= 0) {
+      printf("Server closed the connection\n");
+      exit(EXIT_FAILURE);
+    }
   }
-  game->board = malloc(sizeof(board_t));
-  sscanf(buffer, "%d,%d,%d",
+  // Servers that don't send a version only speak text,
+  // older ones don't send the player number or the tick period
+  sscanf(message, "%d,%d,%d,%d,%d,%lld",
     &game->players->player_count,
-    &game->board->width,
-    &game->board->height);
+    &width,
+    &height,
+    &protocol_version,
+    &player_number,
+    &tick_period);
+  if (protocol_version >= PROTOCOL_BINARY) {
+    setStreamFraming(stream, FRAME_LENGTH_PREFIXED, HEADER_SIZE, 8, HEADER_SIZE + MAX_PAYLOAD);
+  }
+  initGameState(game, width, height);
+}
+
+/*
+    Send connect frames to the UDP port of the server until it answers with
+    the settings of the game and the port of the room, which the socket
+    talks to from then on
+*/
+void startDatagramGame(int connection_fd, char * address, game_t * game) {
+  unsigned char connect[HEADER_SIZE];
+  struct pollfd test_fds[1];
+  frame_header_t header;
+  accept_t accept;
+  int accepted = 0;
+
+  encodeEmpty(MSG_CONNECT, connect);
+  test_fds[0].fd = connection_fd;
+  test_fds[0].events = POLLIN;
+  for (int attempt = 0; attempt < CONNECT_ATTEMPTS && !accepted; attempt++) {
+    sendDatagram(connection_fd, connect, sizeof(connect));
+    if (poll(test_fds, 1, CONNECT_RETRY) <= 0) {
+      continue;
+    }
+    for (int i = 0; i < receiveDatagrams(connection_fd, &datagrams) && !accepted; i++) {
+      accepted = decodeHeader(datagrams.buffers[i], datagrams.messages[i].msg_len, &header) == 1
+        && header.type == MSG_ACCEPT
+        && decodeAccept(datagrams.buffers[i] + HEADER_SIZE, header.payload_length, &accept);
+    }
+  }
+  if (!accepted) {
+    printf("Server did not answer over UDP\n");
+    exit(EXIT_FAILURE);
+  }
+
+  redirectUdpSocket(connection_fd, address, accept.port);
+  protocol_version = PROTOCOL_DELTA;
+  player_number = accept.player_number;
+  tick_period = accept.tick_period;
+  last_heard = monotonicMicros();
+  game->players = malloc(sizeof *game->players);
+  game->players->player_count = accept.player_count;
+  initGameState(game, accept.width, accept.height);
+}
+
+/*
+    Prepare the board and the players once the size of the game is known
+*/
+void initGameState(game_t * game, int width, int height) {
+  // The trails seen so far, drawn by the renderer
+  game->board = create_board(width, height);
+  enable_owners(game->board);
+  initBaselines(&baselines, game->players->player_count, width, height);
   // Initialize player stati
   game->stati = malloc(game->players->player_count * sizeof(*game->stati));
   for(int i = 0; i < game->players->player_count; i++) {
@@ -148,28 +336,219 @@ void startGame(int connection_fd, game_t * game) {
   }
 }
 
-void update(int connection_fd, game_t * game, direction_t move) {
+/*
+    Tell the server the new direction of the player
+*/
+void sendMove(int connection_fd, direction_t move) {
   char buffer[BUFFER_SIZE];
-  // Prepare the message to the server
-  sprintf(buffer, "%d", move);
 
-  // SEND
-  // Send the request
-  sendString(connection_fd, buffer);
+  if (udp) {
+    // Too many moves lost in a row, the oldest one is given up
+    if (unacked_count == INPUT_REDUNDANCY) {
+      memmove(unacked, unacked + 1, (INPUT_REDUNDANCY - 1) * sizeof(*unacked));
+      first_unacked++;
+      unacked_count--;
+    }
+    unacked[unacked_count++] = move;
+    sendInputs(connection_fd);
+  } else if (protocol_version >= PROTOCOL_BINARY) {
+    sendBuffer(connection_fd, buffer, encodeInput(move, last_tick, (unsigned char *)buffer));
+  } else {
+    sprintf(buffer, "%d", move);
+    sendString(connection_fd, buffer);
+  }
+}
 
-  // RECV
-  // Receive the response
-  if ( !recvString(connection_fd, buffer, BUFFER_SIZE) ) {
-    printf("Server closed the connection\n");
+/*
+    Send every move the server has not acknowledged yet in one datagram
+*/
+void sendInputs(int connection_fd) {
+  unsigned char buffer[MAX_INPUTS_FRAME];
+
+  sendDatagram(connection_fd, buffer,
+    encodeInputs(first_unacked, unacked, unacked_count, last_tick, buffer));
+}
+
+/*
+    Ask the server to echo the current time, to measure the round trip
+*/
+void sendPing(int connection_fd) {
+  unsigned char buffer[MAX_CLIENT_FRAME];
+
+  if (udp) {
+    sendDatagram(connection_fd, buffer, encodePing(monotonicMicros(), buffer));
+  } else {
+    sendBuffer(connection_fd, buffer, encodePing(monotonicMicros(), buffer));
+  }
+}
+
+/*
+    Read every snapshot the server sent since the last call without blocking
+    The server sends one per tick, they are applied in order and each one
+    adds its cells to the trails
+    Returns 0 if the server closed the connection
+*/
+int update(stream_t * stream, game_t * game, prediction_t * prediction, renderer_t * renderer) {
+  struct pollfd test_fds[1];
+  frame_header_t header;
+  char * message;
+  size_t length;
+
+  test_fds[0].fd = stream->fd;
+  test_fds[0].events = POLLIN;
+  while (poll(test_fds, 1, 0) > 0 && (test_fds[0].revents & (POLLIN | POLLHUP))) {
+    // RECV
+    // One read may bring several snapshots, or only part of one
+    if (streamFill(stream) <= 0) {
+      return 0;
+    }
+    while (streamNextMessage(stream, &message, &length) == 1) {
+      if (protocol_version == PROTOCOL_TEXT) {
+        decompressGame(message, game);
+      } else if (decodeHeader((unsigned char *)message, length, &header) != 1) {
+        continue;
+      } else if (header.type == MSG_PONG) {
+        predictRoundTrip(prediction, monotonicMicros() - (long long)decodePing((unsigned char *)message + HEADER_SIZE));
+        continue;
+      } else if (header.type == MSG_SNAPSHOT) {
+        decodeSnapshot((unsigned char *)message + HEADER_SIZE, header.payload_length, game);
+        applySnapshot(game, prediction, renderer, header.tick);
+        continue;
+      } else if (header.type == MSG_DELTA) {
+        applyDeltaFrame(game, prediction, renderer, (unsigned char *)message + HEADER_SIZE,
+          header.payload_length, header.tick);
+        continue;
+      } else if (header.type == MSG_VIEW) {
+        applyView(game, prediction, renderer, (unsigned char *)message + HEADER_SIZE,
+          header.payload_length, header.tick);
+        continue;
+      } else {
+        continue;
+      }
+      applySnapshot(game, prediction, renderer, last_tick + 1);
+    }
+  }
+  return 1;
+}
+
+/*
+    Read every datagram the server sent since the last call without blocking
+    Snapshots may be lost, repeated or reordered: only the ones newer than
+    the last one shown are used. After every snapshot the client answers
+    with the moves still not acknowledged and the last step it has, which
+    the server takes as the baseline of the next deltas
+    Returns 0 if the server said the game is over
+*/
+int updateDatagrams(int connection_fd, game_t * game, prediction_t * prediction, renderer_t * renderer) {
+  frame_header_t header;
+  unsigned char * datagram;
+  uint32_t ack;
+  int received;
+  int snapshots = 0;
+
+  while ((received = receiveDatagrams(connection_fd, &datagrams)) > 0) {
+    for (int i = 0; i < received; i++) {
+      datagram = datagrams.buffers[i];
+      if (decodeHeader(datagram, datagrams.messages[i].msg_len, &header) != 1
+          || header.payload_length != datagrams.messages[i].msg_len - HEADER_SIZE) {
+        continue;
+      }
+      last_heard = monotonicMicros();
+      if (header.type == MSG_CLOSE) {
+        return 0;
+      } else if (header.type == MSG_PONG) {
+        predictRoundTrip(prediction, monotonicMicros() - (long long)decodePing(datagram + HEADER_SIZE));
+      } else if ((header.type == MSG_SNAPSHOT || header.type == MSG_DELTA || header.type == MSG_VIEW)
+                 && (header.flags & FLAG_INPUT_ACK)
+                 && header.payload_length >= INPUT_ACK_SIZE
+                 && (last_tick == 0 || (int32_t)(header.tick - last_tick) > 0)) {
+        // Forget the moves the server has
+        ack = decodeSnapshotAck(datagram + HEADER_SIZE);
+        while (unacked_count > 0 && (int32_t)(ack - first_unacked) >= 0) {
+          memmove(unacked, unacked + 1, (unacked_count - 1) * sizeof(*unacked));
+          first_unacked++;
+          unacked_count--;
+        }
+        if (header.type == MSG_SNAPSHOT) {
+          decodeSnapshot(datagram + HEADER_SIZE + INPUT_ACK_SIZE, header.payload_length - INPUT_ACK_SIZE, game);
+          applySnapshot(game, prediction, renderer, header.tick);
+        } else if (header.type == MSG_VIEW) {
+          applyView(game, prediction, renderer, datagram + HEADER_SIZE + INPUT_ACK_SIZE,
+            header.payload_length - INPUT_ACK_SIZE, header.tick);
+        } else {
+          applyDeltaFrame(game, prediction, renderer, datagram + HEADER_SIZE + INPUT_ACK_SIZE,
+            header.payload_length - INPUT_ACK_SIZE, header.tick);
+        }
+        snapshots++;
+      }
+    }
+  }
+  if (snapshots > 0) {
+    sendInputs(connection_fd);
+  }
+  return 1;
+}
+
+/*
+    Show a snapshot of the given tick that was just decoded into game
+    and keep it as a baseline
+*/
+void applySnapshot(game_t * game, prediction_t * prediction, renderer_t * renderer, uint32_t tick) {
+  int ticks = last_tick == 0 ? 1 : (int)(tick - last_tick);
+
+  last_tick = tick;
+  storeBaseline(&baselines, tick, game->stati);
+  predictSnapshot(prediction, game->stati, monotonicMicros());
+  renderSnapshot(renderer, game, ticks);
+}
+
+/*
+    Replay a delta from its baseline and show every step up to tick, so the
+    trails have no gaps even when some deltas were lost
+    A delta from a baseline that is not kept is skipped, the server sends
+    a keyframe once the baselines it knows of are too old
+*/
+void applyDeltaFrame(game_t * game, prediction_t * prediction, renderer_t * renderer,
+                     const unsigned char * payload, size_t length, uint32_t tick) {
+  int steps = applyDelta(&baselines, payload, length, tick);
+
+  if (steps <= 0) {
     return;
   }
-  decompressGame(buffer, game);
+  for (uint32_t step = tick - steps + 1; step != tick + 1; step++) {
+    memcpy(game->stati, findBaseline(&baselines, step), game->players->player_count * sizeof(*game->stati));
+    renderSnapshot(renderer, game, 1);
+  }
+  last_tick = tick;
+  predictSnapshot(prediction, game->stati, monotonicMicros());
+}
+
+/*
+    Show the players in view at tick, the others are hidden until they come
+    back in view. The minimap, when there is one, marks where they are
+*/
+void applyView(game_t * game, prediction_t * prediction, renderer_t * renderer,
+               const unsigned char * payload, size_t length, uint32_t tick) {
+  const unsigned char * minimap;
+  int columns, rows;
+
+  if (decodeView(payload, length, game, &minimap, &columns, &rows) == -1) {
+    return;
+  }
+  applySnapshot(game, prediction, renderer, tick);
+  if (minimap != NULL) {
+    renderMinimap(renderer, minimap, columns, rows);
+  }
 }
 
 void * threadEntry (void * arg) {
-  int * ch = arg;
+  key_queue_t * keys = arg;
+  int key;
   while (1) {
-    *ch = getch();
+    key = getch();
+    if (key != ERR) {
+      pushKey(keys, key, monotonicMicros());
+    }
   }
   pthread_exit(NULL);
 }
@@ -0,0 +1,158 @@
+/*
+ * Delta snapshots.
+ *
+ * See delta.h for how the server and the client use them.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+
+void initDeltaHistory(delta_history_t * history, int player_count) {
+  memset(history, 0, sizeof(*history));
+  history->player_count = player_count;
+  history->previous = calloc(player_count, sizeof(*history->previous));
+  // A player turns and is eliminated at most once per step
+  for (int i = 0; i < DELTA_HISTORY; i++) {
+    history->steps[i].events = malloc(player_count * sizeof(*history->steps[i].events));
+  }
+  history->scratch = malloc((size_t)DELTA_HISTORY * player_count * sizeof(*history->scratch));
+}
+
+void closeDeltaHistory(delta_history_t * history) {
+  for (int i = 0; i < DELTA_HISTORY; i++) {
+    free(history->steps[i].events);
+  }
+  free(history->previous);
+  free(history->scratch);
+}
+
+void startDeltaHistory(delta_history_t * history, const player_status_t * stati) {
+  memcpy(history->previous, stati, history->player_count * sizeof(*stati));
+}
+
+void recordDeltaStep(delta_history_t * history, uint32_t tick, const player_status_t * stati) {
+  delta_step_t * step = &history->steps[tick % DELTA_HISTORY];
+  uint8_t flags;
+
+  step->tick = tick;
+  step->event_count = 0;
+  for (int i = 0; i < history->player_count; i++) {
+    flags = stati[i].current_direction & EVENT_DIRECTION_MASK;
+    if (stati[i].current_direction != history->previous[i].current_direction) {
+      flags |= EVENT_TURN;
+    }
+    if (history->previous[i].status && !stati[i].status) {
+      flags |= EVENT_ELIMINATED;
+    }
+    if (flags & (EVENT_TURN | EVENT_ELIMINATED)) {
+      step->events[step->event_count++] = (delta_event_t){0, i, flags};
+    }
+  }
+  memcpy(history->previous, stati, history->player_count * sizeof(*stati));
+}
+
+shared_buffer_t * createDelta(delta_history_t * history, uint32_t baseline, uint32_t tick, size_t max_size) {
+  shared_buffer_t * buffer;
+  delta_step_t * step;
+  int event_count = 0;
+
+  if (baseline == 0 || baseline >= tick || tick - baseline >= DELTA_HISTORY) {
+    return NULL;
+  }
+  for (uint32_t t = baseline + 1; t <= tick; t++) {
+    step = &history->steps[t % DELTA_HISTORY];
+    if (step->tick != t) {
+      return NULL;
+    }
+    for (int i = 0; i < step->event_count; i++) {
+      history->scratch[event_count] = step->events[i];
+      history->scratch[event_count].offset = t - baseline;
+      event_count++;
+    }
+  }
+  if (deltaFrameSize(event_count) > max_size) {
+    return NULL;
+  }
+  buffer = createSharedBuffer(deltaFrameSize(event_count));
+  encodeDelta(baseline, tick, history->scratch, event_count, (unsigned char *)buffer->data, buffer->length);
+  return buffer;
+}
+
+void initBaselines(baseline_ring_t * ring, int player_count, int width, int height) {
+  memset(ring, 0, sizeof(*ring));
+  ring->player_count = player_count;
+  ring->width = width;
+  ring->height = height;
+  ring->states = calloc((size_t)DELTA_HISTORY * player_count, sizeof(*ring->states));
+  ring->scratch = malloc((size_t)DELTA_HISTORY * player_count * sizeof(*ring->scratch));
+}
+
+void closeBaselines(baseline_ring_t * ring) {
+  free(ring->states);
+  free(ring->scratch);
+}
+
+// Slot of a step in the ring
+static player_status_t * baselineSlot(baseline_ring_t * ring, uint32_t tick) {
+  return ring->states + (size_t)(tick % DELTA_HISTORY) * ring->player_count;
+}
+
+void storeBaseline(baseline_ring_t * ring, uint32_t tick, const player_status_t * stati) {
+  ring->ticks[tick % DELTA_HISTORY] = tick;
+  memcpy(baselineSlot(ring, tick), stati, ring->player_count * sizeof(*stati));
+}
+
+player_status_t * findBaseline(baseline_ring_t * ring, uint32_t tick) {
+  if (tick == 0 || ring->ticks[tick % DELTA_HISTORY] != tick) {
+    return NULL;
+  }
+  return baselineSlot(ring, tick);
+}
+
+int applyDelta(baseline_ring_t * ring, const unsigned char * payload, size_t length, uint32_t tick) {
+  player_status_t * state;
+  player_status_t * next;
+  uint32_t baseline;
+  int event_count;
+  int event = 0;
+
+  event_count = decodeDelta(payload, length, &baseline, ring->scratch, DELTA_HISTORY * ring->player_count);
+  if (event_count == -1 || baseline >= tick || tick - baseline >= DELTA_HISTORY) {
+    return -1;
+  }
+  for (int i = 0; i < event_count; i++) {
+    if (ring->scratch[i].player >= ring->player_count || ring->scratch[i].offset == 0
+        || ring->scratch[i].offset > tick - baseline
+        || (i > 0 && ring->scratch[i].offset < ring->scratch[i - 1].offset)) {
+      return -1;
+    }
+  }
+  if ((state = findBaseline(ring, baseline)) == NULL) {
+    return 0;
+  }
+
+  for (uint32_t t = baseline + 1; t <= tick; t++) {
+    next = baselineSlot(ring, t);
+    memcpy(next, state, ring->player_count * sizeof(*state));
+    for (; event < event_count && ring->scratch[event].offset == t - baseline; event++) {
+      if (ring->scratch[event].flags & EVENT_TURN) {
+        next[ring->scratch[event].player].current_direction = ring->scratch[event].flags & EVENT_DIRECTION_MASK;
+      }
+    }
+    for (int i = 0; i < ring->player_count; i++) {
+      if (next[i].status) {
+        getNewCoordinates(&next[i], ring->width, ring->height);
+      }
+    }
+    // Eliminations of this step, the events are in the same order as the turns
+    for (int i = event - 1; i >= 0 && ring->scratch[i].offset == t - baseline; i--) {
+      if (ring->scratch[i].flags & EVENT_ELIMINATED) {
+        next[ring->scratch[i].player].status = 0;
+      }
+    }
+    ring->ticks[t % DELTA_HISTORY] = t;
+    state = next;
+  }
+  return tick - baseline;
+}
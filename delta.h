@@ -0,0 +1,93 @@
+/*
+ * Delta snapshots.
+ *
+ * The server remembers the turns and eliminations of the last DELTA_HISTORY
+ * steps, so it can write a delta from any of them to the current step. The
+ * client keeps the state of the players after every step of the same window,
+ * so it can replay the steps from whichever baseline the server picked.
+ * Every step is replayed the way the server simulates it: the turns are
+ * applied, every player still alive moves one cell with getNewCoordinates,
+ * and then the eliminated players stop. A client that falls further behind
+ * than the window gets a keyframe instead.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+#include "protocol.h"
+#include "shared_buffer.h"
+
+// Steps a baseline may be behind the current one
+#define DELTA_HISTORY 64
+
+// Turns and eliminations of one step, the offsets are not used
+typedef struct delta_step_struct {
+  // Step number, 0 while the slot is empty
+  uint32_t tick;
+  int event_count;
+  delta_event_t * events;
+} delta_step_t;
+
+// What the server remembers to write deltas
+typedef struct delta_history_struct {
+  int player_count;
+  // The players after the last step recorded
+  player_status_t * previous;
+  delta_step_t steps[DELTA_HISTORY];
+  // Events gathered for one delta
+  delta_event_t * scratch;
+} delta_history_t;
+
+// States the client can use as baselines
+typedef struct baseline_ring_struct {
+  int player_count;
+  // Size of the board the players move on
+  int width;
+  int height;
+  // Step of every slot, 0 while empty
+  uint32_t ticks[DELTA_HISTORY];
+  // DELTA_HISTORY slots of player_count players
+  player_status_t * states;
+  // Events of the delta being replayed
+  delta_event_t * scratch;
+} baseline_ring_t;
+
+void initDeltaHistory(delta_history_t * history, int player_count);
+
+void closeDeltaHistory(delta_history_t * history);
+
+// Remember the players as placed when the game starts, before the first step
+void startDeltaHistory(delta_history_t * history, const player_status_t * stati);
+
+// Remember what changed in a step, compared to the one before
+void recordDeltaStep(delta_history_t * history, uint32_t tick, const player_status_t * stati);
+
+/*
+    Write the delta frame from baseline to tick into a new shared buffer
+    Returns NULL if the baseline is no longer in the history, or if the
+    frame would be larger than max_size, a keyframe is better then
+*/
+shared_buffer_t * createDelta(delta_history_t * history, uint32_t baseline, uint32_t tick, size_t max_size);
+
+void initBaselines(baseline_ring_t * ring, int player_count, int width, int height);
+
+void closeBaselines(baseline_ring_t * ring);
+
+// Keep the players after a step, from a keyframe or a replayed delta
+void storeBaseline(baseline_ring_t * ring, uint32_t tick, const player_status_t * stati);
+
+// The players after a step, NULL if that step is not kept
+player_status_t * findBaseline(baseline_ring_t * ring, uint32_t tick);
+
+/*
+    Replay a delta payload up to tick, keeping every step in the ring
+    Returns the number of steps replayed, 0 if the baseline is not kept,
+    or -1 if the payload is malformed
+*/
+int applyDelta(baseline_ring_t * ring, const unsigned char * payload, size_t length, uint32_t tick);
+
+#endif
@@ -0,0 +1,139 @@
+/* TRON Multiplayer delta tests.
+ * Plays the server side of the delta snapshots against the client side
+ * without a network: a UDP player stops acknowledging steps while every
+ * player turns on every step, so its baseline falls behind and the deltas
+ * from it grow. Every delta written must fit in a datagram and replay to
+ * the state of the server, and once they don't fit the server must fall
+ * back to a keyframe, from which the deltas fit again.
+ *
+ * Prints every failed check and exits with 1 if there was any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// Custom libraries
+#include "codes.h"
+#include "sockets.h"
+#include "tron_simulation.h"
+#include "protocol.h"
+#include "delta.h"
+
+// The largest game allowed over UDP, see MAX_DATAGRAM
+#define PLAYERS 291
+#define WIDTH 2048
+#define HEIGHT 2048
+// Steps of the burst of turns, the baseline stays at the first one
+#define BURST 40
+
+int checks = 0;
+int failures = 0;
+
+///// FUNCTION DECLARATIONS
+void check(int condition, const char * message, uint32_t tick);
+void stepPlayers(player_status_t * stati, uint32_t tick);
+int sameState(const player_status_t * first, const player_status_t * second);
+
+///// MAIN FUNCTION
+int main() {
+  player_status_t stati[PLAYERS];
+  delta_history_t history;
+  baseline_ring_t baselines;
+  shared_buffer_t * delta;
+  frame_header_t header;
+  size_t datagram_limit = MAX_DATAGRAM - INPUT_ACK_SIZE;
+  uint32_t baseline = 1;
+  uint32_t tick;
+  int too_large = 0;
+
+  // Every player in a row, going right
+  for (int i = 0; i < PLAYERS; i++) {
+    stati[i].player_number = i + 1;
+    stati[i].current_direction = RIGHT;
+    stati[i].status = 1;
+    stati[i].coordinates.x_position = i * 4;
+    stati[i].coordinates.y_position = HEIGHT / 2;
+  }
+  initDeltaHistory(&history, PLAYERS);
+  initBaselines(&baselines, PLAYERS, WIDTH, HEIGHT);
+  startDeltaHistory(&history, stati);
+
+  // The client got the keyframe of step 1 and nothing after it
+  stepPlayers(stati, 1);
+  recordDeltaStep(&history, 1, stati);
+  storeBaseline(&baselines, 1, stati);
+
+  for (tick = 2; tick < 2 + BURST; tick++) {
+    stepPlayers(stati, tick);
+    recordDeltaStep(&history, tick, stati);
+
+    delta = createDelta(&history, baseline, tick, datagram_limit);
+    if (delta == NULL) {
+      too_large = 1;
+      // Only because it didn't fit, the baseline is still in the history
+      check(createDelta(&history, baseline, tick, (size_t)-1) != NULL,
+        "the delta is refused for something else than its size", tick);
+      // The keyframe of this step becomes the baseline
+      check(snapshotFrameSize(PLAYERS) + INPUT_ACK_SIZE <= MAX_DATAGRAM, "the keyframe doesn't fit", tick);
+      storeBaseline(&baselines, tick, stati);
+      baseline = tick;
+      continue;
+    }
+    check(delta->length <= datagram_limit, "the delta doesn't fit in a datagram", tick);
+    check(decodeHeader((unsigned char *)delta->data, delta->length, &header) == 1
+      && header.type == MSG_DELTA && header.payload_length == delta->length - HEADER_SIZE,
+      "the delta has a wrong header", tick);
+    check(applyDelta(&baselines, (unsigned char *)delta->data + HEADER_SIZE, header.payload_length, tick)
+      == (int)(tick - baseline), "the delta doesn't replay every step", tick);
+    check(findBaseline(&baselines, tick) != NULL && sameState(findBaseline(&baselines, tick), stati),
+      "the replayed players differ from the server", tick);
+    releaseSharedBuffer(delta);
+  }
+  check(too_large, "the burst never made a delta too large for a datagram", tick);
+  check(baseline > 1, "the client never got a keyframe", tick);
+
+  // Deltas are never larger than the keyframe they replace, over TCP either
+  delta = createDelta(&history, tick - DELTA_HISTORY / 2, tick - 1, snapshotFrameSize(PLAYERS));
+  check(delta == NULL || delta->length <= snapshotFrameSize(PLAYERS), "the delta is larger than a keyframe", tick);
+  if (delta != NULL) {
+    releaseSharedBuffer(delta);
+  }
+
+  closeBaselines(&baselines);
+  closeDeltaHistory(&history);
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+///// FUNCTION DEFINITIONS
+
+void check(int condition, const char * message, uint32_t tick) {
+  checks++;
+  if (!condition) {
+    failures++;
+    printf("FAILED at step %u: %s\n", tick, message);
+  }
+}
+
+/*
+    Turn every player, alternating up and right, and move them one cell
+    the way the client replays a step
+*/
+void stepPlayers(player_status_t * stati, uint32_t tick) {
+  for (int i = 0; i < PLAYERS; i++) {
+    stati[i].current_direction = tick % 2 ? RIGHT : UP;
+    getNewCoordinates(&stati[i], WIDTH, HEIGHT);
+  }
+}
+
+int sameState(const player_status_t * first, const player_status_t * second) {
+  for (int i = 0; i < PLAYERS; i++) {
+    if (first[i].coordinates.x_position != second[i].coordinates.x_position
+        || first[i].coordinates.y_position != second[i].coordinates.y_position
+        || first[i].current_direction != second[i].current_direction
+        || first[i].status != second[i].status) {
+      return 0;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,76 @@
+/*
+ * Steps of a game published for other threads.
+ * See game_frame.h for how the frames are shared without locks.
+ */
+#include <stdlib.h>
+
+#include "game_frame.h"
+#include "fatal_error.h"
+
+void initFramePublisher(frame_publisher_t * publisher, int player_count) {
+  publisher->published = NULL;
+  publisher->frames = NULL;
+  publisher->frame_count = 0;
+  publisher->player_count = player_count;
+}
+
+void closeFramePublisher(frame_publisher_t * publisher) {
+  for (int i = 0; i < publisher->frame_count; i++) {
+    free(publisher->frames[i]);
+  }
+  free(publisher->frames);
+  publisher->frames = NULL;
+  publisher->frame_count = 0;
+  publisher->published = NULL;
+}
+
+// A frame no reader holds, to write the next step into
+game_frame_t * beginFrame(frame_publisher_t * publisher) {
+  game_frame_t * published = __atomic_load_n(&publisher->published, __ATOMIC_SEQ_CST);
+  game_frame_t * frame;
+
+  for (int i = 0; i < publisher->frame_count; i++) {
+    frame = publisher->frames[i];
+    if (frame != published && __atomic_load_n(&frame->readers, __ATOMIC_SEQ_CST) == 0) {
+      return frame;
+    }
+  }
+  // Every frame is held, there are never more than one per reader plus one
+  frame = calloc(1, sizeof(*frame) + publisher->player_count * sizeof(*frame->stati));
+  publisher->frames = realloc(publisher->frames, (publisher->frame_count + 1) * sizeof(*publisher->frames));
+  if (frame == NULL || publisher->frames == NULL) {
+    fatalError("ERROR: allocating a frame");
+  }
+  frame->player_count = publisher->player_count;
+  publisher->frames[publisher->frame_count++] = frame;
+  return frame;
+}
+
+// Make a frame from beginFrame the one readers get
+void publishFrame(frame_publisher_t * publisher, game_frame_t * frame) {
+  __atomic_store_n(&publisher->published, frame, __ATOMIC_SEQ_CST);
+}
+
+// Take the frame published last, from any thread
+game_frame_t * acquireFrame(frame_publisher_t * publisher) {
+  game_frame_t * frame;
+
+  while (1) {
+    frame = __atomic_load_n(&publisher->published, __ATOMIC_SEQ_CST);
+    if (frame == NULL) {
+      return NULL;
+    }
+    __atomic_add_fetch(&frame->readers, 1, __ATOMIC_SEQ_CST);
+    // Still published after the mark, so the room will see the mark
+    // before it reuses the frame
+    if (__atomic_load_n(&publisher->published, __ATOMIC_SEQ_CST) == frame) {
+      return frame;
+    }
+    __atomic_sub_fetch(&frame->readers, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Let the room reuse a frame from acquireFrame
+void releaseFrame(game_frame_t * frame) {
+  __atomic_sub_fetch(&frame->readers, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,66 @@
+/*
+ * Steps of a game published for other threads.
+ *
+ * The room simulates into its own state and, once a step is complete,
+ * copies it into a frame that no reader holds and publishes it by swapping
+ * a single pointer. A reader takes the frame published last and keeps it
+ * consistent for as long as it holds it, without locking the room: frames
+ * are only reused once no reader holds them, and the room never waits for
+ * a reader, it makes one more frame instead.
+ *
+ * A reader marks the frame it is about to read and then checks it is still
+ * the published one. The room unpublishes a frame before checking its
+ * readers, so either the room sees the mark or the reader sees the frame
+ * was replaced and tries again.
+ */
+
+#ifndef GAME_FRAME_H
+#define GAME_FRAME_H
+
+#include <stdint.h>
+
+#include "tron_simulation.h"
+
+typedef struct game_frame_struct {
+  // Readers holding the frame, the room only reuses it at 0
+  int readers;
+  // Steps simulated when the frame was published
+  uint32_t step;
+  int connected_players;
+  int players_ready;
+  // Set once the game is over, the frame shows the last step
+  int finished;
+  int player_count;
+  player_status_t stati[];
+} game_frame_t;
+
+typedef struct frame_publisher_struct {
+  // The last frame published, NULL until the first one
+  game_frame_t * published;
+  // Every frame made, only the room looks at these
+  game_frame_t ** frames;
+  int frame_count;
+  int player_count;
+} frame_publisher_t;
+
+void initFramePublisher(frame_publisher_t * publisher, int player_count);
+
+// Free every frame, no reader may be holding one
+void closeFramePublisher(frame_publisher_t * publisher);
+
+// A frame no reader holds, to write the next step into
+game_frame_t * beginFrame(frame_publisher_t * publisher);
+
+// Make a frame from beginFrame the one readers get
+void publishFrame(frame_publisher_t * publisher, game_frame_t * frame);
+
+/*
+    Take the frame published last, from any thread
+    Returns NULL if no frame was published yet
+*/
+game_frame_t * acquireFrame(frame_publisher_t * publisher);
+
+// Let the room reuse a frame from acquireFrame
+void releaseFrame(game_frame_t * frame);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Append-only binary log of a game, enough to play it again exactly.
+ *
+ * See input_log.h for the layout of the file.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "input_log.h"
+
+static const char log_magic[4] = {'T', 'L', 'O', 'G'};
+
+// Store integers in network byte order one byte at a time
+static void putUint(unsigned char * buffer, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    buffer[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+static uint64_t getUint(const unsigned char * buffer, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = value << 8 | buffer[i];
+  }
+  return value;
+}
+
+int openInputLog(input_log_t * log, const char * path, game_t * game, uint64_t seed) {
+  unsigned char header[LOG_HEADER_SIZE];
+
+  memset(log, 0, sizeof(*log));
+  log->file = fopen(path, "wb");
+  if (log->file == NULL) {
+    return 0;
+  }
+  memcpy(header, log_magic, sizeof(log_magic));
+  header[4] = INPUT_LOG_VERSION;
+  header[5] = 0;
+  putUint(header + 6, game->players->player_count, 2);
+  putUint(header + 8, game->board->width, 2);
+  putUint(header + 10, game->board->height, 2);
+  putUint(header + 12, game->speed, 4);
+  putUint(header + 16, seed, 8);
+  fwrite(header, 1, sizeof(header), log->file);
+
+  // Room for one move of every player
+  log->capacity = game->players->player_count < LOG_MAX_INPUTS ? game->players->player_count : LOG_MAX_INPUTS;
+  log->inputs = malloc(LOG_RECORD_SIZE + log->capacity * LOG_INPUT_SIZE);
+  return 1;
+}
+
+void logInput(input_log_t * log, int player_number, direction_t direction) {
+  unsigned char * input;
+
+  if (log->file == NULL) {
+    return;
+  }
+  // A frame can't hold more moves, close it early
+  if (log->input_count == log->capacity) {
+    logFrame(log);
+    log->frame--;
+  }
+  input = log->inputs + LOG_RECORD_SIZE + log->input_count * LOG_INPUT_SIZE;
+  putUint(input, player_number, 2);
+  input[2] = direction;
+  log->input_count++;
+}
+
+void logFrame(input_log_t * log) {
+  if (log->file == NULL) {
+    return;
+  }
+  if (log->input_count > 0) {
+    putUint(log->inputs, log->frame, 4);
+    log->inputs[4] = log->input_count;
+    fwrite(log->inputs, 1, LOG_RECORD_SIZE + log->input_count * LOG_INPUT_SIZE, log->file);
+    log->input_count = 0;
+  }
+  log->frame++;
+}
+
+void closeInputLog(input_log_t * log, board_t * board) {
+  unsigned char end[LOG_RECORD_SIZE + 8];
+
+  if (log->file == NULL) {
+    return;
+  }
+  putUint(end, log->frame, 4);
+  end[4] = LOG_END;
+  putUint(end + 5, board_checksum(board), 8);
+  fwrite(end, 1, sizeof(end), log->file);
+  fclose(log->file);
+  free(log->inputs);
+  log->file = NULL;
+}
+
+int readLogHeader(const unsigned char * buffer, size_t length, log_header_t * header) {
+  if (length < LOG_HEADER_SIZE || memcmp(buffer, log_magic, sizeof(log_magic)) != 0
+      || buffer[4] != INPUT_LOG_VERSION) {
+    return 0;
+  }
+  header->player_count = getUint(buffer + 6, 2);
+  header->width = getUint(buffer + 8, 2);
+  header->height = getUint(buffer + 10, 2);
+  header->speed = getUint(buffer + 12, 4);
+  header->seed = getUint(buffer + 16, 8);
+  return header->player_count > 0 && header->width > 0 && header->height > 0;
+}
+
+int readLogRecord(const unsigned char * buffer, size_t length, size_t * offset, log_record_t * record) {
+  const unsigned char * start = buffer + *offset;
+  size_t size;
+
+  if (length - *offset < LOG_RECORD_SIZE) {
+    return 0;
+  }
+  record->frame = getUint(start, 4);
+  record->end = start[4] == LOG_END;
+  record->input_count = record->end ? 0 : start[4];
+  record->inputs = start + LOG_RECORD_SIZE;
+  size = LOG_RECORD_SIZE + (record->end ? 8 : record->input_count * LOG_INPUT_SIZE);
+  if (length - *offset < size) {
+    return 0;
+  }
+  record->checksum = record->end ? getUint(start + LOG_RECORD_SIZE, 8) : 0;
+  *offset += size;
+  return 1;
+}
+
+void getLogInput(const log_record_t * record, int index, int * player_number, direction_t * direction) {
+  const unsigned char * input = record->inputs + index * LOG_INPUT_SIZE;
+
+  *player_number = getUint(input, 2);
+  *direction = input[2];
+}
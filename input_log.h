@@ -0,0 +1,106 @@
+/*
+ * Append-only binary log of a game, enough to play it again exactly.
+ *
+ * The simulation only depends on the seed of the game and on the moves
+ * applied before every tick, so that is all the log keeps. All fields are in
+ * network byte order.
+ *
+ * Header (24 bytes):
+ *   char[4] magic         "TLOG"
+ *   uint8   version       INPUT_LOG_VERSION
+ *   uint8   reserved      0
+ *   uint16  player count
+ *   uint16  board width
+ *   uint16  board height
+ *   uint32  time between ticks in us
+ *   uint64  seed of the game
+ *
+ * Then one record for every frame where some player turned:
+ *   uint32  frame          simulation steps done before this one
+ *   uint8   input count
+ *   input count times: uint16 player number, uint8 direction
+ *
+ * And a last record once the game is over:
+ *   uint32  frame          simulation steps done in the whole game
+ *   uint8   LOG_END
+ *   uint64  checksum of the final board (see board_checksum)
+ */
+
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+
+#define INPUT_LOG_VERSION 3
+#define LOG_HEADER_SIZE 24
+#define LOG_RECORD_SIZE 5
+#define LOG_INPUT_SIZE 3
+// Input count marking the last record
+#define LOG_END 0xFF
+// Input counts must stay below LOG_END
+#define LOG_MAX_INPUTS 254
+
+// A log being written by a room
+typedef struct input_log_struct {
+  FILE * file;
+  // Simulation steps written so far
+  uint32_t frame;
+  // Moves of the current frame, written by logFrame
+  int input_count;
+  int capacity;
+  unsigned char * inputs;
+} input_log_t;
+
+typedef struct log_header_struct {
+  int player_count;
+  int width;
+  int height;
+  int speed;
+  uint64_t seed;
+} log_header_t;
+
+// A record read back from a log, the arrays point into the log buffer
+typedef struct log_record_struct {
+  uint32_t frame;
+  // Set for the last record, which has a checksum instead of moves
+  int end;
+  uint64_t checksum;
+  int input_count;
+  const unsigned char * inputs;
+} log_record_t;
+
+/*
+    Create the file and write the header of a game started with seed
+    Returns 0 if the file can't be created
+*/
+int openInputLog(input_log_t * log, const char * path, game_t * game, uint64_t seed);
+
+// Record the move applied to a player in the current frame
+void logInput(input_log_t * log, int player_number, direction_t direction);
+
+// Write the moves of the current frame, if any, and go to the next one
+void logFrame(input_log_t * log);
+
+// Write the last record with the checksum of the board and close the file
+void closeInputLog(input_log_t * log, board_t * board);
+
+/*
+    Read the header at the start of a log
+    Returns 0 if it is not a valid log
+*/
+int readLogHeader(const unsigned char * buffer, size_t length, log_header_t * header);
+
+/*
+    Read the record found at offset and move offset past it
+    Returns 1 when a record was read, 0 when the log is truncated
+*/
+int readLogRecord(const unsigned char * buffer, size_t length, size_t * offset, log_record_t * record);
+
+// Player and direction of one of the moves of a record
+void getLogInput(const log_record_t * record, int index, int * player_number, direction_t * direction);
+
+#endif
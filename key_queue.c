@@ -0,0 +1,69 @@
+/*
+ * Lock-free queue of key presses from the keyboard thread to the game loop.
+ *
+ * See key_queue.h for the rules of each side.
+ */
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "key_queue.h"
+#include "fatal_error.h"
+
+void initKeyQueue(key_queue_t * queue) {
+  queue->head = 0;
+  queue->tail = 0;
+  queue->dropped = 0;
+  queue->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->wakeup_fd == -1) {
+    fatalError("ERROR: eventfd");
+  }
+}
+
+void closeKeyQueue(key_queue_t * queue) {
+  close(queue->wakeup_fd);
+}
+
+int pushKey(key_queue_t * queue, int key, long long time) {
+  uint64_t one = 1;
+  uint32_t tail = queue->tail;
+  // The consumer frees slots by moving the head
+  uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+  if (tail - head == KEY_QUEUE_SIZE) {
+    queue->dropped++;
+    return 0;
+  }
+  queue->events[tail & (KEY_QUEUE_SIZE - 1)] = (key_event_t){key, time};
+  // Publish the event before the new tail
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+  // The counter only saturates after 2^64 - 2 keys nobody read
+  if (write(queue->wakeup_fd, &one, sizeof(one)) == -1) {
+    // Already readable, nothing to do
+  }
+  return 1;
+}
+
+int popKey(key_queue_t * queue, key_event_t * event) {
+  uint32_t head = queue->head;
+  uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return 0;
+  }
+  *event = queue->events[head & (KEY_QUEUE_SIZE - 1)];
+  // Give the slot back only after copying the event out
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void clearKeyWakeup(key_queue_t * queue) {
+  uint64_t count;
+
+  // Keys pushed after this read bump the counter again,
+  // so a consumer that reads the queue next never misses one
+  if (read(queue->wakeup_fd, &count, sizeof(count)) == -1) {
+    // Nothing was pending
+  }
+}
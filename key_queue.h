@@ -0,0 +1,58 @@
+/*
+ * Lock-free queue of key presses from the keyboard thread to the game loop.
+ *
+ * There is exactly one producer (the thread blocked in getch) and one
+ * consumer (the game loop), so a ring with a head owned by the consumer and
+ * a tail owned by the producer needs no locks: each side only publishes its
+ * own index, with release stores the other side reads with acquire loads.
+ * Every key also bumps an eventfd, so the game loop can sleep in poll next
+ * to its socket and still wake up the moment a key is pressed.
+ */
+
+#ifndef KEY_QUEUE_H
+#define KEY_QUEUE_H
+
+#include <stdint.h>
+
+// Keys kept until the game loop reads them, a power of 2
+#define KEY_QUEUE_SIZE 64
+
+typedef struct key_event_struct {
+  // Key code returned by getch
+  int key;
+  // Time the key was pressed, in us of the monotonic clock
+  long long time;
+} key_event_t;
+
+typedef struct key_queue_struct {
+  key_event_t events[KEY_QUEUE_SIZE];
+  // Next event to read, only written by the consumer
+  uint32_t head __attribute__((aligned(64)));
+  // Next free slot, only written by the producer
+  uint32_t tail __attribute__((aligned(64)));
+  // Keys lost because the queue was full, only written by the producer
+  uint32_t dropped;
+  // Readable while there may be keys in the queue
+  int wakeup_fd;
+} key_queue_t;
+
+void initKeyQueue(key_queue_t * queue);
+
+void closeKeyQueue(key_queue_t * queue);
+
+/*
+    Producer side: add a key and wake up the consumer
+    Returns 0 if the queue was full and the key was dropped
+*/
+int pushKey(key_queue_t * queue, int key, long long time);
+
+/*
+    Consumer side: take the oldest key
+    Returns 0 if the queue is empty
+*/
+int popKey(key_queue_t * queue, key_event_t * event);
+
+// Consumer side: reset the wakeup before reading the queue
+void clearKeyWakeup(key_queue_t * queue);
+
+#endif
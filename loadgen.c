@@ -0,0 +1,658 @@
+/* TRON Multiplayer load generator.
+ * Headless client that opens many connections to a server and plays with
+ * all of them at once, following random or scripted steering. It speaks the
+ * same handshake and protocol as the real client and reports the round trip
+ * time percentiles, the message rates and the disconnections. Spectators
+ * can be added after the players, to load the fan-out to viewers.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+// Signals library
+#include <errno.h>
+#include <signal.h>
+// Sockets libraries
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+// Custom libraries
+#include "codes.h"
+#include "sockets.h"
+#include "fatal_error.h"
+#include "tron_simulation.h"
+#include "tick_scheduler.h"
+#include "protocol.h"
+#include "delta.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_EVENTS 256
+// Resolution of the steering and ping timers in ms
+#define STEP_TIME 5
+
+///// Structure definitions
+
+typedef enum bot_state {CONNECTING, JOINING, PLAYING, CLOSED} bot_state_t;
+
+typedef enum steering_policy {STRAIGHT, RANDOM, SCRIPTED} policy_t;
+
+// Growable list of latency samples in microseconds
+typedef struct samples_struct {
+  long long * values;
+  int count;
+  int capacity;
+} samples_t;
+
+// One simulated player, or spectator
+typedef struct bot_struct {
+  int id;
+  int watching;
+  stream_t stream;
+  bot_state_t state;
+  int protocol;
+  int player_number;
+  game_t game;
+  // Steps the deltas start from
+  baseline_ring_t baselines;
+  direction_t direction;
+  uint32_t last_tick;
+  // When the next turn and the next ping are due
+  long long next_turn;
+  long long next_ping;
+  int script_position;
+  // Time a turn was sent, until a snapshot shows it applied (0 when none)
+  long long turn_sent;
+  // Round trip of pings and time for a turn to show in a snapshot
+  samples_t rtt;
+  samples_t turn_latency;
+  unsigned long long snapshots;
+} bot_t;
+
+// Options and totals of the whole run
+typedef struct loadgen_struct {
+  char * address;
+  char * port;
+  int bot_count;
+  int spectator_count;
+  int duration;
+  int connect_rate;
+  int turn_time;
+  int ping_time;
+  int text_protocol;
+  int full_snapshots;
+  int all_players;
+  policy_t policy;
+  char * script;
+  unsigned int seed;
+  int epoll_fd;
+  bot_t * bots;
+  int connected;
+  // Counters since the last report and for the whole run
+  unsigned long long window_snapshots;
+  unsigned long long window_spectator_snapshots;
+  unsigned long long window_bytes;
+  unsigned long long window_moves;
+  unsigned long long total_snapshots;
+  unsigned long long total_spectator_snapshots;
+  unsigned long long total_bytes;
+  unsigned long long total_moves;
+  unsigned long long disconnects;
+  unsigned long long connect_failures;
+} loadgen_t;
+
+
+// Global variable to detect when a signal arrived
+int interrupted = 0;
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+void detectInterruption(int signal);
+void parseOptions(loadgen_t * load, int argc, char * argv[]);
+void startBot(loadgen_t * load, bot_t * bot);
+void handleBotEvent(loadgen_t * load, bot_t * bot, unsigned int events);
+int readBot(loadgen_t * load, bot_t * bot);
+void processBotMessage(loadgen_t * load, bot_t * bot, char * message, size_t length);
+void steerBot(loadgen_t * load, bot_t * bot, long long now);
+void sendBotFrame(bot_t * bot, unsigned char * frame, size_t length);
+void closeBot(loadgen_t * load, bot_t * bot, int failed);
+void addSample(samples_t * samples, long long value);
+void reportWindow(loadgen_t * load, double seconds);
+void reportTotals(loadgen_t * load, double seconds);
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[]) {
+  loadgen_t load;
+  struct epoll_event events[MAX_EVENTS];
+  struct sigaction new_action;
+  struct rlimit limit;
+  long long start, now, next_report, next_step;
+  int bot_total;
+  int started = 0;
+  int event_count;
+
+  parseOptions(&load, argc, argv);
+  srand(load.seed);
+
+  // Stop cleanly on Ctrl-C, and survive the server closing sockets
+  sigemptyset(&new_action.sa_mask);
+  new_action.sa_handler = detectInterruption;
+  new_action.sa_flags = 0;
+  sigaction(SIGINT, &new_action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  // Every bot is one file descriptor
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  load.epoll_fd = epoll_create1(0);
+  if (load.epoll_fd == -1) {
+    fatalError("ERROR: epoll_create1");
+  }
+  // The spectators come after the players
+  bot_total = load.bot_count + load.spectator_count;
+  load.bots = calloc(bot_total, sizeof(*load.bots));
+
+  printf("Starting %d bots and %d spectators against %s:%s for %d s\n", load.bot_count,
+    load.spectator_count, load.address, load.port, load.duration);
+  start = monotonicMicros();
+  next_report = start + 1000000;
+  next_step = start;
+
+  while (!interrupted) {
+    now = monotonicMicros();
+    if (now - start >= load.duration * 1000000LL) {
+      break;
+    }
+    // Open the connections at the configured rate
+    while (started < bot_total
+           && started < (now - start) * load.connect_rate / 1000000 + 1) {
+      load.bots[started].id = started;
+      load.bots[started].watching = started >= load.bot_count;
+      startBot(&load, &load.bots[started]);
+      started++;
+    }
+    if (started == bot_total && load.connected == 0) {
+      printf("Every bot is disconnected\n");
+      break;
+    }
+
+    event_count = epoll_wait(load.epoll_fd, events, MAX_EVENTS, STEP_TIME);
+    if (event_count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatalError("ERROR: epoll_wait");
+    }
+    for (int i = 0; i < event_count; i++) {
+      handleBotEvent(&load, events[i].data.ptr, events[i].events);
+    }
+
+    now = monotonicMicros();
+    if (now >= next_step) {
+      for (int i = 0; i < started; i++) {
+        steerBot(&load, &load.bots[i], now);
+      }
+      next_step = now + STEP_TIME * 1000;
+    }
+    if (now >= next_report) {
+      reportWindow(&load, 1.0);
+      next_report += 1000000;
+    }
+  }
+
+  reportTotals(&load, (monotonicMicros() - start) / 1e6);
+  for (int i = 0; i < started; i++) {
+    closeBot(&load, &load.bots[i], 0);
+    free(load.bots[i].rtt.values);
+    free(load.bots[i].turn_latency.values);
+  }
+  free(load.bots);
+  close(load.epoll_fd);
+  return EXIT_SUCCESS;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program) {
+  printf("Usage:\n");
+  printf("\t%s [options] {server_address} {port_number}\n", program);
+  printf("\t-n bots        connections to open (default 100)\n");
+  printf("\t-W spectators  connections that only watch, opened after the bots (default 0)\n");
+  printf("\t-d seconds     duration of the run (default 10)\n");
+  printf("\t-c rate        connections opened per second (default 500)\n");
+  printf("\t-t ms          time between steering decisions (default 200)\n");
+  printf("\t-i ms          time between pings (default 100)\n");
+  printf("\t-p policy      straight, random or script (default random)\n");
+  printf("\t-S moves       moves for the script policy, e.g. URDL (default URDL)\n");
+  printf("\t-s seed        seed for the random policy (default 1)\n");
+  printf("\t-T             use the text protocol (no round trip times)\n");
+  printf("\t-F             ask for full snapshots every tick instead of deltas\n");
+  printf("\t-A             ask for every player, even on boards larger than the view\n");
+  exit(EXIT_FAILURE);
+}
+
+// Signal handler
+void detectInterruption(int signal) {
+  interrupted = 1;
+}
+
+/*
+    Read the options of the command line into the load structure
+*/
+void parseOptions(loadgen_t * load, int argc, char * argv[]) {
+  int option;
+
+  memset(load, 0, sizeof(*load));
+  load->bot_count = 100;
+  load->duration = 10;
+  load->connect_rate = 500;
+  load->turn_time = 200;
+  load->ping_time = 100;
+  load->policy = RANDOM;
+  load->script = "URDL";
+  load->seed = 1;
+
+  while ((option = getopt(argc, argv, "n:W:d:c:t:i:p:S:s:TFA")) != -1) {
+    switch (option) {
+      case 'n': load->bot_count = atoi(optarg); break;
+      case 'W': load->spectator_count = atoi(optarg); break;
+      case 'd': load->duration = atoi(optarg); break;
+      case 'c': load->connect_rate = atoi(optarg); break;
+      case 't': load->turn_time = atoi(optarg); break;
+      case 'i': load->ping_time = atoi(optarg); break;
+      case 'S': load->script = optarg; break;
+      case 's': load->seed = strtoul(optarg, NULL, 10); break;
+      case 'T': load->text_protocol = 1; break;
+      case 'F': load->full_snapshots = 1; break;
+      case 'A': load->all_players = 1; break;
+      case 'p':
+        if (strcmp(optarg, "straight") == 0) {
+          load->policy = STRAIGHT;
+        } else if (strcmp(optarg, "random") == 0) {
+          load->policy = RANDOM;
+        } else if (strcmp(optarg, "script") == 0) {
+          load->policy = SCRIPTED;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || load->bot_count <= 0 || load->spectator_count < 0 || load->connect_rate <= 0
+      || load->turn_time <= 0 || load->ping_time <= 0 || load->script[0] == '\0') {
+    usage(argv[0]);
+  }
+  load->address = argv[optind];
+  load->port = argv[optind + 1];
+}
+
+/*
+    Start a non-blocking connection for a bot
+*/
+void startBot(loadgen_t * load, bot_t * bot) {
+  struct addrinfo hints;
+  struct addrinfo * server_info = NULL;
+  struct epoll_event event;
+  int connection_fd;
+
+  bzero(&hints, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(load->address, load->port, &hints, &server_info) != 0) {
+    fatalError("ERROR: getaddrinfo");
+  }
+  connection_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
+  if (connection_fd == -1) {
+    fatalError("ERROR: socket");
+  }
+  setNonBlocking(connection_fd);
+  setNoDelay(connection_fd);
+  initStream(&bot->stream, connection_fd, BUFFER_SIZE);
+  bot->state = CONNECTING;
+  if (connect(connection_fd, server_info->ai_addr, server_info->ai_addrlen) == -1
+      && errno != EINPROGRESS) {
+    freeaddrinfo(server_info);
+    closeBot(load, bot, 1);
+    return;
+  }
+  freeaddrinfo(server_info);
+
+  // Writable once the connection is established
+  event.events = EPOLLIN | EPOLLOUT;
+  event.data.ptr = bot;
+  if (epoll_ctl(load->epoll_fd, EPOLL_CTL_ADD, connection_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+  load->connected++;
+}
+
+/*
+    React to the socket of a bot being readable, writable or closed
+*/
+void handleBotEvent(loadgen_t * load, bot_t * bot, unsigned int events) {
+  struct epoll_event event;
+  char buffer[BUFFER_SIZE];
+  int error = 0;
+  socklen_t error_size = sizeof error;
+
+  if (bot->state == CLOSED) {
+    return;
+  }
+  if (bot->state == CONNECTING) {
+    getsockopt(bot->stream.fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+    if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+      closeBot(load, bot, 1);
+      return;
+    }
+    // Connected, start the GAME handshake
+    event.events = EPOLLIN;
+    event.data.ptr = bot;
+    epoll_ctl(load->epoll_fd, EPOLL_CTL_MOD, bot->stream.fd, &event);
+    if (bot->watching) {
+      sprintf(buffer, "%d %d %d", GAME, PROTOCOL_VERSION, CONNECTION_SPECTATOR);
+    } else {
+      sprintf(buffer, "%d %d", GAME, load->text_protocol ? PROTOCOL_TEXT
+        : load->full_snapshots ? PROTOCOL_BINARY : load->all_players ? PROTOCOL_DELTA : PROTOCOL_VERSION);
+    }
+    sendBotFrame(bot, (unsigned char *)buffer, strlen(buffer) + 1);
+    bot->state = JOINING;
+    return;
+  }
+  if ((events & EPOLLIN) && !readBot(load, bot)) {
+    closeBot(load, bot, 0);
+    load->disconnects++;
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    closeBot(load, bot, 0);
+    load->disconnects++;
+  }
+}
+
+/*
+    Read and process every complete message of a bot
+    Returns 0 if the connection has finished
+*/
+int readBot(loadgen_t * load, bot_t * bot) {
+  ssize_t chars_read;
+  char * message;
+  size_t length;
+  int result;
+
+  chars_read = streamFill(&bot->stream);
+  if (chars_read == 0 || (chars_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    return 0;
+  }
+  if (chars_read > 0) {
+    load->window_bytes += chars_read;
+  }
+  while ((result = streamNextMessage(&bot->stream, &message, &length)) == 1) {
+    processBotMessage(load, bot, message, length);
+  }
+  return result != -1;
+}
+
+/*
+    Act on one message from the server
+*/
+void processBotMessage(loadgen_t * load, bot_t * bot, char * message, size_t length) {
+  frame_header_t header;
+  player_status_t * self;
+  const unsigned char * minimap;
+  int minimap_columns, minimap_rows;
+  long long now = monotonicMicros();
+  int width = BOARD_WIDTH;
+  int height = BOARD_HEIGHT;
+
+  // The answer to the handshake
+  if (bot->state == JOINING) {
+    bot->protocol = PROTOCOL_TEXT;
+    bot->game.players = malloc(sizeof *bot->game.players);
+    bot->game.players->player_count = 0;
+    sscanf(message, "%d,%d,%d,%d,%d", &bot->game.players->player_count,
+      &width, &height, &bot->protocol, &bot->player_number);
+    bot->game.stati = calloc(bot->game.players->player_count, sizeof(*bot->game.stati));
+    initBaselines(&bot->baselines, bot->game.players->player_count, width, height);
+    if (bot->protocol >= PROTOCOL_BINARY) {
+      setStreamFraming(&bot->stream, FRAME_LENGTH_PREFIXED, HEADER_SIZE, 8, HEADER_SIZE + MAX_PAYLOAD);
+    }
+    bot->direction = -1;
+    bot->state = PLAYING;
+    bot->next_turn = now + (rand() % load->turn_time) * 1000LL;
+    bot->next_ping = now + (rand() % load->ping_time) * 1000LL;
+    return;
+  }
+
+  if (bot->protocol == PROTOCOL_TEXT) {
+    decompressGame(message, &bot->game);
+  } else {
+    if (decodeHeader((unsigned char *)message, length, &header) != 1) {
+      return;
+    }
+    if (header.type == MSG_PONG) {
+      addSample(&bot->rtt, now - (long long)decodePing((unsigned char *)message + HEADER_SIZE));
+      return;
+    }
+    if (header.type == MSG_SNAPSHOT) {
+      decodeSnapshot((unsigned char *)message + HEADER_SIZE, header.payload_length, &bot->game);
+      storeBaseline(&bot->baselines, header.tick, bot->game.stati);
+    } else if (header.type == MSG_DELTA
+               && applyDelta(&bot->baselines, (unsigned char *)message + HEADER_SIZE, header.payload_length,
+                             header.tick) > 0) {
+      memcpy(bot->game.stati, findBaseline(&bot->baselines, header.tick),
+        bot->game.players->player_count * sizeof(*bot->game.stati));
+    } else if (header.type == MSG_VIEW
+               && decodeView((unsigned char *)message + HEADER_SIZE, header.payload_length, &bot->game,
+                             &minimap, &minimap_columns, &minimap_rows) > 0) {
+      // Only the own record matters to the bot
+    } else {
+      return;
+    }
+    bot->last_tick = header.tick;
+  }
+  bot->snapshots++;
+  if (bot->watching) {
+    load->window_spectator_snapshots++;
+  } else {
+    load->window_snapshots++;
+  }
+
+  if (bot->player_number < 1 || bot->player_number > bot->game.players->player_count) {
+    return;
+  }
+  self = &bot->game.stati[bot->player_number - 1];
+  // Follow the direction the server gave us until we turn
+  if (bot->direction == (direction_t)-1) {
+    bot->direction = self->current_direction;
+  }
+  if (bot->turn_sent != 0 && self->current_direction == bot->direction) {
+    addSample(&bot->turn_latency, now - bot->turn_sent);
+    bot->turn_sent = 0;
+  }
+}
+
+/*
+    Turn and ping when their time has come
+*/
+void steerBot(loadgen_t * load, bot_t * bot, long long now) {
+  unsigned char frame[MAX_CLIENT_FRAME];
+  char buffer[BUFFER_SIZE];
+  direction_t turn;
+
+  if (bot->state != PLAYING || bot->watching || bot->direction == (direction_t)-1) {
+    return;
+  }
+
+  if (now >= bot->next_turn) {
+    bot->next_turn = now + load->turn_time * 1000LL;
+    turn = bot->direction;
+    if (load->policy == RANDOM) {
+      // Half the time keep going, otherwise turn left or right
+      if (rand() % 2) {
+        turn = (bot->direction + (rand() % 2 ? 1 : 3)) % 4;
+      }
+    } else if (load->policy == SCRIPTED) {
+      switch (load->script[bot->script_position]) {
+        case 'U': case 'u': turn = UP; break;
+        case 'R': case 'r': turn = RIGHT; break;
+        case 'D': case 'd': turn = DOWN; break;
+        case 'L': case 'l': turn = LEFT; break;
+      }
+      if (load->script[++bot->script_position] == '\0') {
+        bot->script_position = 0;
+      }
+    }
+    // Never turn back onto our own trail
+    if (turn != bot->direction && turn != (bot->direction + 2) % 4) {
+      bot->direction = turn;
+      bot->turn_sent = now;
+      if (bot->protocol >= PROTOCOL_BINARY) {
+        sendBotFrame(bot, frame, encodeInput(turn, bot->last_tick, frame));
+      } else {
+        sprintf(buffer, "%d", turn);
+        sendBotFrame(bot, (unsigned char *)buffer, strlen(buffer) + 1);
+      }
+      load->window_moves++;
+    }
+  }
+
+  if (bot->protocol >= PROTOCOL_BINARY && now >= bot->next_ping) {
+    bot->next_ping = now + load->ping_time * 1000LL;
+    sendBotFrame(bot, frame, encodePing(now, frame));
+  }
+}
+
+/*
+    Queue a message on the stream of a bot and write it
+*/
+void sendBotFrame(bot_t * bot, unsigned char * frame, size_t length) {
+  shared_buffer_t * buffer = createSharedBuffer(length);
+
+  memcpy(buffer->data, frame, length);
+  streamQueue(&bot->stream, buffer);
+  releaseSharedBuffer(buffer);
+  // The frames are tiny, anything the socket can't take waits for the next one
+  streamFlush(&bot->stream);
+}
+
+/*
+    Close the connection of a bot
+*/
+void closeBot(loadgen_t * load, bot_t * bot, int failed) {
+  if (bot->state == CLOSED) {
+    return;
+  }
+  if (failed) {
+    load->connect_failures++;
+  }
+  if (bot->stream.in_data != NULL) {
+    epoll_ctl(load->epoll_fd, EPOLL_CTL_DEL, bot->stream.fd, NULL);
+    close(bot->stream.fd);
+    closeStream(&bot->stream);
+    load->connected--;
+  }
+  if (bot->game.stati != NULL) {
+    closeBaselines(&bot->baselines);
+  }
+  free(bot->game.stati);
+  free(bot->game.players);
+  bot->game.stati = NULL;
+  bot->game.players = NULL;
+  bot->state = CLOSED;
+}
+
+void addSample(samples_t * samples, long long value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+    samples->values = realloc(samples->values, samples->capacity * sizeof(*samples->values));
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compareSamples(const void * a, const void * b) {
+  long long first = *(const long long *)a;
+  long long second = *(const long long *)b;
+  return (first > second) - (first < second);
+}
+
+// Value below which the given fraction of the sorted samples fall
+static long long percentile(long long * sorted, int count, double fraction) {
+  int index = (int)(fraction * (count - 1) + 0.5);
+  return count > 0 ? sorted[index] : 0;
+}
+
+/*
+    Print the rates of the last second
+*/
+void reportWindow(loadgen_t * load, double seconds) {
+  printf("connected %d, snapshots/s %.0f, spectator snapshots/s %.0f, KB/s %.1f, moves/s %.0f, disconnects %llu\n",
+    load->connected, load->window_snapshots / seconds, load->window_spectator_snapshots / seconds,
+    load->window_bytes / seconds / 1024, load->window_moves / seconds, load->disconnects);
+  load->total_snapshots += load->window_snapshots;
+  load->total_spectator_snapshots += load->window_spectator_snapshots;
+  load->total_bytes += load->window_bytes;
+  load->total_moves += load->window_moves;
+  load->window_snapshots = 0;
+  load->window_spectator_snapshots = 0;
+  load->window_bytes = 0;
+  load->window_moves = 0;
+}
+
+/*
+    Print the percentiles of every latency sample
+    and the distribution of the p99 of each connection
+*/
+static void reportLatency(loadgen_t * load, const char * name, size_t offset) {
+  samples_t all = {NULL, 0, 0};
+  samples_t per_bot = {NULL, 0, 0};
+
+  for (int i = 0; i < load->bot_count; i++) {
+    samples_t * samples = (samples_t *)((char *)&load->bots[i] + offset);
+    if (samples->count == 0) {
+      continue;
+    }
+    for (int j = 0; j < samples->count; j++) {
+      addSample(&all, samples->values[j]);
+    }
+    qsort(samples->values, samples->count, sizeof(long long), compareSamples);
+    addSample(&per_bot, percentile(samples->values, samples->count, 0.99));
+  }
+  if (all.count == 0) {
+    printf("%s: no samples\n", name);
+    return;
+  }
+  qsort(all.values, all.count, sizeof(long long), compareSamples);
+  qsort(per_bot.values, per_bot.count, sizeof(long long), compareSamples);
+  printf("%s (us): samples %d p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld\n", name, all.count,
+    percentile(all.values, all.count, 0.5), percentile(all.values, all.count, 0.9),
+    percentile(all.values, all.count, 0.99), percentile(all.values, all.count, 0.999),
+    all.values[all.count - 1]);
+  printf("%s per connection p99 (us): median %lld worst %lld\n", name,
+    percentile(per_bot.values, per_bot.count, 0.5), per_bot.values[per_bot.count - 1]);
+  free(all.values);
+  free(per_bot.values);
+}
+
+/*
+    Print the summary of the whole run
+*/
+void reportTotals(loadgen_t * load, double seconds) {
+  reportWindow(load, 1.0);
+  printf("=== Summary after %.1f s ===\n", seconds);
+  printf("bots %d, spectators %d, connect failures %llu, disconnects %llu\n",
+    load->bot_count, load->spectator_count, load->connect_failures, load->disconnects);
+  printf("snapshots/s %.0f, spectator snapshots/s %.0f, KB/s %.1f, moves/s %.0f\n",
+    load->total_snapshots / seconds, load->total_spectator_snapshots / seconds,
+    load->total_bytes / seconds / 1024, load->total_moves / seconds);
+  reportLatency(load, "round trip", offsetof(bot_t, rtt));
+  reportLatency(load, "turn to snapshot", offsetof(bot_t, turn_latency));
+}
@@ -0,0 +1,221 @@
+/*
+ * Asynchronous log of the server.
+ * See logger.h for how the threads log without locks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "fatal_error.h"
+
+// Room for the lines the drain thread writes at once
+#define LOG_BATCH 65536
+// Longest prefix and suffix added to a line
+#define LINE_EXTRA 32
+// Allowance a line takes from its thread, in us
+#define LINE_COST (1000000LL / LOG_RATE)
+// Time between two reports of dropped lines, in us
+#define DROP_REPORT_INTERVAL 1000000
+
+log_level_t log_level = LEVEL_INFO;
+
+static const char * level_names[] = {"debug", "info", "warning", "error"};
+static const char * level_labels[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+// Every thread that logged something, newest first, never removed
+static log_ring_t * rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring_t * local = NULL;
+
+// Set while the drain thread takes the lines
+static int running = 0;
+static pthread_t drain_thread;
+
+static void * drainLogs(void * arg);
+
+static long long wallMicros() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// The ring of the calling thread, registered the first time
+static log_ring_t * localRing() {
+  if (local == NULL) {
+    local = aligned_alloc(64, sizeof(*local));
+    if (local == NULL) {
+      fatalError("ERROR: aligned_alloc");
+    }
+    memset(local, 0, sizeof(*local));
+    for (int i = 0; i < LEVEL_WARNING; i++) {
+      local->allowance[i] = LOG_BURST * LINE_COST;
+    }
+    pthread_mutex_lock(&rings_lock);
+    local->next = rings;
+    __atomic_store_n(&rings, local, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+  }
+  return local;
+}
+
+/*
+    Write a line with its time and level to buffer, which has room for it
+    Returns the length written
+*/
+static size_t formatLine(char * buffer, size_t capacity, long long time, log_level_t level, const char * text) {
+  time_t seconds = time / 1000000;
+  struct tm local_time;
+  int length;
+
+  localtime_r(&seconds, &local_time);
+  length = snprintf(buffer, capacity, "%02d:%02d:%02d.%03lld %s %s\n",
+    local_time.tm_hour, local_time.tm_min, local_time.tm_sec, time % 1000000 / 1000,
+    level_labels[level], text);
+  return (size_t)length < capacity ? (size_t)length : capacity - 1;
+}
+
+void writeLog(log_level_t level, const char * format, ...) {
+  char text[LOG_LINE];
+  char line[LOG_LINE + LINE_EXTRA];
+  long long now = wallMicros();
+  log_ring_t * ring;
+  log_line_t * record;
+  uint32_t tail;
+  va_list arguments;
+
+  va_start(arguments, format);
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    // Nobody drains the rings, the line is written by the caller
+    vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    formatLine(line, sizeof(line), now, level, text);
+    fputs(line, stdout);
+    return;
+  }
+
+  ring = localRing();
+  // Time since the last line is allowance to log again, up to a burst
+  if (level < LEVEL_WARNING && now > ring->last_line[level]) {
+    ring->allowance[level] += now - ring->last_line[level];
+    if (ring->allowance[level] > LOG_BURST * LINE_COST) {
+      ring->allowance[level] = LOG_BURST * LINE_COST;
+    }
+    ring->last_line[level] = now;
+  }
+
+  tail = ring->tail;
+  if ((level < LEVEL_WARNING && ring->allowance[level] < LINE_COST)
+      || tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+  } else {
+    if (level < LEVEL_WARNING) {
+      ring->allowance[level] -= LINE_COST;
+    }
+    record = &ring->records[tail % LOG_RING_SIZE];
+    record->time = now;
+    record->level = level;
+    vsnprintf(record->text, LOG_LINE, format, arguments);
+    // The drain thread may take the record once it sees the new tail
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+  va_end(arguments);
+}
+
+/*
+    Write the lines of every ring to stream, oldest first
+    Only the lines there at the start are taken, so threads that keep
+    logging can't keep a pass from ending. The lines dropped are reported
+    once a second, and in the last pass
+*/
+static void drainRings(FILE * stream, int last) {
+  static char batch[LOG_BATCH];
+  static long long next_report = 0;
+  log_ring_t * first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  log_ring_t * oldest;
+  log_line_t * record;
+  unsigned long long dropped = 0;
+  long long now;
+  char text[LOG_LINE];
+  size_t length = 0;
+
+  for (log_ring_t * ring = first; ring != NULL; ring = ring->next) {
+    ring->limit = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  }
+  do {
+    oldest = NULL;
+    for (log_ring_t * ring = first; ring != NULL; ring = ring->next) {
+      if (ring->head != ring->limit && (oldest == NULL
+          || ring->records[ring->head % LOG_RING_SIZE].time < oldest->records[oldest->head % LOG_RING_SIZE].time)) {
+        oldest = ring;
+      }
+    }
+    if (length + LOG_LINE + LINE_EXTRA > LOG_BATCH || (oldest == NULL && length > 0)) {
+      fwrite(batch, 1, length, stream);
+      length = 0;
+    }
+    if (oldest != NULL) {
+      record = &oldest->records[oldest->head % LOG_RING_SIZE];
+      length += formatLine(batch + length, LOG_BATCH - length, record->time, record->level, record->text);
+      // The record is copied, the thread may write it again
+      __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+    }
+  } while (oldest != NULL);
+
+  now = wallMicros();
+  if (now >= next_report || last) {
+    for (log_ring_t * ring = first; ring != NULL; ring = ring->next) {
+      dropped -= ring->reported;
+      ring->reported = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      dropped += ring->reported;
+    }
+    if (dropped > 0) {
+      snprintf(text, sizeof(text), "%llu log lines dropped, logged too fast", dropped);
+      formatLine(batch, LOG_BATCH, now, LEVEL_WARNING, text);
+      fputs(batch, stream);
+      next_report = now + DROP_REPORT_INTERVAL;
+    }
+  }
+  fflush(stream);
+}
+
+// Drain the rings until the logger is stopped
+static void * drainLogs(void * arg) {
+  struct timespec interval = {0, LOG_DRAIN_INTERVAL * 1000000L};
+
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    drainRings(stdout, 0);
+    nanosleep(&interval, NULL);
+  }
+  // The lines logged before the stop
+  drainRings(stdout, 1);
+  return NULL;
+}
+
+void startLogger() {
+  const char * level = getenv("TRON_LOG");
+
+  for (int i = LEVEL_DEBUG; level != NULL && i <= LEVEL_ERROR; i++) {
+    if (strcasecmp(level, level_names[i]) == 0) {
+      log_level = i;
+    }
+  }
+  fflush(stdout);
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&drain_thread, NULL, drainLogs, NULL) != 0) {
+    fatalError("ERROR: pthread_create");
+  }
+  // A fatal error from any thread still writes the lines before it
+  atexit(stopLogger);
+}
+
+void stopLogger() {
+  if (__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) {
+    pthread_join(drain_thread, NULL);
+  }
+}
@@ -0,0 +1,93 @@
+/*
+ * Asynchronous log of the server.
+ *
+ * A thread that logs only formats the line into a ring of its own and moves
+ * on: no stdio lock, no system call and no terminal in the way of a step. A
+ * background thread drains the rings every few ms and writes what it found
+ * to stdout in order of time, with one write for many lines. Each ring has
+ * exactly one producer (its thread) and one consumer (the drain thread), so
+ * like the key queue of the client it needs no locks.
+ *
+ * Lines below the level set with TRON_LOG (debug, info, warning or error,
+ * info by default) cost a comparison. Every thread may log LOG_RATE lines
+ * per second of each level, in bursts of up to LOG_BURST, so debug lines
+ * can't crowd out the rest. Lines over that or that find the ring full are
+ * dropped and counted. Warnings and errors are never
+ * rate limited.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+// Lines kept per thread until the drain thread writes them, a power of 2
+#define LOG_RING_SIZE 1024
+// Longest line kept, longer ones are cut
+#define LOG_LINE 232
+// Lines per second and burst allowed to every thread
+#define LOG_RATE 1000
+#define LOG_BURST 200
+// Time between two drains of the rings, in ms
+#define LOG_DRAIN_INTERVAL 10
+
+typedef enum log_level {
+  LEVEL_DEBUG,
+  LEVEL_INFO,
+  LEVEL_WARNING,
+  LEVEL_ERROR
+} log_level_t;
+
+typedef struct log_line_struct {
+  // Wall clock time of the line, in us
+  long long time;
+  log_level_t level;
+  char text[LOG_LINE];
+} log_line_t;
+
+// Lines of one thread, only that thread writes the records and the tail
+typedef struct log_ring_struct {
+  log_line_t records[LOG_RING_SIZE];
+  // Next record to read, only written by the drain thread
+  uint32_t head __attribute__((aligned(64)));
+  // Records available to the drain thread in the pass it is doing
+  uint32_t limit;
+  // Dropped lines already reported
+  unsigned long long reported;
+  // Next free record, only written by the thread logging
+  uint32_t tail __attribute__((aligned(64)));
+  // Lines dropped for the rate or a full ring
+  unsigned long long dropped;
+  // Time the thread may still log for at each rate limited level, and when
+  // it was last updated, in us
+  long long allowance[LEVEL_WARNING];
+  long long last_line[LEVEL_WARNING];
+  struct log_ring_struct * next;
+} log_ring_t;
+
+// Lines below this level are not logged
+extern log_level_t log_level;
+
+/*
+    Log a line in the style of printf, without a trailing newline
+    The arguments are not evaluated for levels that are not logged
+*/
+#define logMessage(level, ...) \
+  do { \
+    if ((level) >= log_level) { \
+      writeLog((level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+void writeLog(log_level_t level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+    Read the level from TRON_LOG and start the drain thread
+    Until then, and after stopLogger, lines are written right away
+*/
+void startLogger();
+
+// Write every line left and stop the drain thread
+void stopLogger();
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Latency histograms and counters of the server.
+ * See metrics.h for how the threads record without locks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "fatal_error.h"
+#include "logger.h"
+
+// Time allowed to a client to send its request, in ms
+#define REQUEST_TIMEOUT 100
+// Largest text served, every histogram and counter fits easily
+#define METRICS_TEXT 16384
+
+static const char * histogram_names[HISTOGRAM_COUNT] = {
+  "tron_tick_seconds",
+  "tron_simulation_seconds",
+  "tron_serialization_seconds",
+  "tron_send_seconds",
+  "tron_client_rtt_seconds"
+};
+
+static const char * histogram_help[HISTOGRAM_COUNT] = {
+  "Time to run a whole step of a room",
+  "Time to simulate a step",
+  "Time to write the frames of a step",
+  "Time to hand the frames of a step to the sockets",
+  "Round trip time of the players, sampled once a second each"
+};
+
+static const char * counter_names[COUNTER_COUNT] = {
+  "tron_ticks_total",
+  "tron_received_bytes_total",
+  "tron_sent_bytes_total",
+  "tron_frames_dropped_total",
+  "tron_lag_disconnects_total",
+  "tron_spectator_sent_bytes_total"
+};
+
+static const char * counter_help[COUNTER_COUNT] = {
+  "Steps simulated by every room",
+  "Bytes received from the players",
+  "Bytes sent to the players",
+  "Frames replaced by a newer one before a slow player read them",
+  "Players disconnected for falling behind",
+  "Bytes sent to the spectators"
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// Every thread that recorded something, newest first, never removed
+static metrics_thread_t * threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread metrics_thread_t * local = NULL;
+
+static void * serveMetrics(void * arg);
+
+long long metricsNow() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// The metrics of the calling thread, registered the first time
+static metrics_thread_t * localMetrics() {
+  if (local == NULL) {
+    local = calloc(1, sizeof(*local));
+    if (local == NULL) {
+      fatalError("ERROR: calloc");
+    }
+    pthread_mutex_lock(&threads_lock);
+    local->next = threads;
+    __atomic_store_n(&threads, local, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&threads_lock);
+  }
+  return local;
+}
+
+// Only the owner writes, so a load and a store are enough, the readers
+// just need them untorn
+static inline void bump(uint64_t * value, uint64_t amount) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+// Bucket of a value: exact below METRIC_SUB_BUCKETS, then the top
+// METRIC_SUB_BITS + 1 bits of the value
+static int bucketOf(uint64_t value) {
+  int bits;
+
+  if (value < METRIC_SUB_BUCKETS) {
+    return value;
+  }
+  bits = 63 - __builtin_clzll(value);
+  if (bits >= METRIC_MAX_BITS) {
+    return METRIC_BUCKETS - 1;
+  }
+  return (bits - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS
+    + (value >> (bits - METRIC_SUB_BITS)) - METRIC_SUB_BUCKETS;
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucketTop(int bucket) {
+  int shift;
+
+  if (bucket < METRIC_SUB_BUCKETS) {
+    return bucket;
+  }
+  shift = bucket / METRIC_SUB_BUCKETS - 1;
+  return ((uint64_t)(METRIC_SUB_BUCKETS + bucket % METRIC_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void recordDuration(histogram_id_t histogram, long long nanoseconds) {
+  metrics_thread_t * metrics = localMetrics();
+
+  if (nanoseconds < 0) {
+    nanoseconds = 0;
+  }
+  bump(&metrics->buckets[histogram][bucketOf(nanoseconds)], 1);
+  bump(&metrics->sums[histogram], nanoseconds);
+}
+
+void addCounter(counter_id_t counter, uint64_t value) {
+  bump(&localMetrics()->counters[counter], value);
+}
+
+size_t formatMetrics(char * buffer, size_t capacity) {
+  static uint64_t buckets[METRIC_BUCKETS];
+  metrics_thread_t * first = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  uint64_t sum, count, seen, target;
+  size_t length = 0;
+  int bucket;
+
+  // Only the thread of the metrics server formats, the buckets can be static
+  #define APPEND(...) \
+    if (length < capacity) { \
+      length += snprintf(buffer + length, capacity - length, __VA_ARGS__); \
+    }
+  for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+    memset(buckets, 0, sizeof(buckets));
+    sum = count = 0;
+    for (metrics_thread_t * metrics = first; metrics != NULL; metrics = metrics->next) {
+      for (int i = 0; i < METRIC_BUCKETS; i++) {
+        buckets[i] += __atomic_load_n(&metrics->buckets[h][i], __ATOMIC_RELAXED);
+      }
+      sum += __atomic_load_n(&metrics->sums[h], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+      count += buckets[i];
+    }
+    APPEND("# HELP %s %s\n# TYPE %s summary\n", histogram_names[h], histogram_help[h], histogram_names[h]);
+    for (int q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++) {
+      // Smallest bucket holding at least the quantile of the values
+      target = (uint64_t)(quantiles[q] * count + 0.5);
+      seen = 0;
+      bucket = 0;
+      while (bucket < METRIC_BUCKETS - 1 && (seen += buckets[bucket]) < target) {
+        bucket++;
+      }
+      APPEND("%s{quantile=\"%g\"} %.9f\n", histogram_names[h], quantiles[q],
+        count > 0 ? bucketTop(bucket) / 1e9 : 0.0);
+    }
+    APPEND("%s_sum %.9f\n%s_count %llu\n", histogram_names[h], sum / 1e9,
+      histogram_names[h], (unsigned long long)count);
+  }
+  for (int c = 0; c < COUNTER_COUNT; c++) {
+    sum = 0;
+    for (metrics_thread_t * metrics = first; metrics != NULL; metrics = metrics->next) {
+      sum += __atomic_load_n(&metrics->counters[c], __ATOMIC_RELAXED);
+    }
+    APPEND("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[c], counter_help[c],
+      counter_names[c], counter_names[c], (unsigned long long)sum);
+  }
+  #undef APPEND
+  return length < capacity ? length : capacity - 1;
+}
+
+void startMetricsServer(metrics_server_t * server, const char * path) {
+  struct sockaddr_un address;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fatalError("ERROR: metrics socket path too long");
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  // A socket left by an earlier run would make bind fail
+  unlink(path);
+
+  server->path = path;
+  server->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->socket_fd == -1) {
+    fatalError("ERROR: socket");
+  }
+  if (bind(server->socket_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    fatalError("ERROR: bind");
+  }
+  if (listen(server->socket_fd, 16) == -1) {
+    fatalError("ERROR: listen");
+  }
+  if (pthread_create(&server->thread, NULL, serveMetrics, server) != 0) {
+    fatalError("ERROR: pthread_create");
+  }
+  logMessage(LEVEL_INFO, "Serving metrics on %s", path);
+}
+
+void stopMetricsServer(metrics_server_t * server) {
+  // Wakes up the accept of the thread
+  shutdown(server->socket_fd, SHUT_RDWR);
+  pthread_join(server->thread, NULL);
+  close(server->socket_fd);
+  unlink(server->path);
+}
+
+// Answer every connection with the metrics and close it
+static void * serveMetrics(void * arg) {
+  metrics_server_t * server = arg;
+  static char text[METRICS_TEXT];
+  char request[512];
+  char header[128];
+  struct pollfd client;
+  ssize_t request_length;
+  size_t length;
+  int client_fd;
+
+  while ((client_fd = accept(server->socket_fd, NULL, NULL)) != -1) {
+    // An HTTP scraper sends a request first, a plain reader nothing
+    client.fd = client_fd;
+    client.events = POLLIN;
+    request_length = 0;
+    if (poll(&client, 1, REQUEST_TIMEOUT) > 0) {
+      request_length = recv(client_fd, request, sizeof(request) - 1, 0);
+    }
+    length = formatMetrics(text, sizeof(text));
+    if (request_length >= 3 && strncmp(request, "GET", 3) == 0) {
+      snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+      send(client_fd, header, strlen(header), MSG_NOSIGNAL);
+    }
+    send(client_fd, text, length, MSG_NOSIGNAL);
+    close(client_fd);
+  }
+  return NULL;
+}
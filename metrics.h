@@ -0,0 +1,82 @@
+/*
+ * Latency histograms and counters of the server.
+ *
+ * Every thread records into its own histograms and counters, registered
+ * the first time it records anything, so recording is a couple of plain
+ * stores with no lock and no shared cache line. The histograms are in the
+ * style of HdrHistogram: every power of 2 is split into METRIC_SUB_BUCKETS
+ * buckets, which keeps about 3% of precision from 1 ns to several minutes
+ * in a fixed array.
+ *
+ * The totals of every thread are served in the Prometheus text format on
+ * a Unix socket, as a summary with the usual quantiles for each histogram:
+ *     curl --unix-socket tron.sock http://localhost/metrics
+ * A client that sends nothing gets the text without the HTTP headers.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Buckets per power of 2, and the powers of 2 covered (up to 2^40 ns)
+#define METRIC_SUB_BITS 5
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_MAX_BITS 40
+#define METRIC_BUCKETS ((METRIC_MAX_BITS - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS)
+
+// Durations recorded, in ns
+typedef enum histogram_id {
+  HISTOGRAM_TICK,           // A whole step of a room
+  HISTOGRAM_SIMULATION,     // The simulation in it
+  HISTOGRAM_SERIALIZATION,  // Writing the frames of the step
+  HISTOGRAM_SEND,           // Handing them to the sockets
+  HISTOGRAM_RTT,            // Round trip time of a player
+  HISTOGRAM_COUNT
+} histogram_id_t;
+
+typedef enum counter_id {
+  COUNTER_TICKS,
+  COUNTER_BYTES_IN,
+  COUNTER_BYTES_OUT,
+  COUNTER_FRAMES_DROPPED,
+  COUNTER_LAG_DISCONNECTS,
+  COUNTER_SPECTATOR_BYTES_OUT,
+  COUNTER_COUNT
+} counter_id_t;
+
+// What one thread recorded, only that thread writes to it
+typedef struct metrics_thread_struct {
+  uint64_t buckets[HISTOGRAM_COUNT][METRIC_BUCKETS];
+  uint64_t sums[HISTOGRAM_COUNT];
+  uint64_t counters[COUNTER_COUNT];
+  struct metrics_thread_struct * next;
+} metrics_thread_t;
+
+typedef struct metrics_server_struct {
+  int socket_fd;
+  const char * path;
+  pthread_t thread;
+} metrics_server_t;
+
+// Time in ns for the durations
+long long metricsNow();
+
+void recordDuration(histogram_id_t histogram, long long nanoseconds);
+
+void addCounter(counter_id_t counter, uint64_t value);
+
+/*
+    Write the totals of every thread in the Prometheus text format
+    Returns the length written, at most capacity - 1
+*/
+size_t formatMetrics(char * buffer, size_t capacity);
+
+// Serve the metrics on a Unix socket at path, from a thread of its own
+void startMetricsServer(metrics_server_t * server, const char * path);
+
+// Stop serving and remove the socket
+void stopMetricsServer(metrics_server_t * server);
+
+#endif
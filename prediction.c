@@ -0,0 +1,176 @@
+/*
+ * Client-side prediction and interpolation.
+ *
+ * See prediction.h for how the client uses it.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "prediction.h"
+
+// Weight of a new sample in the smoothed round trip time and tick period
+#define SMOOTHING 8
+
+// The oldest move that was not confirmed
+static pending_input_t * oldestInput(prediction_t * prediction) {
+  return &prediction->pending[prediction->pending_head];
+}
+
+static void dropOldestInput(prediction_t * prediction) {
+  prediction->pending_head = (prediction->pending_head + 1) % PENDING_INPUTS;
+  prediction->pending_count--;
+}
+
+void initPrediction(prediction_t * prediction, int player_count, int width, int height,
+                    int player_number, long long period) {
+  memset(prediction, 0, sizeof(*prediction));
+  prediction->player_count = player_count;
+  prediction->width = width;
+  prediction->height = height;
+  prediction->player_number = player_number;
+  prediction->period = period;
+  prediction->period_known = period > 0;
+  prediction->previous = calloc(player_count, sizeof(*prediction->previous));
+  prediction->latest = calloc(player_count, sizeof(*prediction->latest));
+}
+
+void closePrediction(prediction_t * prediction) {
+  free(prediction->previous);
+  free(prediction->latest);
+}
+
+void predictInput(prediction_t * prediction, direction_t direction, long long now) {
+  // The server keeps a few moves at most, the oldest ones are lost anyway
+  if (prediction->pending_count == PENDING_INPUTS) {
+    dropOldestInput(prediction);
+  }
+  prediction->pending[(prediction->pending_head + prediction->pending_count) % PENDING_INPUTS] =
+    (pending_input_t){direction, now};
+  prediction->pending_count++;
+}
+
+void predictRoundTrip(prediction_t * prediction, long long rtt) {
+  if (prediction->rtt == 0) {
+    prediction->rtt = rtt;
+  } else {
+    prediction->rtt += (rtt - prediction->rtt) / SMOOTHING;
+  }
+}
+
+void predictSnapshot(prediction_t * prediction, player_status_t * stati, long long now) {
+  player_status_t * swap;
+  long long interval;
+  long long timeout;
+
+  // Servers that don't tell the period: measure it
+  if (!prediction->period_known && prediction->snapshots > 0) {
+    interval = now - prediction->latest_time;
+    prediction->period += prediction->period == 0 ? interval : (interval - prediction->period) / SMOOTHING;
+  }
+
+  swap = prediction->previous;
+  prediction->previous = prediction->latest;
+  prediction->latest = swap;
+  memcpy(prediction->latest, stati, prediction->player_count * sizeof(*stati));
+  prediction->previous_time = prediction->latest_time;
+  prediction->latest_time = now;
+  // Until there are two snapshots, there is nothing to interpolate
+  if (prediction->snapshots++ == 0) {
+    memcpy(prediction->previous, stati, prediction->player_count * sizeof(*stati));
+  }
+
+  if (prediction->player_number < 1 || prediction->player_number > prediction->player_count) {
+    return;
+  }
+  // The server applies one move per tick: the oldest one is confirmed
+  // once the snapshot shows it
+  if (prediction->pending_count > 0
+      && oldestInput(prediction)->direction == stati[prediction->player_number - 1].current_direction) {
+    dropOldestInput(prediction);
+  }
+  // Moves that should have shown up long ago were dropped by the server,
+  // trust the snapshot instead
+  timeout = 2 * prediction->rtt + 4 * prediction->period;
+  while (prediction->pending_count > 0 && now - oldestInput(prediction)->sent > timeout) {
+    dropOldestInput(prediction);
+  }
+}
+
+/*
+    Move the head of the local player from the last snapshot to the tick the
+    server will be simulating when a move sent now arrives.
+    Every pending move is applied on the first tick the server could
+    have applied it, and no two on the same tick.
+*/
+static void predictHead(prediction_t * prediction, long long now, player_status_t * head) {
+  long long steps = 0;
+  long long step_limit;
+  long long earliest;
+  long long last_step = 0;
+  int applied = 0;
+  pending_input_t * input;
+
+  *head = prediction->latest[prediction->player_number - 1];
+  // An eliminated player stays where it crashed
+  if (prediction->period > 0 && head->status) {
+    steps = (now - prediction->latest_time + prediction->rtt) / prediction->period;
+    // Stop guessing if the snapshots stop coming
+    step_limit = prediction->rtt / prediction->period + 2;
+    steps = steps > step_limit ? step_limit : steps;
+  }
+
+  for (long long step = 1; step <= steps; step++) {
+    if (applied < prediction->pending_count) {
+      input = &prediction->pending[(prediction->pending_head + applied) % PENDING_INPUTS];
+      earliest = (input->sent + prediction->rtt - prediction->latest_time + prediction->period - 1) / prediction->period;
+      if (step >= earliest && step > last_step) {
+        head->current_direction = input->direction;
+        last_step = step;
+        applied++;
+      }
+    }
+    getNewCoordinates(head, prediction->width, prediction->height);
+  }
+  // Show where the player is heading even before the move is simulated
+  if (prediction->pending_count > 0) {
+    head->current_direction =
+      prediction->pending[(prediction->pending_head + prediction->pending_count - 1) % PENDING_INPUTS].direction;
+  }
+}
+
+// Linear interpolation on one axis, unless the player wrapped around the board
+static double interpolate(int from, int to, double alpha) {
+  if (abs(to - from) > 1) {
+    return to;
+  }
+  return from + (to - from) * alpha;
+}
+
+int predictPlayer(prediction_t * prediction, int index, long long now,
+                  double * x, double * y, direction_t * direction) {
+  player_status_t head;
+  double alpha = 1;
+
+  if (prediction->snapshots == 0) {
+    return 0;
+  }
+  if (index == prediction->player_number - 1) {
+    predictHead(prediction, now, &head);
+    *x = head.coordinates.x_position;
+    *y = head.coordinates.y_position;
+    *direction = head.current_direction;
+    return 1;
+  }
+
+  // The others are drawn one tick late, between the last two snapshots
+  if (prediction->period > 0) {
+    alpha = (double)(now - prediction->latest_time) / prediction->period;
+    alpha = alpha < 0 ? 0 : alpha > 1 ? 1 : alpha;
+  }
+  *x = interpolate(prediction->previous[index].coordinates.x_position,
+    prediction->latest[index].coordinates.x_position, alpha);
+  *y = interpolate(prediction->previous[index].coordinates.y_position,
+    prediction->latest[index].coordinates.y_position, alpha);
+  *direction = prediction->latest[index].current_direction;
+  return 1;
+}
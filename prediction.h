@@ -0,0 +1,82 @@
+/*
+ * Client-side prediction and interpolation.
+ *
+ * The client doesn't wait for the server to show its own moves: the head of
+ * the local player is moved ahead with the same getNewCoordinates rules,
+ * starting from the last snapshot and applying the moves the server has not
+ * confirmed yet. Every snapshot reconciles that guess with the real state.
+ * The other players are drawn between the last two snapshots, so they move
+ * smoothly even when the snapshots arrive in bursts.
+ */
+
+#ifndef PREDICTION_H
+#define PREDICTION_H
+
+#include <stdint.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+
+// Moves sent and not yet seen in a snapshot, older ones are forgotten
+#define PENDING_INPUTS 16
+
+typedef struct pending_input_struct {
+  direction_t direction;
+  // Time the move was sent in us
+  long long sent;
+} pending_input_t;
+
+typedef struct prediction_struct {
+  int player_count;
+  // Size of the board, the predicted head wraps around it
+  int width;
+  int height;
+  // Number of the local player, 0 if the server didn't tell
+  int player_number;
+  // Time between ticks in us, measured from the snapshots if the server didn't tell
+  long long period;
+  int period_known;
+  // Last two snapshots and the time they arrived
+  player_status_t * previous;
+  player_status_t * latest;
+  long long previous_time;
+  long long latest_time;
+  int snapshots;
+  // Moves of the local player the server hasn't shown yet, oldest first
+  pending_input_t pending[PENDING_INPUTS];
+  int pending_head;
+  int pending_count;
+  // Smoothed round trip time in us, 0 until measured
+  long long rtt;
+} prediction_t;
+
+/*
+    Prepare the prediction for a game of player_count players on a board
+    of width x height, period is the time between ticks in us, 0 if unknown
+*/
+void initPrediction(prediction_t * prediction, int player_count, int width, int height,
+                    int player_number, long long period);
+
+void closePrediction(prediction_t * prediction);
+
+// Remember a move sent to the server at time now
+void predictInput(prediction_t * prediction, direction_t direction, long long now);
+
+// Add a measurement of the round trip time
+void predictRoundTrip(prediction_t * prediction, long long rtt);
+
+/*
+    Take a snapshot received at time now as the real state and drop the
+    moves it shows applied
+*/
+void predictSnapshot(prediction_t * prediction, player_status_t * stati, long long now);
+
+/*
+    Where a player should be drawn at time now, in board cells
+    The local player is predicted, the others interpolated
+    Returns 0 until the first snapshot arrives
+*/
+int predictPlayer(prediction_t * prediction, int index, long long now,
+                  double * x, double * y, direction_t * direction);
+
+#endif
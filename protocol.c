@@ -0,0 +1,302 @@
+/*
+ * Binary wire protocol shared by the server and the clients.
+ *
+ * See protocol.h for the layout of the frames.
+ */
+#include <string.h>
+
+#include "protocol.h"
+
+// Store integers in network byte order one byte at a time,
+// so the buffers need no alignment
+static void putUint16(unsigned char * buffer, uint16_t value) {
+  buffer[0] = value >> 8;
+  buffer[1] = value & 0xFF;
+}
+
+static void putUint32(unsigned char * buffer, uint32_t value) {
+  buffer[0] = value >> 24;
+  buffer[1] = (value >> 16) & 0xFF;
+  buffer[2] = (value >> 8) & 0xFF;
+  buffer[3] = value & 0xFF;
+}
+
+static uint16_t getUint16(const unsigned char * buffer) {
+  return (uint16_t)(buffer[0] << 8 | buffer[1]);
+}
+
+static uint32_t getUint32(const unsigned char * buffer) {
+  return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16
+    | (uint32_t)buffer[2] << 8 | buffer[3];
+}
+
+size_t snapshotFrameSize(int player_c) {
+  return HEADER_SIZE + (size_t)player_c * PLAYER_RECORD_SIZE;
+}
+
+void encodeHeader(unsigned char * buffer, message_type_t type, uint32_t tick, uint32_t payload_length) {
+  buffer[0] = PROTOCOL_MAGIC;
+  buffer[1] = PROTOCOL_BINARY;
+  buffer[2] = type;
+  buffer[3] = 0;
+  putUint32(buffer + 4, tick);
+  putUint32(buffer + 8, payload_length);
+}
+
+int decodeHeader(const unsigned char * buffer, size_t length, frame_header_t * header) {
+  if (length < HEADER_SIZE) {
+    return 0;
+  }
+  if (buffer[0] != PROTOCOL_MAGIC || buffer[1] != PROTOCOL_BINARY) {
+    return -1;
+  }
+  header->version = buffer[1];
+  header->type = buffer[2];
+  header->flags = buffer[3];
+  header->tick = getUint32(buffer + 4);
+  header->payload_length = getUint32(buffer + 8);
+  if (header->payload_length > MAX_PAYLOAD) {
+    return -1;
+  }
+  return 1;
+}
+
+size_t encodeSnapshot(game_t * game, uint32_t tick, unsigned char * buffer, size_t capacity) {
+  return encodePlayersSnapshot(game->stati, game->players->player_count, tick, buffer, capacity);
+}
+
+size_t encodePlayersSnapshot(const player_status_t * stati, int player_c, uint32_t tick,
+                             unsigned char * buffer, size_t capacity) {
+  size_t size = snapshotFrameSize(player_c);
+  unsigned char * record = buffer + HEADER_SIZE;
+
+  if (capacity < size) {
+    return 0;
+  }
+  encodeHeader(buffer, MSG_SNAPSHOT, tick, size - HEADER_SIZE);
+  for (int i = 0; i < player_c; i++) {
+    putUint16(record, stati[i].coordinates.x_position);
+    putUint16(record + 2, stati[i].coordinates.y_position);
+    record[4] = (stati[i].current_direction & RECORD_DIRECTION_MASK)
+      | (stati[i].status ? RECORD_ALIVE : 0);
+    record += PLAYER_RECORD_SIZE;
+  }
+  return size;
+}
+
+int decodeSnapshot(const unsigned char * payload, size_t length, game_t * game) {
+  int player_c = length / PLAYER_RECORD_SIZE;
+
+  if (length % PLAYER_RECORD_SIZE != 0 || player_c > game->players->player_count) {
+    return -1;
+  }
+  for (int i = 0; i < player_c; i++) {
+    game->stati[i].coordinates.x_position = getUint16(payload);
+    game->stati[i].coordinates.y_position = getUint16(payload + 2);
+    game->stati[i].current_direction = payload[4] & RECORD_DIRECTION_MASK;
+    game->stati[i].status = (payload[4] & RECORD_ALIVE) != 0;
+    payload += PLAYER_RECORD_SIZE;
+  }
+  return player_c;
+}
+
+size_t encodeInput(direction_t direction, uint32_t last_tick, unsigned char * buffer) {
+  encodeHeader(buffer, MSG_INPUT, last_tick, INPUT_PAYLOAD_SIZE);
+  buffer[HEADER_SIZE] = direction;
+  return HEADER_SIZE + INPUT_PAYLOAD_SIZE;
+}
+
+int decodeInput(const unsigned char * payload, size_t length) {
+  if (length != INPUT_PAYLOAD_SIZE || payload[0] > LEFT) {
+    return -1;
+  }
+  return payload[0];
+}
+
+size_t encodePing(uint64_t value, unsigned char * buffer) {
+  encodeHeader(buffer, MSG_PING, 0, PING_PAYLOAD_SIZE);
+  putUint32(buffer + HEADER_SIZE, value >> 32);
+  putUint32(buffer + HEADER_SIZE + 4, value & 0xFFFFFFFF);
+  return HEADER_SIZE + PING_PAYLOAD_SIZE;
+}
+
+uint64_t decodePing(const unsigned char * payload) {
+  return (uint64_t)getUint32(payload) << 32 | getUint32(payload + 4);
+}
+
+void encodePong(const unsigned char * ping, size_t length, unsigned char * buffer) {
+  memcpy(buffer, ping, length);
+  buffer[2] = MSG_PONG;
+}
+
+size_t encodeEmpty(message_type_t type, unsigned char * buffer) {
+  encodeHeader(buffer, type, 0, 0);
+  return HEADER_SIZE;
+}
+
+size_t encodeAccept(const accept_t * accept, unsigned char * buffer) {
+  unsigned char * payload = buffer + HEADER_SIZE;
+
+  encodeHeader(buffer, MSG_ACCEPT, 0, ACCEPT_PAYLOAD_SIZE);
+  putUint16(payload, accept->player_count);
+  putUint16(payload + 2, accept->width);
+  putUint16(payload + 4, accept->height);
+  putUint16(payload + 6, accept->player_number);
+  putUint32(payload + 8, accept->tick_period);
+  putUint16(payload + 12, accept->port);
+  return HEADER_SIZE + ACCEPT_PAYLOAD_SIZE;
+}
+
+int decodeAccept(const unsigned char * payload, size_t length, accept_t * accept) {
+  if (length != ACCEPT_PAYLOAD_SIZE) {
+    return 0;
+  }
+  accept->player_count = getUint16(payload);
+  accept->width = getUint16(payload + 2);
+  accept->height = getUint16(payload + 4);
+  accept->player_number = getUint16(payload + 6);
+  accept->tick_period = getUint32(payload + 8);
+  accept->port = getUint16(payload + 12);
+  return 1;
+}
+
+size_t encodeInputs(uint32_t first_sequence, const direction_t * directions, int count,
+                    uint32_t last_tick, unsigned char * buffer) {
+  unsigned char * payload = buffer + HEADER_SIZE;
+
+  encodeHeader(buffer, MSG_INPUTS, last_tick, 5 + count);
+  putUint32(payload, first_sequence);
+  payload[4] = count;
+  for (int i = 0; i < count; i++) {
+    payload[5 + i] = directions[i];
+  }
+  return HEADER_SIZE + 5 + count;
+}
+
+int decodeInputs(const unsigned char * payload, size_t length, uint32_t * first_sequence,
+                 const unsigned char ** directions) {
+  if (length < 5 || length != 5 + (size_t)payload[4] || payload[4] > INPUT_REDUNDANCY) {
+    return -1;
+  }
+  *first_sequence = getUint32(payload);
+  *directions = payload + 5;
+  return payload[4];
+}
+
+size_t encodeSnapshotAck(message_type_t type, uint32_t tick, uint32_t input_ack, uint32_t body_length,
+                         unsigned char * buffer) {
+  encodeHeader(buffer, type, tick, INPUT_ACK_SIZE + body_length);
+  buffer[3] = FLAG_INPUT_ACK;
+  putUint32(buffer + HEADER_SIZE, input_ack);
+  return HEADER_SIZE + INPUT_ACK_SIZE;
+}
+
+uint32_t decodeSnapshotAck(const unsigned char * payload) {
+  return getUint32(payload);
+}
+
+size_t deltaFrameSize(int event_c) {
+  return HEADER_SIZE + DELTA_START_SIZE + (size_t)event_c * DELTA_EVENT_SIZE;
+}
+
+size_t encodeDelta(uint32_t baseline, uint32_t tick, const delta_event_t * events, int event_c,
+                   unsigned char * buffer, size_t capacity) {
+  size_t size = deltaFrameSize(event_c);
+  unsigned char * event = buffer + HEADER_SIZE + DELTA_START_SIZE;
+
+  if (capacity < size) {
+    return 0;
+  }
+  encodeHeader(buffer, MSG_DELTA, tick, size - HEADER_SIZE);
+  putUint32(buffer + HEADER_SIZE, baseline);
+  putUint16(buffer + HEADER_SIZE + 4, event_c);
+  for (int i = 0; i < event_c; i++) {
+    event[0] = events[i].offset;
+    putUint16(event + 1, events[i].player);
+    event[3] = events[i].flags;
+    event += DELTA_EVENT_SIZE;
+  }
+  return size;
+}
+
+int decodeDelta(const unsigned char * payload, size_t length, uint32_t * baseline,
+                delta_event_t * events, int capacity) {
+  int event_c;
+
+  if (length < DELTA_START_SIZE) {
+    return -1;
+  }
+  event_c = getUint16(payload + 4);
+  if (length != DELTA_START_SIZE + (size_t)event_c * DELTA_EVENT_SIZE || event_c > capacity) {
+    return -1;
+  }
+  *baseline = getUint32(payload);
+  payload += DELTA_START_SIZE;
+  for (int i = 0; i < event_c; i++) {
+    events[i].offset = payload[0];
+    events[i].player = getUint16(payload + 1);
+    events[i].flags = payload[3];
+    payload += DELTA_EVENT_SIZE;
+  }
+  return event_c;
+}
+
+size_t viewBodySize(int record_c) {
+  return VIEW_START_SIZE + (size_t)record_c * VIEW_RECORD_SIZE;
+}
+
+size_t encodeViewBody(const player_status_t * stati, const uint16_t * players, int record_c,
+                      int minimap_columns, int minimap_rows, unsigned char * buffer) {
+  unsigned char * record = buffer + VIEW_START_SIZE;
+  const player_status_t * player;
+
+  putUint16(buffer, record_c);
+  buffer[2] = minimap_columns;
+  buffer[3] = minimap_rows;
+  for (int i = 0; i < record_c; i++) {
+    player = &stati[players[i]];
+    putUint16(record, players[i]);
+    putUint16(record + 2, player->coordinates.x_position);
+    putUint16(record + 4, player->coordinates.y_position);
+    record[6] = (player->current_direction & RECORD_DIRECTION_MASK) | (player->status ? RECORD_ALIVE : 0);
+    record += VIEW_RECORD_SIZE;
+  }
+  return viewBodySize(record_c);
+}
+
+int decodeView(const unsigned char * payload, size_t length, game_t * game,
+               const unsigned char ** minimap, int * minimap_columns, int * minimap_rows) {
+  int record_c;
+  size_t body;
+  const unsigned char * record;
+  player_status_t * player;
+
+  if (length < VIEW_START_SIZE) {
+    return -1;
+  }
+  record_c = getUint16(payload);
+  body = viewBodySize(record_c);
+  if (record_c > game->players->player_count || length != body + (size_t)payload[2] * payload[3]) {
+    return -1;
+  }
+  for (record = payload + VIEW_START_SIZE; record < payload + body; record += VIEW_RECORD_SIZE) {
+    if (getUint16(record) >= game->players->player_count) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < game->players->player_count; i++) {
+    game->stati[i].coordinates.x_position = -1;
+    game->stati[i].coordinates.y_position = -1;
+  }
+  for (record = payload + VIEW_START_SIZE; record < payload + body; record += VIEW_RECORD_SIZE) {
+    player = &game->stati[getUint16(record)];
+    player->coordinates.x_position = getUint16(record + 2);
+    player->coordinates.y_position = getUint16(record + 4);
+    player->current_direction = record[6] & RECORD_DIRECTION_MASK;
+    player->status = (record[6] & RECORD_ALIVE) != 0;
+  }
+  *minimap_columns = payload[2];
+  *minimap_rows = payload[3];
+  *minimap = *minimap_columns * *minimap_rows > 0 ? payload + body : NULL;
+  return record_c;
+}
@@ -0,0 +1,277 @@
+/*
+ * Binary wire protocol shared by the server and the clients.
+ *
+ * Every message after the GAME handshake is a frame made of a fixed header
+ * followed by a payload. All fields are in network byte order.
+ *
+ * Header (12 bytes):
+ *   uint8  magic          PROTOCOL_MAGIC
+ *   uint8  version        PROTOCOL_BINARY
+ *   uint8  type           message_type_t
+ *   uint8  flags          FLAG_* bits, 0 over TCP
+ *   uint32 tick           simulation step of the snapshot, counted from 1,
+ *                         or the last one seen by a client (0 for none)
+ *   uint32 payload length bytes after the header
+ *
+ * Snapshot payload, one 5 byte record per player:
+ *   uint16 x, uint16 y, uint8 direction (bits 0-1) | alive (bit 2)
+ *
+ * Clients that offer PROTOCOL_DELTA get a full snapshot (a keyframe) first
+ * and then deltas, that only tell what changed since a baseline step the
+ * client already has. Positions follow from the directions, so only turns
+ * and eliminations are sent, and a quiet step costs 6 bytes of payload
+ * whatever the number of players:
+ *   uint32 baseline step, uint16 count, count x 4 byte events:
+ *   uint8 steps after the baseline, uint16 player index,
+ *   uint8 new direction (bits 0-1) | EVENT_ELIMINATED | EVENT_TURN
+ * Over TCP the baseline is the previous step sent, over UDP the last step
+ * the client acknowledged. See delta.h for how the steps are replayed.
+ *
+ * On boards larger than the view of a player, clients that offer
+ * PROTOCOL_VIEW get a view every step instead, with only the players near
+ * their own head (see view.h), so its size doesn't grow with the players in
+ * the game. Every few steps it also carries a minimap, the number of players
+ * alive in each of up to MINIMAP_SIZE x MINIMAP_SIZE equal parts of the board:
+ *   uint16 count, uint8 minimap columns, uint8 minimap rows (0 if none),
+ *   count x 7 byte records: uint16 player index, then as in a snapshot,
+ *   columns x rows uint8 players alive in that part, row by row
+ * The first record is the player the view is for. Players left out are
+ * not in view, and the last step of a game is a full snapshot.
+ *
+ * Input payload (1 byte):
+ *   uint8 direction
+ *
+ * Ping payload (8 bytes), answered right away with a pong carrying the
+ * same payload, used to measure the round trip time:
+ *   uint64 opaque value chosen by the sender (usually a timestamp)
+ *
+ * Over UDP every datagram is one frame. The client sends a connect frame
+ * (empty payload) to the port of the server until it gets an accept:
+ *   uint16 players, uint16 width, uint16 height, uint16 player number,
+ *   uint32 tick period in us, uint16 UDP port of the room
+ * and from then on talks to the port of the room. Moves are numbered and
+ * every inputs frame repeats the ones not acknowledged yet, so a lost
+ * datagram costs nothing as long as a later one arrives:
+ *   uint32 sequence of the first move, uint8 count, count x uint8 direction
+ * with the header tick holding the last snapshot step the client saw, which
+ * also acknowledges it as a baseline. Those frames are sent on every
+ * snapshot even without moves. Snapshots and deltas are not resent, a newer
+ * one replaces them. They carry FLAG_INPUT_ACK and a uint32 with the last
+ * move sequence received before the usual payload, and always fit in one
+ * datagram: a delta that wouldn't is replaced by a keyframe. Pings work as
+ * over TCP. A close frame (empty payload) tells the client the game is over.
+ *
+ * A TCP client may add the kind of connection to the GAME handshake, after
+ * the version, and for spectators the room to watch: "3 4 1 7" watches
+ * room 7, "3 4 1" the game that started last. Spectators always get
+ * PROTOCOL_BINARY snapshots and player number 0, and anything they send is
+ * ignored.
+ *
+ * The encoders write into buffers supplied by the caller and the decoders
+ * read in place, so neither allocates memory.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+
+// Versions negotiated in the GAME handshake
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_BINARY 2
+#define PROTOCOL_DELTA 3
+#define PROTOCOL_VIEW 4
+// Highest version this build can speak
+#define PROTOCOL_VERSION PROTOCOL_VIEW
+
+// Kinds of connection asked for in the GAME handshake
+#define CONNECTION_PLAYER 0
+#define CONNECTION_SPECTATOR 1
+
+#define PROTOCOL_MAGIC 0x54
+#define HEADER_SIZE 12
+#define PLAYER_RECORD_SIZE 5
+#define INPUT_PAYLOAD_SIZE 1
+#define PING_PAYLOAD_SIZE 8
+// Largest frame a client may send
+#define MAX_CLIENT_FRAME (HEADER_SIZE + PING_PAYLOAD_SIZE)
+// Frames larger than this are treated as a protocol error
+#define MAX_PAYLOAD (1 << 24)
+
+#define RECORD_DIRECTION_MASK 0x03
+#define RECORD_ALIVE 0x04
+
+#define ACCEPT_PAYLOAD_SIZE 14
+#define INPUT_ACK_SIZE 4
+// Most moves repeated in one inputs frame
+#define INPUT_REDUNDANCY 16
+#define MAX_INPUTS_FRAME (HEADER_SIZE + 5 + INPUT_REDUNDANCY)
+// Header flag: the payload starts with the last move sequence received
+#define FLAG_INPUT_ACK 0x01
+#define DELTA_START_SIZE 6
+#define DELTA_EVENT_SIZE 4
+#define EVENT_DIRECTION_MASK 0x03
+#define EVENT_ELIMINATED 0x04
+#define EVENT_TURN 0x08
+#define VIEW_START_SIZE 4
+#define VIEW_RECORD_SIZE 7
+// Most players in a view, so it always fits in a datagram with the minimap
+#define VIEW_MAX_PLAYERS 128
+// Parts the minimap splits each side of the board in, fewer on small boards
+#define MINIMAP_SIZE 16
+
+typedef enum message_type {
+  MSG_SNAPSHOT, MSG_INPUT, MSG_PING, MSG_PONG,
+  // Only used over UDP
+  MSG_CONNECT, MSG_ACCEPT, MSG_INPUTS, MSG_CLOSE,
+  MSG_DELTA, MSG_VIEW
+} message_type_t;
+
+// Something that happened to a player in a step covered by a delta
+typedef struct delta_event_struct {
+  // Steps after the baseline, from 1
+  uint8_t offset;
+  uint16_t player;
+  // EVENT_* bits and the new direction
+  uint8_t flags;
+} delta_event_t;
+
+// Game settings given to a UDP client by the accept frame
+typedef struct accept_struct {
+  int player_count;
+  int width;
+  int height;
+  int player_number;
+  long long tick_period;
+  int port;
+} accept_t;
+
+typedef struct frame_header_struct {
+  uint8_t version;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t tick;
+  uint32_t payload_length;
+} frame_header_t;
+
+// Bytes needed for a whole snapshot frame with player_c players
+size_t snapshotFrameSize(int player_c);
+
+// Write a header into buffer, which must hold HEADER_SIZE bytes
+void encodeHeader(unsigned char * buffer, message_type_t type, uint32_t tick, uint32_t payload_length);
+
+/*
+  Read a header from the first bytes of buffer
+  Returns 1 when a valid header was read, 0 when fewer than HEADER_SIZE bytes
+  are available, and -1 when the bytes are not a valid header
+*/
+int decodeHeader(const unsigned char * buffer, size_t length, frame_header_t * header);
+
+/*
+  Write the snapshot frame of the game into buffer
+  Returns the bytes written, or 0 if capacity is not enough
+*/
+size_t encodeSnapshot(game_t * game, uint32_t tick, unsigned char * buffer, size_t capacity);
+
+// Same for player_c players kept outside of a game
+size_t encodePlayersSnapshot(const player_status_t * stati, int player_c, uint32_t tick,
+                             unsigned char * buffer, size_t capacity);
+
+/*
+  Update the player stati of the game from a snapshot payload
+  Returns the number of players read, or -1 if the payload is malformed
+*/
+int decodeSnapshot(const unsigned char * payload, size_t length, game_t * game);
+
+// Write an input frame into buffer, which must hold HEADER_SIZE + INPUT_PAYLOAD_SIZE bytes
+size_t encodeInput(direction_t direction, uint32_t last_tick, unsigned char * buffer);
+
+// Read the direction of an input payload, -1 if it is malformed
+int decodeInput(const unsigned char * payload, size_t length);
+
+// Write a ping frame into buffer, which must hold MAX_CLIENT_FRAME bytes
+size_t encodePing(uint64_t value, unsigned char * buffer);
+
+// Read the value of a ping or pong payload
+uint64_t decodePing(const unsigned char * payload);
+
+// Write into buffer the pong answering a whole ping frame of the given length
+void encodePong(const unsigned char * ping, size_t length, unsigned char * buffer);
+
+// Write a frame without payload, such as connect or close, into buffer
+size_t encodeEmpty(message_type_t type, unsigned char * buffer);
+
+// Write an accept frame into buffer, which must hold HEADER_SIZE + ACCEPT_PAYLOAD_SIZE bytes
+size_t encodeAccept(const accept_t * accept, unsigned char * buffer);
+
+// Read an accept payload, returns 0 if it is malformed
+int decodeAccept(const unsigned char * payload, size_t length, accept_t * accept);
+
+/*
+  Write an inputs frame with count moves, the first one numbered first_sequence
+  buffer must hold MAX_INPUTS_FRAME bytes, count is at most INPUT_REDUNDANCY
+*/
+size_t encodeInputs(uint32_t first_sequence, const direction_t * directions, int count,
+                    uint32_t last_tick, unsigned char * buffer);
+
+/*
+  Read an inputs payload in place
+  Returns the number of moves, or -1 if the payload is malformed
+*/
+int decodeInputs(const unsigned char * payload, size_t length, uint32_t * first_sequence,
+                 const unsigned char ** directions);
+
+/*
+  Write the header and move acknowledgement that come before the payload of
+  a snapshot or delta sent over UDP, body_length being the bytes after them
+  buffer must hold HEADER_SIZE + INPUT_ACK_SIZE bytes
+*/
+size_t encodeSnapshotAck(message_type_t type, uint32_t tick, uint32_t input_ack, uint32_t body_length,
+                         unsigned char * buffer);
+
+// Read the move acknowledgement at the start of a payload with FLAG_INPUT_ACK
+uint32_t decodeSnapshotAck(const unsigned char * payload);
+
+// Bytes needed for a whole delta frame with event_c events
+size_t deltaFrameSize(int event_c);
+
+/*
+  Write a delta frame from baseline to tick into buffer
+  Returns the bytes written, or 0 if capacity is not enough
+*/
+size_t encodeDelta(uint32_t baseline, uint32_t tick, const delta_event_t * events, int event_c,
+                   unsigned char * buffer, size_t capacity);
+
+/*
+  Read a delta payload, at most capacity events
+  Returns the number of events, or -1 if the payload is malformed
+*/
+int decodeDelta(const unsigned char * payload, size_t length, uint32_t * baseline,
+                delta_event_t * events, int capacity);
+
+// Bytes of a view payload with record_c players, before the minimap
+size_t viewBodySize(int record_c);
+
+/*
+  Write the start and the records of a view payload into buffer, which must
+  hold viewBodySize bytes, the minimap counts are written by the caller after
+  them when minimap_columns is not 0
+  Returns the bytes written
+*/
+size_t encodeViewBody(const player_status_t * stati, const uint16_t * players, int record_c,
+                      int minimap_columns, int minimap_rows, unsigned char * buffer);
+
+/*
+  Update the player stati of the game from a view payload, the players not
+  in view get -1 as coordinates
+  minimap points to the counts in the payload, NULL when it has none
+  Returns the number of players read, or -1 if the payload is malformed
+*/
+int decodeView(const unsigned char * payload, size_t length, game_t * game,
+               const unsigned char ** minimap, int * minimap_columns, int * minimap_rows);
+
+#endif
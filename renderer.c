@@ -0,0 +1,291 @@
+/*
+ * Incremental ncurses renderer for the client.
+ *
+ * See renderer.h for how it decides what to draw.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "renderer.h"
+#include "protocol.h"
+
+// Colors given to the players in turn
+static const short player_colors[] = {COLOR_RED, COLOR_GREEN, COLOR_YELLOW, COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN};
+#define PLAYER_COLORS (int)(sizeof(player_colors) / sizeof(*player_colors))
+
+// Character for a part of the board with players out of view
+#define FAR_GLYPH ('+' | A_DIM)
+
+// Character for a trail or a head of a player
+static chtype glyph(int owner, int head, int local) {
+  chtype result = head ? (local ? '@' : 'O') | A_BOLD : 'o';
+
+  if (has_colors()) {
+    result |= COLOR_PAIR((owner - 1) % PLAYER_COLORS + 1);
+  }
+  return result;
+}
+
+// Screen cell showing a board cell, -1 outside the board
+static int screenCell(renderer_t * renderer, double x, double y) {
+  int row, column;
+
+  if (x < 0 || y < 0 || x >= renderer->board->width || y >= renderer->board->height) {
+    return -1;
+  }
+  row = renderer->rows * y / renderer->board->height;
+  column = renderer->columns * x / renderer->board->width;
+  return row * renderer->columns + column;
+}
+
+static void markDirty(renderer_t * renderer, int cell) {
+  if (cell >= 0 && !renderer->dirty_mark[cell]) {
+    renderer->dirty_mark[cell] = 1;
+    renderer->dirty[renderer->dirty_count++] = cell;
+  }
+}
+
+/*
+    Make the buffers for the current size of the terminal
+    and draw the trails again from the shadow board
+*/
+static void resizeRenderer(renderer_t * renderer, int rows, int columns) {
+  int cells = rows * columns;
+  int owner;
+
+  renderer->rows = rows;
+  renderer->columns = columns;
+  free(renderer->trails);
+  free(renderer->screen);
+  free(renderer->dirty);
+  free(renderer->dirty_mark);
+  free(renderer->far_mark);
+  renderer->trails = malloc(cells * sizeof(*renderer->trails));
+  renderer->screen = malloc(cells * sizeof(*renderer->screen));
+  renderer->dirty = malloc(cells * sizeof(*renderer->dirty));
+  renderer->dirty_mark = calloc(cells, sizeof(*renderer->dirty_mark));
+  renderer->dirty_count = 0;
+  // The marks come back with the next minimap
+  renderer->far_mark = calloc(cells, sizeof(*renderer->far_mark));
+  renderer->far_count = 0;
+  for (int i = 0; i < cells; i++) {
+    renderer->trails[i] = ' ';
+    renderer->screen[i] = ' ';
+  }
+  for (int i = 0; i < renderer->player_count; i++) {
+    renderer->heads[i] = -1;
+  }
+
+  erase();
+  // Only the chunks some trail reached can have taken cells
+  for (int y = 0; y < renderer->board->height; y++) {
+    for (int x = 0; x < renderer->board->width; x += CHUNK_SIZE) {
+      if (renderer->board->occupied[board_chunk(renderer->board, x, y)] == NULL) {
+        continue;
+      }
+      for (int i = x; i < x + CHUNK_SIZE && i < renderer->board->width; i++) {
+        if (board_is_occupied(renderer->board, i, y) && (owner = board_owner(renderer->board, i, y)) > 0) {
+          int cell = screenCell(renderer, i, y);
+          renderer->trails[cell] = glyph(owner, 0, 0);
+          markDirty(renderer, cell);
+        }
+      }
+    }
+  }
+}
+
+void initRenderer(renderer_t * renderer, board_t * board, int player_count, int fps) {
+  int rows, columns;
+
+  memset(renderer, 0, sizeof(*renderer));
+  renderer->board = board;
+  renderer->player_count = player_count;
+  renderer->heads = malloc(player_count * sizeof(*renderer->heads));
+  renderer->seen = calloc(player_count, sizeof(*renderer->seen));
+  renderer->far = malloc(MINIMAP_SIZE * MINIMAP_SIZE * sizeof(*renderer->far));
+  renderer->frame_interval = 1000000 / (fps > 0 ? fps : DEFAULT_FPS);
+
+  initscr();
+  noecho();
+  curs_set(FALSE);
+  cbreak();	/* Line buffering disabled. pass on everything */
+  keypad(stdscr, TRUE);
+  if (has_colors()) {
+    start_color();
+    use_default_colors();
+    for (int i = 0; i < PLAYER_COLORS; i++) {
+      init_pair(i + 1, player_colors[i], -1);
+    }
+  }
+  getmaxyx(stdscr, rows, columns);
+  resizeRenderer(renderer, rows, columns);
+}
+
+void closeRenderer(renderer_t * renderer) {
+  endwin();
+  free(renderer->trails);
+  free(renderer->screen);
+  free(renderer->dirty);
+  free(renderer->dirty_mark);
+  free(renderer->heads);
+  free(renderer->seen);
+  free(renderer->far);
+  free(renderer->far_mark);
+}
+
+// Add a cell taken by a player to the trails
+static void drawTrail(renderer_t * renderer, int x, int y, int owner) {
+  int cell;
+
+  if (x < 0 || y < 0 || x >= renderer->board->width || y >= renderer->board->height
+      || board_owner(renderer->board, x, y) == owner) {
+    return;
+  }
+  board_occupy(renderer->board, x, y, owner);
+  cell = screenCell(renderer, x, y);
+  renderer->trails[cell] = glyph(owner, 0, 0);
+  markDirty(renderer, cell);
+}
+
+/*
+    Draw the cells a player went through during ticks that had no snapshot:
+    straight on in the old direction until level with the new position,
+    then in the new direction. Exact unless the player turned twice
+    during the gap, in which case the walk stops at the given steps
+*/
+static void fillGap(renderer_t * renderer, player_status_t * from, player_status_t * to, int ticks) {
+  player_status_t walk = *from;
+  int steps = 0;
+  int horizontal = from->current_direction == LEFT || from->current_direction == RIGHT;
+
+  while (steps < ticks && (horizontal ? walk.coordinates.x_position != to->coordinates.x_position
+                                      : walk.coordinates.y_position != to->coordinates.y_position)) {
+    getNewCoordinates(&walk, renderer->board->width, renderer->board->height);
+    drawTrail(renderer, walk.coordinates.x_position, walk.coordinates.y_position, to->player_number);
+    steps++;
+  }
+  walk.current_direction = to->current_direction;
+  while (steps < ticks && (walk.coordinates.x_position != to->coordinates.x_position
+                           || walk.coordinates.y_position != to->coordinates.y_position)) {
+    getNewCoordinates(&walk, renderer->board->width, renderer->board->height);
+    drawTrail(renderer, walk.coordinates.x_position, walk.coordinates.y_position, to->player_number);
+    steps++;
+  }
+}
+
+void renderSnapshot(renderer_t * renderer, game_t * game, int ticks) {
+  player_status_t * now;
+
+  for (int i = 0; i < game->players->player_count; i++) {
+    now = &game->stati[i];
+    now->player_number = i + 1;
+    // Players out of view before or now have no gap to fill
+    if (renderer->seen_valid && ticks > 1 && renderer->seen[i].status
+        && renderer->seen[i].coordinates.x_position >= 0 && now->coordinates.x_position >= 0) {
+      fillGap(renderer, &renderer->seen[i], now, ticks);
+    }
+    drawTrail(renderer, now->coordinates.x_position, now->coordinates.y_position, i + 1);
+    renderer->seen[i] = *now;
+  }
+  renderer->seen_valid = 1;
+}
+
+void renderMinimap(renderer_t * renderer, const unsigned char * minimap, int columns, int rows) {
+  int cell;
+
+  for (int i = 0; i < renderer->far_count; i++) {
+    renderer->far_mark[renderer->far[i]] = 0;
+    markDirty(renderer, renderer->far[i]);
+  }
+  renderer->far_count = 0;
+  for (int i = 0; i < rows && i < MINIMAP_SIZE; i++) {
+    for (int j = 0; j < columns && j < MINIMAP_SIZE; j++) {
+      // The middle of the part of the board
+      cell = screenCell(renderer, (2 * j + 1) * renderer->board->width / (2 * columns),
+                        (2 * i + 1) * renderer->board->height / (2 * rows));
+      if (minimap[i * columns + j] > 0 && cell >= 0 && !renderer->far_mark[cell]) {
+        renderer->far_mark[cell] = 1;
+        renderer->far[renderer->far_count++] = cell;
+        markDirty(renderer, cell);
+      }
+    }
+  }
+}
+
+int renderFrame(renderer_t * renderer, prediction_t * prediction, long long now) {
+  int rows, columns;
+  int cell;
+  int changed = 0;
+  double x, y;
+  direction_t direction;
+  chtype wanted;
+
+  if (now < renderer->next_frame) {
+    return 0;
+  }
+  renderer->next_frame += renderer->frame_interval;
+  // Don't try to catch up with frames missed while busy
+  if (renderer->next_frame < now) {
+    renderer->next_frame = now + renderer->frame_interval;
+  }
+
+  getmaxyx(stdscr, rows, columns);
+  if (rows != renderer->rows || columns != renderer->columns) {
+    resizeRenderer(renderer, rows, columns);
+  }
+
+  // A head that moved dirties the cell it left and the one it entered
+  for (int i = 0; i < renderer->player_count; i++) {
+    cell = predictPlayer(prediction, i, now, &x, &y, &direction) ? screenCell(renderer, x, y) : -1;
+    if (cell != renderer->heads[i]) {
+      markDirty(renderer, renderer->heads[i]);
+      markDirty(renderer, cell);
+      renderer->heads[i] = cell;
+    }
+  }
+
+  for (int i = 0; i < renderer->dirty_count; i++) {
+    cell = renderer->dirty[i];
+    renderer->dirty_mark[cell] = 0;
+    wanted = renderer->trails[cell];
+    // The local player is drawn on top of the others
+    for (int j = 0; j < renderer->player_count; j++) {
+      if (renderer->heads[j] == cell && (wanted == renderer->trails[cell] || j == prediction->player_number - 1)) {
+        wanted = glyph(j + 1, 1, j == prediction->player_number - 1);
+      }
+    }
+    if (wanted == ' ' && renderer->far_mark[cell]) {
+      wanted = FAR_GLYPH;
+    }
+    if (wanted != renderer->screen[cell]) {
+      mvaddch(cell / renderer->columns, cell % renderer->columns, wanted);
+      renderer->screen[cell] = wanted;
+      changed = 1;
+    }
+  }
+  renderer->dirty_count = 0;
+
+  if (changed) {
+    refresh();
+  }
+  return 1;
+}
+
+int renderTimeout(renderer_t * renderer, long long now) {
+  if (now >= renderer->next_frame) {
+    return 0;
+  }
+  // Round up, waking early would only spin until the deadline
+  return (renderer->next_frame - now + 999) / 1000;
+}
+
+void renderMessage(renderer_t * renderer, const char * message) {
+  move(renderer->rows - 1, 0);
+  clrtoeol();
+  mvaddstr(renderer->rows - 1, 0, message);
+  // The screen no longer shows the trails of that row
+  for (int i = 0; i < renderer->columns; i++) {
+    renderer->screen[(renderer->rows - 1) * renderer->columns + i] = 0;
+  }
+  refresh();
+}
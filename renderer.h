@@ -0,0 +1,89 @@
+/*
+ * Incremental ncurses renderer for the client.
+ *
+ * Every cell a snapshot shows taken is kept in a shadow board, with the
+ * player that took it, so the whole trail can be drawn again at any time
+ * (after the terminal is resized, for instance). The screen is only touched
+ * where something changed since the last frame: new trail cells and the
+ * cells the heads left or entered. Frames are capped to a fixed rate, and a
+ * frame with nothing to draw costs no terminal output at all.
+ *
+ * On boards larger than the view of the player, the players out of view
+ * are not drawn, and a mark shows each part of the board where the last
+ * minimap counted some.
+ */
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <ncurses.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+#include "prediction.h"
+
+#define DEFAULT_FPS 60
+
+typedef struct renderer_struct {
+  // Every cell shown taken in a snapshot, with its owner
+  board_t * board;
+  int player_count;
+  // Size of the terminal the buffers were made for
+  int rows;
+  int columns;
+  // Trails at screen resolution
+  chtype * trails;
+  // What the terminal is showing
+  chtype * screen;
+  // Screen cells to check in the next frame, each listed once
+  int * dirty;
+  unsigned char * dirty_mark;
+  int dirty_count;
+  // Screen cell under the head of every player, -1 if not drawn
+  int * heads;
+  // Every player as shown by the last snapshot, to fill the cells of the
+  // snapshots that never arrived
+  player_status_t * seen;
+  int seen_valid;
+  // Screen cells marking the parts of the minimap with players
+  int * far;
+  int far_count;
+  unsigned char * far_mark;
+  // Time between frames and time of the next one, in us
+  long long frame_interval;
+  long long next_frame;
+} renderer_t;
+
+// Start ncurses and prepare the buffers for a board of the game
+void initRenderer(renderer_t * renderer, board_t * board, int player_count, int fps);
+
+// Restore the terminal and free the buffers
+void closeRenderer(renderer_t * renderer);
+
+/*
+    Add the cells of every player in a snapshot to the trails
+    ticks is the number of ticks since the last snapshot drawn, when some
+    snapshots were lost the cells in between are guessed from the
+    directions before and after
+*/
+void renderSnapshot(renderer_t * renderer, game_t * game, int ticks);
+
+/*
+    Mark the parts of the board where a minimap of columns x rows counts
+    players, replacing the marks of the last one
+*/
+void renderMinimap(renderer_t * renderer, const unsigned char * minimap, int columns, int rows);
+
+/*
+    Draw the changes since the last frame if a frame is due at time now
+    Returns 1 if a frame was due
+*/
+int renderFrame(renderer_t * renderer, prediction_t * prediction, long long now);
+
+// Time in ms until the next frame is due, to use as a poll timeout
+int renderTimeout(renderer_t * renderer, long long now);
+
+// Show a line of text at the bottom of the screen
+void renderMessage(renderer_t * renderer, const char * message);
+
+#endif
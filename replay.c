@@ -0,0 +1,238 @@
+/* TRON Multiplayer replay.
+ * Plays again a game recorded by the server with -l, without sockets or
+ * timers, as fast as the CPU allows. The final board is compared with the
+ * checksum the server wrote, so a replay proves the game was reproduced.
+ * With -r the game is played many times, as a benchmark of the simulation
+ * with the moves of a real game.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+// Custom libraries
+#include "codes.h"
+#include "fatal_error.h"
+#include "tron_simulation.h"
+#include "strip_simulation.h"
+#include "input_log.h"
+
+///// Structure definitions
+
+// Outcome of one replay
+typedef struct replay_result_struct {
+  // Simulation steps done
+  uint32_t frames;
+  // Set when a player touched a trail
+  int ended;
+  // Set when the log had the last record
+  int complete;
+  uint64_t expected_checksum;
+  uint64_t checksum;
+} replay_result_t;
+
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+unsigned char * readFile(char * path, size_t * length);
+void initReplayGame(game_t * game, log_header_t * header);
+void closeReplayGame(game_t * game);
+void replayGame(const unsigned char * log, size_t length, log_header_t * header,
+                int threads, int print, replay_result_t * result);
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[]) {
+  log_header_t header;
+  replay_result_t result;
+  unsigned char * log;
+  size_t length;
+  struct timespec start, end;
+  double seconds;
+  int repeats = 1;
+  int print = 0;
+  int threads = 1;
+  int option;
+
+  while ((option = getopt(argc, argv, "r:pt:")) != -1) {
+    switch (option) {
+      case 'r':
+        repeats = atoi(optarg);
+        break;
+      case 'p':
+        print = 1;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 || repeats <= 0 || threads <= 0) {
+    usage(argv[0]);
+  }
+
+  log = readFile(argv[optind], &length);
+  if (!readLogHeader(log, length, &header)) {
+    fprintf(stderr, "%s is not a game log\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  printf("Game of %d players on a %dx%d board, %d us per tick, seed %llu\n",
+    header.player_count, header.width, header.height, header.speed,
+    (unsigned long long)header.seed);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < repeats; i++) {
+    replayGame(log, length, &header, threads, print && i == repeats - 1, &result);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("%u frames, %s\n", result.frames,
+    result.ended ? "a player touched a trail" : "every player left");
+  printf("%d replays in %.3f s, %.1f ns per frame, %.0f frames/s (%.1fx real time)\n",
+    repeats, seconds, seconds * 1e9 / ((double)result.frames * repeats),
+    result.frames * repeats / seconds,
+    result.frames * repeats * (header.speed / 1e6) / seconds);
+  free(log);
+
+  if (!result.complete) {
+    printf("The log is truncated, the final board can't be checked\n");
+    return EXIT_FAILURE;
+  }
+  if (result.checksum != result.expected_checksum) {
+    printf("MISMATCH: final board %016llx, the server had %016llx\n",
+      (unsigned long long)result.checksum, (unsigned long long)result.expected_checksum);
+    return EXIT_FAILURE;
+  }
+  printf("Final board matches the server (%016llx)\n", (unsigned long long)result.checksum);
+  return EXIT_SUCCESS;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program) {
+  printf("Usage:\n");
+  printf("\t%s [-r repeats] [-p] [-t threads] {log_file}\n", program);
+  printf("\t-r: play the game this many times and report the speed\n");
+  printf("\t-p: print the final board\n");
+  printf("\t-t: split the board between this many threads, like server -t\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+    Load a whole file in memory, so the replay doesn't wait for the disk
+*/
+unsigned char * readFile(char * path, size_t * length) {
+  unsigned char * buffer;
+  FILE * file = fopen(path, "rb");
+  long size;
+
+  if (file == NULL) {
+    fatalError(path);
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  buffer = malloc(size > 0 ? size : 1);
+  if (buffer == NULL || fread(buffer, 1, size, file) != (size_t)size) {
+    fatalError("ERROR: reading the log");
+  }
+  fclose(file);
+  *length = size;
+  return buffer;
+}
+
+/*
+    Prepare the game exactly as the room did:
+    the players take their start in order, drawing from the same seed
+*/
+void initReplayGame(game_t * game, log_header_t * header) {
+  game->status = 1;
+  game->speed = header->speed;
+  game->board = create_board(header->width, header->height);
+  game->players = calloc(1, sizeof(*game->players));
+  game->players->player_count = header->player_count;
+  game->players->connected_players = header->player_count;
+  game->stati = calloc(header->player_count, sizeof(*game->stati));
+  seed_random(&game->random_state, header->seed);
+  for (int i = 0; i < header->player_count; i++) {
+    game->stati[i].player_number = i + 1;
+    game->stati[i].current_direction = getStartDirection(&game->random_state);
+    game->stati[i].coordinates = getStartPosition(game->board, i + 1, &game->random_state);
+    game->stati[i].status = 1;
+  }
+}
+
+void closeReplayGame(game_t * game) {
+  free_board(game->board);
+  free(game->stati);
+  free(game->players);
+}
+
+/*
+    Play the whole log once
+    The moves of a record are applied right before the frame they belong to
+*/
+void replayGame(const unsigned char * log, size_t length, log_header_t * header,
+                int threads, int print, replay_result_t * result) {
+  game_t game;
+  strip_simulation_t * strips = NULL;
+  log_record_t record;
+  size_t offset = LOG_HEADER_SIZE;
+  int player_number;
+  direction_t direction;
+  int running = 1;
+
+  memset(result, 0, sizeof(*result));
+  initReplayGame(&game, header);
+  if (threads > 1) {
+    strips = create_strip_simulation(game.board, threads);
+  }
+  while (running && readLogRecord(log, length, &offset, &record)) {
+    // Nobody turned in the frames between records
+    while (running && result->frames < record.frame) {
+      running = strips != NULL
+        ? strip_simulation(strips, game.stati, header->player_count)
+        : game_simulation(game.board, game.stati, header->player_count);
+      result->frames++;
+    }
+    if (record.end) {
+      result->complete = 1;
+      result->expected_checksum = record.checksum;
+      break;
+    }
+    for (int i = 0; i < record.input_count; i++) {
+      getLogInput(&record, i, &player_number, &direction);
+      if (player_number >= 1 && player_number <= header->player_count) {
+        game.stati[player_number - 1].current_direction = direction;
+      }
+    }
+  }
+  // The server stopped at the same frame, the last record tells it apart
+  // from a log cut short
+  if (running == 0) {
+    result->ended = 1;
+    while (!result->complete && readLogRecord(log, length, &offset, &record)) {
+      if (record.end) {
+        result->complete = 1;
+        result->expected_checksum = record.checksum;
+      }
+    }
+  }
+  result->checksum = board_checksum(game.board);
+  if (print) {
+    print_board(game.board);
+  }
+  if (strips != NULL) {
+    free_strip_simulation(strips);
+  }
+  closeReplayGame(&game);
+}
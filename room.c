@@ -0,0 +1,1012 @@
+/* TRON Multiplayer Server rooms.
+ * A room is one independent game with its own players, board and tick timer.
+ * Every room has its own epoll instance watching its sockets and its timer,
+ * so the whole room can be serviced by whichever worker thread picks it up.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "room.h"
+#include "fatal_error.h"
+
+// Most events handled in one pass over the room
+#define MAX_EVENTS 64
+// Most different delta baselines written per step, other clients get keyframes
+#define DELTA_CACHE 8
+// Time between two reports of the tick jitter and overruns, in us
+#define TICK_REPORT_INTERVAL 10000000
+// Room for a report of the tick statistics
+#define TICK_REPORT_SIZE 128
+
+// Deltas written in one step, shared by the clients with the same baseline
+typedef struct delta_cache_struct {
+  uint32_t baselines[DELTA_CACHE];
+  shared_buffer_t * buffers[DELTA_CACHE];
+  int count;
+} delta_cache_t;
+
+// use for printing debug info
+// #define DEBUG
+
+///// FUNCTION DECLARATIONS
+static void initGame(game_t * game_data, int player_c, int width, int height, int speed, uint64_t seed);
+static void openRoomLog(room_t * room);
+static void addPlayer(room_t * room, connection_t * connection);
+static void openDatagramSocket(room_t * room);
+static void readDatagrams(room_t * room);
+static connection_t * findDatagramPeer(room_t * room, const struct sockaddr_storage * address);
+static void processInputs(room_t * room, connection_t * connection, const unsigned char * payload, size_t length);
+static void closeGame(game_t * game_data);
+static void reportTicks(room_t * room);
+static int readConnection(room_t * room, connection_t * connection);
+static void processHandshake(room_t * room, connection_t * connection, char * message);
+static void processMove(room_t * room, connection_t * connection, int direction);
+static void processPing(room_t * room, connection_t * connection, char * message, size_t length);
+static void sampleRoundTrip(connection_t * connection, long long sample, long long now);
+static void queueBuffer(room_t * room, connection_t * connection, shared_buffer_t * buffer);
+static void queueFrame(room_t * room, connection_t * connection, shared_buffer_t * buffer);
+static int prepareFrames(room_t * room, connection_t * connection, long long now);
+static int flushConnection(room_t * room, connection_t * connection);
+static void closeConnection(room_t * room, connection_t * connection);
+static shared_buffer_t * getDelta(room_t * room, delta_cache_t * cache, uint32_t baseline, size_t max_size);
+static void advanceFrame(room_t * room);
+static void sendView(room_t * room, connection_t * connection, shared_buffer_t * minimap);
+static void publishRoomFrame(room_t * room);
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Function to initialize all the information necessary
+    This will allocate memory for the board and the players
+*/
+static void initGame(game_t * game_data, int player_c, int width, int height, int speed, uint64_t seed) {
+  // Game hasn's started
+  game_data->status = 0;
+  // Initialize board, its chunks are allocated as the trails reach them
+  game_data->board = create_board(width, height);
+  // Initialize player stati
+  game_data->stati = malloc(player_c * sizeof(*game_data->stati));
+  // Initialize players
+  game_data->players = malloc(sizeof *game_data->players);
+  // Initialize connected player count
+  game_data->players->connected_players = 0;
+  // Initialize players ready count
+  game_data->players->players_ready = 0;
+  // Set the number of players
+  game_data->players->player_count = player_c;
+  // Set game speed
+  game_data->speed = speed;
+  // Start positions come from the seed of the game
+  seed_random(&game_data->random_state, seed);
+}
+
+/*
+    Free all the memory used for the game data
+*/
+static void closeGame(game_t * game_data) {
+  free_board(game_data->board);
+  free(game_data->stati);
+  free(game_data->players);
+}
+
+/*
+    Create an empty room waiting for player_c players
+    The same seed and the same moves always give the same game
+*/
+room_t * createRoom(int id, int player_c, int width, int height, int view_radius, int speed,
+                    int simulation_threads, long long lag_budget, broadcast_t * broadcast,
+                    uint64_t seed, const char * log_directory) {
+  struct epoll_event event;
+  room_t * room = calloc(1, sizeof(*room));
+
+  if (room == NULL) {
+    fatalError("ERROR: calloc");
+  }
+  room->id = id;
+  room->udp_fd = -1;
+  room->seed = seed;
+  room->log_directory = log_directory;
+  room->lag_budget = lag_budget;
+  initGame(&room->game_data, player_c, width, height, speed, seed);
+  room->connections = calloc(player_c, sizeof(*room->connections));
+  pthread_mutex_init(&room->lock, NULL);
+  initTickScheduler(&room->ticker, speed >= MIN_TICK ? speed : MIN_TICK);
+  initDeltaHistory(&room->history, player_c);
+  initViewGrid(&room->view, width, height, player_c, view_radius);
+  if (simulation_threads > 1) {
+    room->strips = create_strip_simulation(room->game_data.board, simulation_threads);
+  }
+  initFramePublisher(&room->frames, player_c);
+  room->channel = openChannel(broadcast, &room->frames, id, player_c, width, height, room->ticker.period);
+
+  room->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (room->epoll_fd == -1) {
+    fatalError("ERROR: epoll_create1");
+  }
+  // The timer is told apart from the sockets by its address
+  event.events = EPOLLIN;
+  event.data.ptr = &room->ticker;
+  if (epoll_ctl(room->epoll_fd, EPOLL_CTL_ADD, room->ticker.timer_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+  return room;
+}
+
+/*
+    Whether the room already has all its players
+*/
+int roomIsFull(room_t * room) {
+  return room->accepted_players >= room->game_data.players->player_count;
+}
+
+/*
+    Add a connected socket to the room as its next player
+    The game starts when the last player is added
+    Returns 1 if the room started, after that only the workers may touch it
+*/
+int roomAddConnection(room_t * room, int client_fd) {
+  struct epoll_event event;
+  connection_t * connection;
+  int started;
+
+  pthread_mutex_lock(&room->lock);
+  connection = calloc(1, sizeof(*connection));
+  connection->connection_fd = client_fd;
+  connection->transport = TRANSPORT_TCP;
+  initStream(&connection->stream, client_fd, BUFFER_SIZE);
+
+  event.events = EPOLLIN;
+  event.data.ptr = connection;
+  if (epoll_ctl(room->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+
+  addPlayer(room, connection);
+  started = room->game_data.status;
+  pthread_mutex_unlock(&room->lock);
+  return started;
+}
+
+/*
+    Add a UDP player that sent a connect frame from address
+    accept gets the settings to send back to the player
+    Returns 1 if the room started, like roomAddConnection
+*/
+int roomAddDatagramPeer(room_t * room, const struct sockaddr_storage * address,
+                        socklen_t address_length, accept_t * accept) {
+  game_t * game_data = &room->game_data;
+  connection_t * connection;
+  int started;
+
+  pthread_mutex_lock(&room->lock);
+  if (room->udp_fd == -1) {
+    openDatagramSocket(room);
+  }
+  // The connect frame is the whole handshake, UDP always uses the newest
+  // binary protocol, with views when the board is larger than the view
+  connection = calloc(1, sizeof(*connection));
+  connection->connection_fd = room->udp_fd;
+  connection->transport = TRANSPORT_UDP;
+  connection->address = *address;
+  connection->address_length = address_length;
+  connection->protocol = viewCulls(&room->view) ? PROTOCOL_VIEW : PROTOCOL_DELTA;
+  connection->joined = 1;
+  connection->last_heard = monotonicMicros();
+
+  addPlayer(room, connection);
+  accept->player_count = game_data->players->player_count;
+  accept->width = game_data->board->width;
+  accept->height = game_data->board->height;
+  accept->player_number = connection->player_number;
+  accept->tick_period = room->ticker.period;
+  accept->port = room->udp_port;
+  started = game_data->status;
+  pthread_mutex_unlock(&room->lock);
+  return started;
+}
+
+/*
+    Give the next player number to a connection and place the player on
+    the board, starting the game once the room is full
+    The room lock must be held
+*/
+static void addPlayer(room_t * room, connection_t * connection) {
+  game_t * game_data = &room->game_data;
+  int player = ++room->accepted_players;
+
+  // Update player data
+  game_data->players->connected_players++;
+  game_data->stati[player - 1].player_number = player;
+  game_data->stati[player - 1].current_direction = getStartDirection(&game_data->random_state);
+  game_data->stati[player - 1].coordinates = getStartPosition(game_data->board, player, &game_data->random_state);
+  game_data->stati[player - 1].status = 1;
+
+  connection->player_number = player;
+  room->connections[player - 1] = connection;
+
+  if (roomIsFull(room)) {
+    logMessage(LEVEL_INFO, "Room %d: all players have connected, starting game with seed %llu...",
+      room->id, (unsigned long long)room->seed);
+    game_data->status = 1;
+    startDeltaHistory(&room->history, game_data->stati);
+    publishRoomFrame(room);
+    openRoomLog(room);
+    startTickScheduler(&room->ticker);
+  }
+}
+
+/*
+    Open the socket of the UDP players on a free port, watched by the room
+    like the timer, told apart by its address
+*/
+static void openDatagramSocket(room_t * room) {
+  struct epoll_event event;
+
+  room->udp_fd = initUdpSocket(NULL);
+  room->udp_port = getSocketPort(room->udp_fd);
+  room->incoming = malloc(sizeof(*room->incoming));
+  room->outgoing = malloc(sizeof(*room->outgoing));
+  room->outgoing->count = 0;
+  room->outgoing->bytes_sent = 0;
+
+  event.events = EPOLLIN;
+  event.data.ptr = &room->udp_fd;
+  if (epoll_ctl(room->epoll_fd, EPOLL_CTL_ADD, room->udp_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+}
+
+/*
+    Start the input log of a game that is starting
+*/
+static void openRoomLog(room_t * room) {
+  char path[BUFFER_SIZE];
+
+  if (room->log_directory == NULL) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/room%d-%llu.tlog", room->log_directory, room->id,
+    (unsigned long long)room->seed);
+  if (!openInputLog(&room->log, path, &room->game_data, room->seed)) {
+    logMessage(LEVEL_ERROR, "%s: %s", path, strerror(errno));
+  }
+}
+
+/*
+    Handle every event pending in the room without blocking:
+    socket reads and writes, and the tick timer
+    Returns 0 once the room has finished
+*/
+int serviceRoom(room_t * room) {
+  struct epoll_event events[MAX_EVENTS];
+  game_t * game_data = &room->game_data;
+  int event_count;
+
+  pthread_mutex_lock(&room->lock);
+  do {
+    event_count = epoll_wait(room->epoll_fd, events, MAX_EVENTS, 0);
+    if (event_count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatalError("ERROR: epoll_wait");
+    }
+
+    for (int i = 0; i < event_count && !room->finished; i++) {
+      connection_t * connection = events[i].data.ptr;
+
+      // The tick deadline passed
+      if (events[i].data.ptr == &room->ticker) {
+        if (nextTick(&room->ticker) >= 0) {
+          advanceFrame(room);
+          reportTicks(room);
+        }
+        continue;
+      }
+      // Datagrams from the UDP players
+      if (events[i].data.ptr == &room->udp_fd) {
+        readDatagrams(room);
+        continue;
+      }
+      // Already closed earlier in this batch
+      if (connection->connection_fd == -1) {
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        closeConnection(room, connection);
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && !flushConnection(room, connection)) {
+        closeConnection(room, connection);
+        continue;
+      }
+      if ((events[i].events & EPOLLIN) && !readConnection(room, connection)) {
+        closeConnection(room, connection);
+      }
+    }
+
+    if (game_data->status && game_data->players->connected_players == 0) {
+      room->finished = 1;
+    }
+  // A full batch may have left more events behind
+  } while (event_count == MAX_EVENTS && !room->finished);
+  pthread_mutex_unlock(&room->lock);
+
+  return !room->finished;
+}
+
+/*
+    Read everything available on the socket and process each complete message
+    The handshake and the text protocol end every message with '\0',
+    the binary protocol uses the payload length of the frame header
+    Returns 0 if the connection has finished
+*/
+static int readConnection(room_t * room, connection_t * connection) {
+  stream_t * stream = &connection->stream;
+  frame_header_t header;
+  ssize_t chars_read;
+  size_t space;
+  char * message;
+  size_t length;
+  int result;
+  int direction;
+
+  do {
+    space = stream->in_capacity - stream->in_length;
+    chars_read = streamFill(stream);
+    if (chars_read == 0) {
+      logMessage(LEVEL_INFO, "Connection disconnected");
+      return 0;
+    }
+    if (chars_read > 0) {
+      addCounter(COUNTER_BYTES_IN, chars_read);
+    }
+    if (chars_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      logMessage(LEVEL_ERROR, "recv: %s", strerror(errno));
+      return 0;
+    }
+
+    // Process every complete message of this read
+    while ((result = streamNextMessage(stream, &message, &length)) == 1) {
+      if (!connection->joined) {
+        processHandshake(room, connection, message);
+      } else if (connection->protocol >= PROTOCOL_BINARY) {
+        if (decodeHeader((unsigned char *)message, length, &header) != 1) {
+          return 0;
+        }
+        if (header.type == MSG_INPUT) {
+          processMove(room, connection,
+            decodeInput((unsigned char *)message + HEADER_SIZE, header.payload_length));
+        } else if (header.type == MSG_PING) {
+          processPing(room, connection, message, length);
+        }
+      } else if (sscanf(message, "%d", &direction) == 1) {
+        processMove(room, connection, direction);
+      }
+    }
+    if (result == -1) {
+      return 0;
+    }
+    // A read that filled the ring may have left more data in the socket
+  } while (chars_read > 0 && (size_t)chars_read == space);
+
+  return 1;
+}
+
+/*
+    Process every datagram waiting on the socket of the UDP players
+    Datagrams from unknown addresses or that are not valid frames are ignored,
+    the answers are sent together at the end
+*/
+static void readDatagrams(room_t * room) {
+  datagram_batch_t * batch = room->incoming;
+  connection_t * connection;
+  frame_header_t header;
+  unsigned char * datagram;
+  size_t length;
+  unsigned char pong[MAX_CLIENT_FRAME];
+  int received;
+
+  do {
+    received = receiveDatagrams(room->udp_fd, batch);
+    if (received == -1) {
+      logMessage(LEVEL_ERROR, "recvmmsg: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < received; i++) {
+      datagram = batch->buffers[i];
+      length = batch->messages[i].msg_len;
+      addCounter(COUNTER_BYTES_IN, length);
+      connection = findDatagramPeer(room, &batch->addresses[i]);
+      if (connection == NULL || decodeHeader(datagram, length, &header) != 1
+          || header.payload_length != length - HEADER_SIZE) {
+        continue;
+      }
+      connection->last_heard = monotonicMicros();
+      if (header.type == MSG_INPUTS) {
+        // The tick of an inputs frame acknowledges a step as a baseline,
+        // the client answers every frame, so the first one for a step
+        // times the round trip
+        if ((int32_t)(header.tick - connection->baseline) > 0 && header.tick <= room->frame) {
+          connection->baseline = header.tick;
+          if (room->frame - header.tick < DELTA_HISTORY) {
+            sampleRoundTrip(connection, connection->last_heard - room->step_times[header.tick % DELTA_HISTORY],
+              connection->last_heard);
+          }
+        }
+        processInputs(room, connection, datagram + HEADER_SIZE, header.payload_length);
+      } else if (header.type == MSG_PING && length <= MAX_CLIENT_FRAME) {
+        encodePong(datagram, length, pong);
+        queueDatagram(room->udp_fd, room->outgoing, &connection->address, connection->address_length,
+          pong, length, NULL, 0);
+      }
+    }
+  // A full batch may have left more datagrams behind
+  } while (received == DATAGRAM_BATCH);
+  sendDatagrams(room->udp_fd, room->outgoing);
+}
+
+/*
+    The UDP player whose datagrams come from address, NULL if there is none
+*/
+static connection_t * findDatagramPeer(room_t * room, const struct sockaddr_storage * address) {
+  const struct sockaddr_in * from = (const struct sockaddr_in *)address;
+  const struct sockaddr_in * peer;
+  connection_t * connection;
+
+  for (int i = 0; i < room->accepted_players; i++) {
+    connection = room->connections[i];
+    peer = (const struct sockaddr_in *)&connection->address;
+    if (connection->transport == TRANSPORT_UDP && connection->connection_fd != -1
+        && peer->sin_port == from->sin_port && peer->sin_addr.s_addr == from->sin_addr.s_addr) {
+      return connection;
+    }
+  }
+  return NULL;
+}
+
+/*
+    Queue the moves of an inputs frame that were not received before
+    Every frame repeats the moves not acknowledged yet, so the sequence
+    numbers tell the new ones apart
+*/
+static void processInputs(room_t * room, connection_t * connection, const unsigned char * payload, size_t length) {
+  const unsigned char * directions;
+  uint32_t first_sequence;
+  uint32_t sequence;
+  int count = decodeInputs(payload, length, &first_sequence, &directions);
+
+  for (int i = 0; i < count; i++) {
+    sequence = first_sequence + i;
+    // Signed difference, the sequence may wrap around
+    if ((int32_t)(sequence - connection->input_sequence) > 0) {
+      processMove(room, connection, directions[i]);
+      connection->input_sequence = sequence;
+    }
+  }
+}
+
+/*
+    Answer the GAME handshake with the size of the game
+    The client may append the highest protocol version it speaks,
+    clients that don't are served with the text protocol
+*/
+static void processHandshake(room_t * room, connection_t * connection, char * message) {
+  game_t * game_data = &room->game_data;
+  char buffer[BUFFER_SIZE];
+  shared_buffer_t * reply;
+  int operation;
+  int version = PROTOCOL_TEXT;
+
+  if (sscanf(message, "%d %d", &operation, &version) < 1 || operation != GAME) {
+    // error
+    return;
+  }
+  connection->protocol = version > PROTOCOL_VERSION ? PROTOCOL_VERSION
+    : version >= PROTOCOL_BINARY ? version : PROTOCOL_TEXT;
+  // Deltas are smaller when every player is in view anyway
+  if (connection->protocol == PROTOCOL_VIEW && !viewCulls(&room->view)) {
+    connection->protocol = PROTOCOL_DELTA;
+  }
+  if (connection->protocol >= PROTOCOL_BINARY) {
+    setStreamFraming(&connection->stream, FRAME_LENGTH_PREFIXED, HEADER_SIZE, 8,
+      MAX_CLIENT_FRAME);
+  }
+
+  sprintf(buffer, "%d,%d,%d,%d,%d,%lld",
+    game_data->players->player_count,
+    game_data->board->width,
+    game_data->board->height,
+    connection->protocol,
+    connection->player_number,
+    room->ticker.period);
+  reply = sharedBufferFromString(buffer);
+  queueBuffer(room, connection, reply);
+  releaseSharedBuffer(reply);
+  connection->joined = 1;
+}
+
+/*
+    Store the new direction of a player
+*/
+static void processMove(room_t * room, connection_t * connection, int direction) {
+  if (direction < UP || direction > LEFT) {
+    return;
+  }
+  logMessage(LEVEL_DEBUG, "Received %d from player %d in room %d", direction, connection->player_number, room->id);
+  // Keep the moves in order so quick turns are applied on consecutive ticks
+  if (connection->input_count < INPUT_QUEUE) {
+    connection->inputs[(connection->input_head + connection->input_count) % INPUT_QUEUE] = direction;
+    connection->input_count++;
+  }
+}
+
+/*
+    Answer a ping right away with the same payload
+*/
+static void processPing(room_t * room, connection_t * connection, char * message, size_t length) {
+  shared_buffer_t * pong = createSharedBuffer(length);
+
+  encodePong((unsigned char *)message, length, (unsigned char *)pong->data);
+  queueBuffer(room, connection, pong);
+  releaseSharedBuffer(pong);
+}
+
+/*
+    Take a round trip time of a player, in us, at most once every
+    ROUND_TRIP_INTERVAL, into the metrics and its smoothed round trip
+*/
+static void sampleRoundTrip(connection_t * connection, long long sample, long long now) {
+  if (now < connection->next_round_trip) {
+    return;
+  }
+  connection->next_round_trip = now + ROUND_TRIP_INTERVAL;
+  recordDuration(HISTOGRAM_RTT, sample * 1000);
+  // Like TCP, a new sample weighs 1/8
+  connection->round_trip = connection->round_trip == 0 ? sample : (7 * connection->round_trip + sample) / 8;
+}
+
+/*
+    Add a reference to a shared buffer to the write queue of a connection
+    and try to send it right away
+*/
+static void queueBuffer(room_t * room, connection_t * connection, shared_buffer_t * buffer) {
+  int pending = streamPending(&connection->stream);
+
+  streamQueue(&connection->stream, buffer);
+  // Only try to send when nothing was pending, otherwise wait for EPOLLOUT
+  if (pending == 0 && !flushConnection(room, connection)) {
+    closeConnection(room, connection);
+  }
+}
+
+/*
+    Same as queueBuffer for a frame of the current step, which the frames
+    of the next step replace if the player didn't start reading it
+*/
+static void queueFrame(room_t * room, connection_t * connection, shared_buffer_t * buffer) {
+  int pending = streamPending(&connection->stream);
+
+  streamQueueTagged(&connection->stream, buffer, room->frame);
+  if (pending == 0 && !flushConnection(room, connection)) {
+    closeConnection(room, connection);
+  }
+}
+
+/*
+    Get a TCP player ready for the frames of a new step: the frames it
+    didn't start reading are stale and dropped, so a slow player only costs
+    the newest frame, and one behind for longer than the lag budget is
+    disconnected
+    Returns 0 if the connection was closed
+*/
+static int prepareFrames(room_t * room, connection_t * connection, long long now) {
+  int dropped = streamDropStale(&connection->stream);
+  int depth = streamPending(&connection->stream);
+
+  connection->dropped_frames += dropped;
+  room->dropped_frames += dropped;
+  if (dropped > 0) {
+    addCounter(COUNTER_FRAMES_DROPPED, dropped);
+  }
+  if (depth > room->max_queue_depth) {
+    room->max_queue_depth = depth;
+  }
+  if ((connection->backlog_since != 0 && now - connection->backlog_since > room->lag_budget)
+      || depth > MAX_QUEUED_BUFFERS) {
+    logMessage(LEVEL_WARNING, "Room %d: player %d fell behind, %llu frames dropped", room->id,
+      connection->player_number, connection->dropped_frames);
+    room->lag_disconnects++;
+    addCounter(COUNTER_LAG_DISCONNECTS, 1);
+    closeConnection(room, connection);
+    return 0;
+  }
+  // TCP delivers in order, so the next delta can start from the newest
+  // frame that started going out
+  connection->baseline = streamStartedTag(&connection->stream);
+  return 1;
+}
+
+/*
+    Write as much of the pending buffers as the socket accepts
+    Watch for EPOLLOUT only while something is left to send
+    Returns 0 if the connection has finished
+*/
+static int flushConnection(room_t * room, connection_t * connection) {
+  struct epoll_event event;
+  unsigned long long written = connection->stream.out_total;
+  int want_out;
+
+  if (!streamFlush(&connection->stream)) {
+    return 0;
+  }
+  addCounter(COUNTER_BYTES_OUT, connection->stream.out_total - written);
+
+  // Only touch the epoll registration when the interest changes
+  want_out = streamPending(&connection->stream) > 0;
+  if (!want_out) {
+    connection->backlog_since = 0;
+  } else if (connection->backlog_since == 0) {
+    connection->backlog_since = monotonicMicros();
+  }
+  if (want_out != connection->watching_out) {
+    event.data.ptr = connection;
+    event.events = want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if (epoll_ctl(room->epoll_fd, EPOLL_CTL_MOD, connection->connection_fd, &event) == -1) {
+      fatalError("ERROR: epoll_ctl");
+    }
+    connection->watching_out = want_out;
+  }
+  return 1;
+}
+
+/*
+    Remove a client from the room and free its buffers
+*/
+static void closeConnection(room_t * room, connection_t * connection) {
+  unsigned char close_frame[HEADER_SIZE];
+
+  if (connection->connection_fd == -1) {
+    return;
+  }
+  logMessage(LEVEL_DEBUG, "Room %d: player %d left, round trip %lld us", room->id,
+    connection->player_number, connection->round_trip);
+  // The socket belongs to the room, just tell the player the game is over
+  if (connection->transport == TRANSPORT_UDP) {
+    encodeEmpty(MSG_CLOSE, close_frame);
+    for (int i = 0; i < CLOSE_COPIES; i++) {
+      queueDatagram(room->udp_fd, room->outgoing, &connection->address, connection->address_length,
+        close_frame, HEADER_SIZE, NULL, 0);
+    }
+    sendDatagrams(room->udp_fd, room->outgoing);
+    connection->connection_fd = -1;
+    room->game_data.players->connected_players--;
+    return;
+  }
+  epoll_ctl(room->epoll_fd, EPOLL_CTL_DEL, connection->connection_fd, NULL);
+  close(connection->connection_fd);
+  connection->connection_fd = -1;
+
+  // Drop the references to anything that was never sent
+  closeStream(&connection->stream);
+
+  // Let the game know the client disconnected
+  room->game_data.players->connected_players--;
+}
+
+/*
+    The delta from baseline to the current step, written once per step
+    and baseline, NULL if a keyframe must be sent instead, which is also
+    the case when the delta is larger than max_size
+*/
+static shared_buffer_t * getDelta(room_t * room, delta_cache_t * cache, uint32_t baseline, size_t max_size) {
+  shared_buffer_t * delta;
+  long long started;
+
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->baselines[i] == baseline) {
+      return cache->buffers[i]->length <= max_size ? cache->buffers[i] : NULL;
+    }
+  }
+  if (cache->count == DELTA_CACHE) {
+    return NULL;
+  }
+  started = metricsNow();
+  // Never larger than the keyframe it replaces
+  delta = createDelta(&room->history, baseline, room->frame,
+    snapshotFrameSize(room->game_data.players->player_count));
+  room->serialize_time += metricsNow() - started;
+  if (delta == NULL) {
+    return NULL;
+  }
+  cache->baselines[cache->count] = baseline;
+  cache->buffers[cache->count++] = delta;
+  return delta->length <= max_size ? delta : NULL;
+}
+
+/*
+    Apply the moves that arrived before the deadline, simulate one step
+    and send the new state to every player
+    Clients of the delta protocol get what changed since their baseline,
+    or a keyframe when they have none or it is too old. Clients of the view
+    protocol get the players around them, and every MINIMAP_INTERVAL steps
+    the minimap. The last step of a game is always a keyframe, it may stop
+    halfway through the players
+*/
+static void advanceFrame(room_t * room) {
+  game_t * game_data = &room->game_data;
+  connection_t * connection;
+  shared_buffer_t * snapshot = NULL;
+  shared_buffer_t * text_snapshot = NULL;
+  shared_buffer_t * frame;
+  shared_buffer_t * minimap = NULL;
+  delta_cache_t deltas;
+  char * compressed = NULL;
+  unsigned char prefix[HEADER_SIZE + INPUT_ACK_SIZE];
+  struct tcp_info info;
+  socklen_t info_length = sizeof(info);
+  long long now = monotonicMicros();
+  long long started = metricsNow();
+  long long encode_start;
+  long long mark;
+  int winner;
+
+  // Players without a new move keep their last direction,
+  // the eliminated ones don't move any more
+  game_data->players->players_ready = 0;
+  for (int i = 0; i < room->accepted_players; i++) {
+    connection = room->connections[i];
+    if (connection->input_count > 0 && game_data->stati[i].status) {
+      game_data->stati[i].current_direction = connection->inputs[connection->input_head];
+      logInput(&room->log, i + 1, game_data->stati[i].current_direction);
+      connection->input_head = (connection->input_head + 1) % INPUT_QUEUE;
+      connection->input_count--;
+      game_data->players->players_ready++;
+    }
+  }
+
+  logFrame(&room->log);
+
+  mark = metricsNow();
+  if (!(room->strips != NULL
+        ? strip_simulation(room->strips, game_data->stati, game_data->players->player_count)
+        : game_simulation(game_data->board, game_data->stati, game_data->players->player_count))) {
+    // The game is over, the players see the connection close
+    winner = 0;
+    for (int i = 0; i < game_data->players->player_count; i++) {
+      if (game_data->stati[i].status) {
+        winner = i + 1;
+      }
+    }
+    if (winner) {
+      logMessage(LEVEL_INFO, "Room %d: game has ended, player %d won", room->id, winner);
+    } else {
+      logMessage(LEVEL_INFO, "Room %d: game has ended", room->id);
+    }
+    room->finished = 1;
+  }
+  recordDuration(HISTOGRAM_SIMULATION, metricsNow() - mark);
+  room->frame++;
+  recordDeltaStep(&room->history, room->frame, game_data->stati);
+  publishRoomFrame(room);
+  #ifdef DEBUG
+    print_board(game_data->board);
+  #endif
+  // The rest is either writing the frames or sending them, the first
+  // adds up its time in serialize_time
+  mark = metricsNow();
+  room->serialize_time = 0;
+  if (viewCulls(&room->view)) {
+    buildViewGrid(&room->view, game_data->stati);
+    if (room->frame % MINIMAP_INTERVAL == 1) {
+      minimap = createSharedBuffer(room->view.minimap_columns * room->view.minimap_rows);
+      memcpy(minimap->data, room->view.minimap, minimap->length);
+    }
+    room->serialize_time += metricsNow() - mark;
+  }
+
+  // Serialize once per protocol and baseline, connections share the buffers
+  deltas.count = 0;
+  for (int i = 0; i < room->accepted_players; i++) {
+    connection = room->connections[i];
+    if (connection->connection_fd == -1 || !connection->joined) {
+      continue;
+    }
+    if (connection->transport == TRANSPORT_UDP && now - connection->last_heard > UDP_TIMEOUT) {
+      logMessage(LEVEL_WARNING, "Room %d: player %d timed out", room->id, connection->player_number);
+      closeConnection(room, connection);
+      continue;
+    }
+    if (connection->transport == TRANSPORT_TCP && !prepareFrames(room, connection, now)) {
+      continue;
+    }
+    // The kernel times the TCP players already
+    if (connection->transport == TRANSPORT_TCP && now >= connection->next_round_trip
+        && getsockopt(connection->connection_fd, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0) {
+      sampleRoundTrip(connection, info.tcpi_rtt, now);
+    }
+    if (connection->protocol == PROTOCOL_VIEW && !room->finished) {
+      sendView(room, connection, minimap);
+    } else if (connection->protocol >= PROTOCOL_BINARY) {
+      frame = NULL;
+      if (connection->protocol == PROTOCOL_DELTA && !room->finished) {
+        // Over UDP the delta must fit in one datagram with the acknowledgement
+        frame = getDelta(room, &deltas, connection->baseline, connection->transport == TRANSPORT_UDP
+          ? MAX_DATAGRAM - INPUT_ACK_SIZE : snapshotFrameSize(game_data->players->player_count));
+      }
+      if (frame == NULL) {
+        if (snapshot == NULL) {
+          encode_start = metricsNow();
+          snapshot = createSharedBuffer(snapshotFrameSize(game_data->players->player_count));
+          encodeSnapshot(game_data, room->frame, (unsigned char *)snapshot->data, snapshot->length);
+          room->serialize_time += metricsNow() - encode_start;
+        }
+        frame = snapshot;
+      }
+      if (connection->transport == TRANSPORT_UDP) {
+        // Only the header and the acknowledgement differ, the rest is shared
+        encodeSnapshotAck(frame == snapshot ? MSG_SNAPSHOT : MSG_DELTA, room->frame,
+          connection->input_sequence, frame->length - HEADER_SIZE, prefix);
+        queueDatagram(room->udp_fd, room->outgoing, &connection->address, connection->address_length,
+          prefix, sizeof(prefix), frame->data + HEADER_SIZE, frame->length - HEADER_SIZE);
+      } else {
+        queueFrame(room, connection, frame);
+      }
+    } else {
+      if (text_snapshot == NULL) {
+        encode_start = metricsNow();
+        compressed = compressGame(game_data);
+        text_snapshot = sharedBufferFromString(compressed);
+        free(compressed);
+        room->serialize_time += metricsNow() - encode_start;
+      }
+      logMessage(LEVEL_DEBUG, "Sending message %s to %d", text_snapshot->data, connection->player_number);
+      queueFrame(room, connection, text_snapshot);
+    }
+  }
+  // The batch points into the buffers, send it before releasing them
+  if (room->udp_fd != -1) {
+    sendDatagrams(room->udp_fd, room->outgoing);
+    room->step_times[room->frame % DELTA_HISTORY] = monotonicMicros();
+    addCounter(COUNTER_BYTES_OUT, room->outgoing->bytes_sent - room->datagram_bytes);
+    room->datagram_bytes = room->outgoing->bytes_sent;
+  }
+  recordDuration(HISTOGRAM_SERIALIZATION, room->serialize_time);
+  recordDuration(HISTOGRAM_SEND, metricsNow() - mark - room->serialize_time);
+  if (snapshot != NULL) {
+    releaseSharedBuffer(snapshot);
+  }
+  if (minimap != NULL) {
+    releaseSharedBuffer(minimap);
+  }
+  for (int i = 0; i < deltas.count; i++) {
+    releaseSharedBuffer(deltas.buffers[i]);
+  }
+  if (text_snapshot != NULL) {
+    releaseSharedBuffer(text_snapshot);
+  }
+  addCounter(COUNTER_TICKS, 1);
+  recordDuration(HISTOGRAM_TICK, metricsNow() - started);
+}
+
+/*
+    Send a player the players in view of its head, and the minimap if
+    there is one this step
+    Only the records are written for each player, the minimap is written
+    once and copied after them
+*/
+static void sendView(room_t * room, connection_t * connection, shared_buffer_t * minimap) {
+  unsigned char prefix[HEADER_SIZE + INPUT_ACK_SIZE + VIEW_START_SIZE + VIEW_MAX_PLAYERS * VIEW_RECORD_SIZE];
+  uint16_t players[VIEW_MAX_PLAYERS];
+  size_t minimap_length = minimap != NULL ? minimap->length : 0;
+  int columns = minimap != NULL ? room->view.minimap_columns : 0;
+  int rows = minimap != NULL ? room->view.minimap_rows : 0;
+  shared_buffer_t * frame;
+  size_t body;
+  int count;
+  long long started = metricsNow();
+
+  count = queryView(&room->view, room->game_data.stati, connection->player_number - 1, players, VIEW_MAX_PLAYERS);
+  body = viewBodySize(count);
+  if (connection->transport == TRANSPORT_UDP) {
+    encodeSnapshotAck(MSG_VIEW, room->frame, connection->input_sequence, body + minimap_length, prefix);
+    encodeViewBody(room->game_data.stati, players, count, columns, rows, prefix + HEADER_SIZE + INPUT_ACK_SIZE);
+    room->serialize_time += metricsNow() - started;
+    queueDatagram(room->udp_fd, room->outgoing, &connection->address, connection->address_length,
+      prefix, HEADER_SIZE + INPUT_ACK_SIZE + body, minimap != NULL ? minimap->data : NULL, minimap_length);
+    return;
+  }
+  // The minimap is copied into the frame: a slow player may have the frame
+  // dropped, and it must never lose only one part of it
+  frame = createSharedBuffer(HEADER_SIZE + body + minimap_length);
+  encodeHeader((unsigned char *)frame->data, MSG_VIEW, room->frame, body + minimap_length);
+  encodeViewBody(room->game_data.stati, players, count, columns, rows, (unsigned char *)frame->data + HEADER_SIZE);
+  if (minimap != NULL) {
+    memcpy(frame->data + HEADER_SIZE + body, minimap->data, minimap_length);
+  }
+  room->serialize_time += metricsNow() - started;
+  queueFrame(room, connection, frame);
+  releaseSharedBuffer(frame);
+}
+
+/*
+    Copy the step just completed into a free frame and make it the one
+    other threads read
+*/
+static void publishRoomFrame(room_t * room) {
+  game_t * game_data = &room->game_data;
+  game_frame_t * frame = beginFrame(&room->frames);
+
+  frame->step = room->frame;
+  frame->connected_players = game_data->players->connected_players;
+  frame->players_ready = game_data->players->players_ready;
+  frame->finished = room->finished;
+  memcpy(frame->stati, game_data->stati, game_data->players->player_count * sizeof(*frame->stati));
+  publishFrame(&room->frames, frame);
+  notifyChannel(room->channel);
+}
+
+/*
+    Log the jitter and overruns of the ticks every TICK_REPORT_INTERVAL
+    of game time
+*/
+static void reportTicks(room_t * room) {
+  char report[TICK_REPORT_SIZE];
+
+  if (tickWindowLength(&room->ticker) >= TICK_REPORT_INTERVAL
+      && formatTickStats(&room->ticker, report, sizeof(report))) {
+    logMessage(LEVEL_INFO, "Room %d: %s", room->id, report);
+  }
+}
+
+/*
+    Close every connection of the room and free it
+*/
+void closeRoom(room_t * room) {
+  connection_t * connection;
+
+  if (room->game_data.status) {
+    logMessage(LEVEL_INFO, "Room %d finished after %llu ticks, max jitter %lld us, %llu overruns, %d board chunks",
+      room->id, room->ticker.tick, room->ticker.total_jitter_max, room->ticker.total_overruns,
+      room->game_data.board->chunk_count);
+    logMessage(LEVEL_INFO, "Room %d: %llu frames dropped for slow players, %d disconnected, at most %d buffers queued",
+      room->id, room->dropped_frames, room->lag_disconnects, room->max_queue_depth);
+    closeInputLog(&room->log, room->game_data.board);
+  }
+  for (int i = 0; i < room->accepted_players; i++) {
+    connection = room->connections[i];
+    // Try to deliver the last snapshot before closing
+    if (connection->connection_fd != -1 && connection->transport == TRANSPORT_TCP) {
+      streamFlush(&connection->stream);
+    }
+    closeConnection(room, connection);
+    free(connection);
+  }
+  free(room->connections);
+  if (room->udp_fd != -1) {
+    close(room->udp_fd);
+    free(room->incoming);
+    free(room->outgoing);
+  }
+  closeTickScheduler(&room->ticker);
+  closeDeltaHistory(&room->history);
+  closeViewGrid(&room->view);
+  if (room->strips != NULL) {
+    free_strip_simulation(room->strips);
+  }
+  // The spectators may still be reading the frames until then
+  closeChannel(room->channel);
+  closeFramePublisher(&room->frames);
+  close(room->epoll_fd);
+  pthread_mutex_destroy(&room->lock);
+  closeGame(&room->game_data);
+  free(room);
+}
@@ -0,0 +1,191 @@
+/* TRON Multiplayer Server rooms.
+ * A room is one independent game with its own players, board and tick timer.
+ * Every room has its own epoll instance watching its sockets and its timer,
+ * so the whole room can be serviced by whichever worker thread picks it up.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <pthread.h>
+
+#include "codes.h"
+#include "sockets.h"
+#include "tron_simulation.h"
+#include "strip_simulation.h"
+#include "tick_scheduler.h"
+#include "shared_buffer.h"
+#include "input_log.h"
+#include "protocol.h"
+#include "delta.h"
+#include "view.h"
+#include "game_frame.h"
+#include "broadcast.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define BUFFER_SIZE 1024
+// Moves kept per player between ticks, extra ones are dropped
+#define INPUT_QUEUE 8
+// Minimum time between ticks in microseconds
+#define MIN_TICK 10000
+// UDP players silent for longer than this are disconnected, in us
+#define UDP_TIMEOUT 5000000
+// Copies of the close frame sent to a UDP player, in case some are lost
+#define CLOSE_COPIES 3
+// Steps between two views that carry the minimap
+#define MINIMAP_INTERVAL 10
+// TCP players that can't take the frames for longer than this are
+// disconnected, in us
+#define LAG_BUDGET 3000000
+// Buffers queued for a TCP player, beyond this it is disconnected
+#define MAX_QUEUED_BUFFERS 256
+// Time between two round trip samples of a player, in us
+#define ROUND_TRIP_INTERVAL 1000000
+
+typedef enum transport_type {TRANSPORT_TCP, TRANSPORT_UDP} transport_t;
+
+// State kept for every client socket
+typedef struct connection_struct {
+  // The file descriptor for the socket, -1 once closed
+  // UDP players share the socket of the room
+  int connection_fd;
+  transport_t transport;
+  // Buffered reads and writes of the socket
+  stream_t stream;
+  // Unique id for each player in the room
+  int player_number;
+  // Set once the GAME handshake has been answered
+  int joined;
+  // Protocol version agreed in the handshake
+  int protocol;
+  // Moves received and not yet applied, one is consumed per tick
+  direction_t inputs[INPUT_QUEUE];
+  int input_head;
+  int input_count;
+  // Set while EPOLLOUT is part of the registered events
+  int watching_out;
+  // Time the socket stopped taking everything queued, 0 while it does
+  long long backlog_since;
+  // Frames that were replaced by a newer one before they were sent
+  unsigned long long dropped_frames;
+  // Address the datagrams of a UDP player come from
+  struct sockaddr_storage address;
+  socklen_t address_length;
+  // Last move sequence received from a UDP player
+  uint32_t input_sequence;
+  // Time the last datagram of a UDP player arrived, in us
+  long long last_heard;
+  // Last step the client surely has, deltas start from it, 0 for none
+  uint32_t baseline;
+  // Smoothed round trip time of the player, 0 until measured, and when it
+  // is sampled next, in us
+  long long round_trip;
+  long long next_round_trip;
+} connection_t;
+
+typedef struct room_struct {
+  // Unique id of the room in the server
+  int id;
+  // The epoll instance watching the sockets and the timer of the room
+  int epoll_fd;
+  // Held while the room is being serviced or receiving players
+  pthread_mutex_t lock;
+  // The game being played
+  game_t game_data;
+  // Connections indexed by player number - 1
+  connection_t ** connections;
+  // How many players have been accepted so far
+  int accepted_players;
+  // Timer driving the simulation
+  tick_scheduler_t ticker;
+  // Steps simulated so far, the tick number the clients see
+  uint32_t frame;
+  // Changes of the last steps, to write deltas
+  delta_history_t history;
+  // Time the frames of each of those steps were sent, in us, UDP players
+  // acknowledge them in their inputs frames
+  long long step_times[DELTA_HISTORY];
+  // Heads of the players by area, to write the views of large boards
+  view_grid_t view;
+  // Threads sharing the simulation of the board, NULL to simulate it alone
+  strip_simulation_t * strips;
+  // Every completed step, for threads that read the game without the lock
+  frame_publisher_t frames;
+  // Snapshots of the game for the spectators, made from the frames
+  broadcast_channel_t * channel;
+  // Set when the game is over and the room can be closed
+  int finished;
+  // Position in the list of rooms of the worker pool
+  int pool_index;
+  // Seed of the random numbers of the game
+  uint64_t seed;
+  // Directory for the input log, NULL to keep no log
+  const char * log_directory;
+  // Moves applied on every tick, to replay the game
+  input_log_t log;
+  // Socket shared by the UDP players, -1 until the first one joins
+  int udp_fd;
+  int udp_port;
+  // Datagrams just received and datagrams waiting to be sent
+  datagram_batch_t * incoming;
+  datagram_batch_t * outgoing;
+  // Time a TCP player may stay behind before it is disconnected, in us
+  long long lag_budget;
+  // Frames dropped for slow players, players disconnected for it, and the
+  // most buffers queued for a player at the start of a step
+  unsigned long long dropped_frames;
+  int lag_disconnects;
+  int max_queue_depth;
+  // Time spent writing the frames of the current step, in ns
+  long long serialize_time;
+  // Bytes of datagrams already added to the metrics
+  unsigned long long datagram_bytes;
+} room_t;
+
+/*
+    Create an empty room waiting for player_c players on a board of
+    width x height, at most MAX_BOARD_SIZE on each side
+    Clients that speak PROTOCOL_VIEW only get the players within
+    view_radius cells of their head, if the board is larger than that
+    The board is split between simulation_threads threads if more than one
+    TCP players that fall behind for longer than lag_budget us are dropped
+    Spectators of the game are served by the threads of broadcast
+    The same seed and the same moves always give the same game
+*/
+room_t * createRoom(int id, int player_c, int width, int height, int view_radius, int speed,
+                    int simulation_threads, long long lag_budget, broadcast_t * broadcast,
+                    uint64_t seed, const char * log_directory);
+
+// Whether the room already has all its players
+int roomIsFull(room_t * room);
+
+/*
+    Add a connected socket to the room as its next player
+    The game starts when the last player is added
+    Returns 1 if the room started, after that only the workers may touch it
+*/
+int roomAddConnection(room_t * room, int client_fd);
+
+/*
+    Add a UDP player that sent a connect frame from address
+    accept gets the settings to send back to the player
+    Returns 1 if the room started, like roomAddConnection
+*/
+int roomAddDatagramPeer(room_t * room, const struct sockaddr_storage * address,
+                        socklen_t address_length, accept_t * accept);
+
+/*
+    Handle every event pending in the room without blocking:
+    socket reads and writes, and the tick timer
+    Returns 0 once the room has finished
+*/
+int serviceRoom(room_t * room);
+
+// Close every connection of the room and free it
+void closeRoom(room_t * room);
+
+#endif
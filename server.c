@@ -1,6 +1,11 @@
 /* TRON Multiplayer Server.
- * Implementation for the server functionality using threads and mutexes.
- * 
+ * Implementation for the server functionality hosting many rooms at once.
+ * The main thread accepts the clients and fills the rooms in order, each
+ * room being an independent game with its own sockets and tick timer.
+ * The rooms with pending events are serviced by a pool of worker threads
+ * (see worker_pool.h), so the number of games is bounded by memory and file
+ * descriptors instead of processes or threads.
+ *
  * Christian Aguilar
  * Salomon Levy
  */
@@ -14,42 +19,94 @@
 #include <signal.h>
 // Sockets libraries
 #include <netdb.h>
-#include <sys/poll.h>
-// Posix threads library
-#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 // Custom libraries
 #include "codes.h"
 #include "sockets.h"
 #include "fatal_error.h"
-#include "tron_simulation.h"
-
-#define BUFFER_SIZE 1024
-#define MAX_QUEUE 5
-#define SLEEP 10000
-
-// use for printing debug info
-// #define DEBUG
+#include "tick_scheduler.h"
+#include "room.h"
+#include "worker_pool.h"
+
+#define MAX_QUEUE 128
+#define MAX_EVENTS 64
+// Seconds between worker pool reports
+#define REPORT_INTERVAL 10
+// Accept frames remembered to answer repeated connect frames the same way
+#define RECENT_ACCEPTS 256
+// Time a connect frame is taken as a repeat of an earlier one, in us
+#define ACCEPT_MEMORY 10000000
+// Longest GAME handshake looked at to tell spectators from players
+#define HANDSHAKE_SIZE 64
+// Time a new connection has to send its GAME handshake, in us
+#define HANDSHAKE_TIMEOUT 5000000
+// Most time the main thread sleeps, so late handshakes are noticed, in ms
+#define LOOP_TIMEOUT 1000
 
 ///// Structure definitions
 
-// Structure for the mutexes to keep the data consistent
-typedef struct locks_struct {
-  // Mutex array for the operations on the accounts
-  pthread_mutex_t count_mutex;
-} locks_t;
-
-// Data that will be sent to each structure
-typedef struct data_struct {
-  // Unique id for each player
-  int player_number;
-  // The file descriptor for the socket
-  int connection_fd;
-  // A pointer to a player data structure
-  game_t * game_data;
-  // A pointer to a locks structure
-  locks_t * data_locks;
-} thread_data_t;
+// An accept frame sent to a UDP client, in case its connect frame comes again
+typedef struct recent_accept_struct {
+  struct sockaddr_in address;
+  unsigned char frame[HEADER_SIZE + ACCEPT_PAYLOAD_SIZE];
+  long long time;
+} recent_accept_t;
+
+// A connection waiting for its GAME handshake
+typedef struct pending_handshake_struct {
+  int fd;
+  // Time it is closed if the handshake didn't come, in us
+  long long deadline;
+  struct pending_handshake_struct * previous;
+  struct pending_handshake_struct * next;
+} pending_handshake_t;
+
+// Everything the main thread needs to fill the rooms
+typedef struct server_struct {
+  // The listening socket
+  int server_fd;
+  // The epoll instance watching the listening socket and every room
+  int epoll_fd;
+  // The epoll instance watching the connections that haven't sent their
+  // GAME handshake yet, itself watched by epoll_fd
+  int handshake_fd;
+  // Those connections, in the order they were accepted, so by deadline
+  pending_handshake_t * oldest_pending;
+  pending_handshake_t * newest_pending;
+  // The room receiving the next players
+  room_t * open_room;
+  // Id for the next room
+  int next_room_id;
+  // Players per room and time between ticks
+  int player_count;
+  int speed;
+  // Size of the board of every room, and how far the players see on it
+  int board_width;
+  int board_height;
+  int view_radius;
+  // Threads simulating the board of each room
+  int simulation_threads;
+  // Time a TCP player may stay behind before it is disconnected, in us
+  long long lag_budget;
+  // Seed of the first room, the next ones count up from it
+  uint64_t seed;
+  // Where the rooms write their input logs, NULL for no logs
+  const char * log_directory;
+  // Threads running the rooms
+  worker_pool_t pool;
+  // Threads sending the games to the spectators
+  broadcast_t broadcast;
+  // The socket receiving the connect frames of UDP clients, -1 if disabled
+  int udp_fd;
+  // Connect frames received and accept frames waiting to be sent
+  datagram_batch_t * incoming;
+  datagram_batch_t * outgoing;
+  // Ring of the last accept frames sent
+  recent_accept_t recent[RECENT_ACCEPTS];
+  int recent_next;
+} server_t;
 
 
 // Global variable to detect when a signal arrived
@@ -58,50 +115,137 @@ int interrupted = 0;
 ///// FUNCTION DECLARATIONS
 void usage(char * program);
 void setupHandlers();
-void initGame(game_t * game_data, int player_c, locks_t * data_locks, int speed);
-void waitForConnections(int server_fd, game_t * game_data, locks_t * data_locks);
-void * attentionThread(void * arg);
-int checkValidAccount(int account);
-void closeGame(game_t * game_data, locks_t * data_locks);
+void raiseFileLimit();
+void initServerLoop(server_t * server, int server_fd, int player_c, int speed, int workers,
+                    int spectator_threads, long long lag_budget);
+void runEventLoop(server_t * server);
+void acceptConnections(server_t * server);
+void receiveHandshakes(server_t * server);
+void expireHandshakes(server_t * server, long long now);
+void removePendingHandshake(server_t * server, pending_handshake_t * pending);
+room_t * getOpenRoom(server_t * server);
+broadcast_channel_t * findChannel(server_t * server, int room_id);
+void initDatagramListener(server_t * server, char * port);
+void receiveConnects(server_t * server);
+recent_accept_t * findRecentAccept(server_t * server, const struct sockaddr_storage * address, long long now);
+void closeServerLoop(server_t * server);
 void detectInterruption(int signal);
-void manageGame(game_t * game_data, locks_t * data_locks);
 
 ///// MAIN FUNCTION
 int main(int argc, char * argv[]) {
   int server_fd;
-  game_t game_data;
-  locks_t data_locks;
+  server_t server;
+  int workers = 0;
+  uint64_t seed = time(NULL);
+  const char * log_directory = NULL;
+  int udp = 0;
+  int width = BOARD_WIDTH;
+  int height = BOARD_HEIGHT;
+  int view_radius = VIEW_RADIUS;
+  int simulation_threads = 1;
+  long long lag_budget = LAG_BUDGET;
+  int spectator_threads = 1;
+  const char * metrics_path = NULL;
+  metrics_server_t metrics;
+  int option;
 
   printf("\n=== TRON SERVER ===\n");
 
-  // Check the correct arguments
-  if (argc != 4) {
+  // Check the options and the correct arguments
+  while ((option = getopt(argc, argv, "w:s:l:ub:v:t:L:m:S:")) != -1) {
+    switch (option) {
+      case 'w':
+        workers = atoi(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        log_directory = optarg;
+        break;
+      case 'u':
+        udp = 1;
+        break;
+      case 'b':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 1 || height < 1
+            || width > MAX_BOARD_SIZE || height > MAX_BOARD_SIZE) {
+          usage(argv[0]);
+        }
+        break;
+      case 'v':
+        if ((view_radius = atoi(optarg)) < 1) {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        if ((simulation_threads = atoi(optarg)) < 1) {
+          usage(argv[0]);
+        }
+        break;
+      case 'L':
+        if ((lag_budget = atoll(optarg) * 1000) <= 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'm':
+        metrics_path = optarg;
+        break;
+      case 'S':
+        spectator_threads = atoi(optarg);
+        if (spectator_threads < 1 || spectator_threads > MAX_BROADCAST_THREADS) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 3) {
     usage(argv[0]);
   }
+  // Every player over UDP gets keyframes of the whole game in one datagram
+  if (udp && snapshotFrameSize(atoi(argv[optind + 1])) + INPUT_ACK_SIZE > MAX_DATAGRAM) {
+    printf("Games of more than %d players can't be played over UDP\n",
+      (MAX_DATAGRAM - HEADER_SIZE - INPUT_ACK_SIZE) / PLAYER_RECORD_SIZE);
+    exit(EXIT_FAILURE);
+  }
 
   // Configure the handler to catch SIGINT
   setupHandlers();
-
-  // Initialize the data structures
-  initGame(&game_data, atoi(argv[2]), &data_locks, atoi(argv[3]));
+  // Allow as many sockets as the system lets us have
+  raiseFileLimit();
 
 	// Show the IPs assigned to this computer
 	printLocalIPs();
   // Start the server
-  server_fd = initServer(argv[1], MAX_QUEUE);
-  // Listen for connections from the clients
-  waitForConnections(server_fd, &game_data, &data_locks);
-  // All players have connected, start game
-  manageGame(&game_data, &data_locks);
-  // Close the socket
+  server_fd = initServer(argv[optind], MAX_QUEUE);
+  // From here on the threads log through the drain thread
+  startLogger();
+  // Fill the rooms from the main thread, the workers run the games
+  initServerLoop(&server, server_fd, atoi(argv[optind + 1]), atoi(argv[optind + 2]), workers,
+    spectator_threads, lag_budget);
+  server.seed = seed;
+  server.log_directory = log_directory;
+  server.board_width = width;
+  server.board_height = height;
+  server.view_radius = view_radius;
+  server.simulation_threads = simulation_threads;
+  server.lag_budget = lag_budget;
+  if (udp) {
+    initDatagramListener(&server, argv[optind]);
+  }
+  if (metrics_path != NULL) {
+    startMetricsServer(&metrics, metrics_path);
+  }
+  runEventLoop(&server);
+  // Close the rooms and the socket
+  closeServerLoop(&server);
+  if (metrics_path != NULL) {
+    stopMetricsServer(&metrics);
+  }
+  stopLogger();
   close(server_fd);
 
-  // Clean the memory used
-  closeGame(&game_data, &data_locks);
-
-  // Finish the main thread
-  //pthread_exit(NULL);
-
   return 0;
 }
 
@@ -112,7 +256,20 @@ int main(int argc, char * argv[]) {
 */
 void usage(char * program) {
   printf("Usage:\n");
-  printf("\t%s {port_number} {player_number} {game_speed (ms, try anywhere from 10,000-100,000)}\n", program);
+  printf("\t%s [-w workers] [-s seed] [-l log_directory] [-u] [-b WIDTHxHEIGHT] [-v radius] [-t threads] [-L lag_ms] [-m metrics_socket] [-S threads] {port_number} {players_per_room} {tick_period (us, try anywhere from 10,000-100,000)}\n", program);
+  printf("\t-w: worker threads running the rooms (default: one per core)\n");
+  printf("\t-s: seed of the first room, room n uses seed + n (default: the current time)\n");
+  printf("\t-l: write the input log of every room to this directory, see replay\n");
+  printf("\t-u: also take players over UDP on the same port number\n");
+  printf("\t-b: size of the board, up to %dx%d (default: %dx%d)\n",
+    MAX_BOARD_SIZE, MAX_BOARD_SIZE, BOARD_WIDTH, BOARD_HEIGHT);
+  printf("\t-v: on larger boards, players only get the others within this many cells (default: %d)\n",
+    VIEW_RADIUS);
+  printf("\t-t: threads simulating the board of each room, for huge rooms (default: 1)\n");
+  printf("\t-L: disconnect TCP players that can't keep up for this many ms (default: %d)\n",
+    LAG_BUDGET / 1000);
+  printf("\t-m: serve latency histograms and counters on a Unix socket at this path\n");
+  printf("\t-S: threads sending the games to spectators, up to %d (default: 1)\n", MAX_BROADCAST_THREADS);
   exit(EXIT_FAILURE);
 }
 
@@ -126,9 +283,12 @@ void setupHandlers() {
   // Block all signals during the time the handler funciton is running
   sigfillset(&new_action.sa_mask);
   new_action.sa_handler = detectInterruption;
+  new_action.sa_flags = 0;
 
   // Set the handler
   sigaction(SIGINT, &new_action, NULL);
+  // A client closing its socket must not kill the server
+  signal(SIGPIPE, SIG_IGN);
 }
 
 // Signal handler
@@ -139,257 +299,404 @@ void detectInterruption(int signal) {
 }
 
 /*
-    Function to initialize all the information necessary
-    This will allocate memory for the accounts, and for the mutexes
+    Raise the limit of open files to the hard limit
+    Every player is one file descriptor, so this is the real cap on players
 */
-void initGame(game_t * game_data, int player_c, locks_t * data_locks, int speed) {
-  printf("INIT GAME\n");
-  // Game hasn's started
-  game_data->status = 0;
-  // Initialize board
-  game_data->board = create_board(BOARD_WIDTH, BOARD_HEIGHT);
-  // Initialize player stati
-  game_data->stati = malloc(player_c * sizeof(*game_data->stati));
-  // Initialize players
-  game_data->players = malloc(sizeof *game_data->players);
-  // Initialize connected player count
-  game_data->players->connected_players = 0;
-  // Initialize players ready count
-  game_data->players->players_ready = 0;
-  // Set the number of players
-  game_data->players->player_count = player_c;
-  // Set game speed
-  game_data->speed = speed;
-  // Initialize the mutex
-  pthread_mutex_init(&data_locks->count_mutex, NULL);
+void raiseFileLimit() {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
 }
 
 /*
-    Main loop to wait for incomming connections
+    Create the epoll instance, register the listening socket
+    and start the worker threads
 */
-void waitForConnections(int server_fd, game_t * game_data, locks_t * data_locks) {
-  struct sockaddr_in client_address;
-  socklen_t client_address_size;
-  char client_presentation[INET_ADDRSTRLEN];
-  int client_fd;
-  pthread_t new_tid;
-  thread_data_t * connection_data = NULL;
-  int poll_response;
-  int timeout = 500;		// Time in milliseconds (0.5 seconds)
-  int current_player_c = 0;
+void initServerLoop(server_t * server, int server_fd, int player_c, int speed, int workers,
+                    int spectator_threads, long long lag_budget) {
+  struct epoll_event event;
+
+  server->server_fd = server_fd;
+  server->player_count = player_c > 0 ? player_c : 1;
+  server->speed = speed;
+  server->next_room_id = 0;
+  server->open_room = NULL;
+  server->oldest_pending = NULL;
+  server->newest_pending = NULL;
+  server->udp_fd = -1;
+
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server->epoll_fd == -1) {
+    fatalError("ERROR: epoll_create1");
+  }
 
-  // Get the size of the structure to store client information
-  client_address_size = sizeof client_address;
+  setNonBlocking(server_fd);
+  // The listening socket is the only one without a room attached
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+  // New connections wait there until they say whether they play or watch
+  server->handshake_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server->handshake_fd == -1) {
+    fatalError("ERROR: epoll_create1");
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = &server->handshake_fd;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->handshake_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
 
-  while (!interrupted) {
-    #ifdef DEBUG
-      printf("%d / %d players!\n", current_player_c, game_data->players->player_count);
-    #endif
-    if (current_player_c >= game_data->players->player_count) {
-      printf("All players have connected, starting game...\n");
-      game_data->status = 1;
-      break;
-    }
-    //// POLL
-    // Create a structure array to hold the file descriptors to poll
-    struct pollfd test_fds[1];
-    // Fill in the structure
-    test_fds[0].fd = server_fd;
-    test_fds[0].events = POLLIN;    // Check for incomming data
-    // Check if there is any incomming communication
-    poll_response = poll(test_fds, 1, timeout);
+  initBroadcast(&server->broadcast, spectator_threads, lag_budget);
+  initWorkerPool(&server->pool, workers, server->epoll_fd);
+  logMessage(LEVEL_INFO, "Running rooms of %d players on %d workers", server->player_count, server->pool.worker_count);
+}
+
+/*
+    Main loop: accept new players and hand the rooms with pending events
+    to the workers
+*/
+void runEventLoop(server_t * server) {
+  struct epoll_event events[MAX_EVENTS];
+  long long next_report = monotonicMicros() + REPORT_INTERVAL * 1000000LL;
+  int event_count;
 
+  while (!interrupted) {
+    event_count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, LOOP_TIMEOUT);
     // Error when polling
-    if (poll_response == -1) {
+    if (event_count == -1) {
       // Test if the error was caused by an interruption
       if (errno == EINTR) {
-        //printf("Poll did not finish. The program was interrupted");
-        break;
+        continue;
+      }
+      fatalError("ERROR: epoll_wait");
+    }
+
+    for (int i = 0; i < event_count; i++) {
+      // Activity on the listening socket
+      if (events[i].data.ptr == NULL) {
+        acceptConnections(server);
+      } else if (events[i].data.ptr == &server->udp_fd) {
+        receiveConnects(server);
+      } else if (events[i].data.ptr == &server->handshake_fd) {
+        receiveHandshakes(server);
       } else {
-        fatalError("ERROR: poll");
+        submitRoom(&server->pool, events[i].data.ptr);
       }
     }
-    // Timeout finished without reading anything
-    else if (poll_response == 0) {
-      //printf("No response after %d seconds\n", timeout);
+
+    expireHandshakes(server, monotonicMicros());
+    if (monotonicMicros() >= next_report) {
+      reportWorkerPool(&server->pool, stdout);
+      next_report += REPORT_INTERVAL * 1000000LL;
+    }
+  }
+}
+
+/*
+    Accept every pending connection on the listening socket
+    and wait for its GAME handshake
+*/
+void acceptConnections(server_t * server) {
+  struct sockaddr_in client_address;
+  socklen_t client_address_size;
+  char client_presentation[INET_ADDRSTRLEN];
+  struct epoll_event event;
+  pending_handshake_t * pending;
+  int client_fd;
+
+  while (1) {
+    // Get the size of the structure to store client information
+    client_address_size = sizeof client_address;
+    // ACCEPT
+    client_fd = accept(server->server_fd, (struct sockaddr *)&client_address,
+                       &client_address_size);
+    if (client_fd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      // Out of file descriptors, keep the client in the backlog
+      if (errno == EMFILE || errno == ENFILE) {
+        logMessage(LEVEL_ERROR, "accept: %s", strerror(errno));
+        return;
+      }
+      fatalError("ERROR: accept");
+    }
+    setNonBlocking(client_fd);
+    setNoDelay(client_fd);
+
+    // Get the data from the client
+    inet_ntop(client_address.sin_family, &client_address.sin_addr,
+              client_presentation, sizeof client_presentation);
+    logMessage(LEVEL_DEBUG, "Received incomming connection from %s on port %d",
+      client_presentation, client_address.sin_port);
+
+    // Edge triggered, so a handshake that came in parts is looked at again
+    // only when more of it arrives
+    pending = malloc(sizeof(*pending));
+    pending->fd = client_fd;
+    pending->deadline = monotonicMicros() + HANDSHAKE_TIMEOUT;
+    pending->next = NULL;
+    pending->previous = server->newest_pending;
+    if (server->newest_pending != NULL) {
+      server->newest_pending->next = pending;
     } else {
-      // There is something ready at the socket
-      // Check the type of event detected
-      if (test_fds[0].revents & POLLIN) {
-        // ACCEPT
-        // Wait for a client connection
-        client_fd = accept(server_fd, (struct sockaddr *)&client_address,
-                           &client_address_size);
-        if (client_fd == -1) {
-          fatalError("ERROR: accept");
-        }
-      
-        // Get the data from the client
-        inet_ntop(client_address.sin_family, &client_address.sin_addr,
-                  client_presentation, sizeof client_presentation);
-        printf("Received incomming connection from %s on port %d\n",
-                client_presentation, client_address.sin_port);
-
-        current_player_c++;
-
-        // Update player data
-        game_data->players->connected_players = current_player_c;
-        game_data->stati[current_player_c - 1].player_number = current_player_c;
-        game_data->stati[current_player_c - 1].current_direction = getStartDirection();
-        game_data->stati[current_player_c - 1].coordinates = getStartPosition(game_data->board, current_player_c);
-        game_data->stati[current_player_c - 1].status = 1;
-
-        // Prepare the structure to send to the thread
-        connection_data = malloc(sizeof(*connection_data));
-        connection_data->player_number = current_player_c;
-        connection_data->connection_fd = client_fd;
-        connection_data->game_data = game_data;
-        connection_data->data_locks = data_locks;
-
-        // CREATE A THREAD
-        int status = pthread_create(&new_tid, NULL, &attentionThread, connection_data);
-        if (status) {
-          fprintf(stderr, "ERROR: pthread_create %d\n", status);
-          exit(EXIT_FAILURE);
-        }
+      server->oldest_pending = pending;
+    }
+    server->newest_pending = pending;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pending;
+    if (epoll_ctl(server->handshake_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+      fatalError("ERROR: epoll_ctl");
+    }
+  }
+}
+
+/*
+    Look at the GAME handshake of the connections that sent one, without
+    taking it from the socket: players go to the open room, opening a new
+    one when it is full, and read it there, spectators go to the threads
+    sending the game they asked for
+*/
+void receiveHandshakes(server_t * server) {
+  struct epoll_event events[MAX_EVENTS];
+  char handshake[HANDSHAKE_SIZE];
+  broadcast_channel_t * channel;
+  pending_handshake_t * pending;
+  ssize_t length;
+  char * end;
+  int event_count;
+  int client_fd;
+  int operation;
+  int version;
+  int type = CONNECTION_PLAYER;
+  int room_id = -1;
+
+  event_count = epoll_wait(server->handshake_fd, events, MAX_EVENTS, 0);
+  for (int i = 0; i < event_count; i++) {
+    pending = events[i].data.ptr;
+    client_fd = pending->fd;
+    length = recv(client_fd, handshake, sizeof(handshake) - 1, MSG_PEEK);
+    if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      continue;
+    }
+    end = length > 0 ? memchr(handshake, '\0', length) : NULL;
+    // Wait for the rest, until the deadline
+    if (end == NULL && length > 0 && length < HANDSHAKE_SIZE - 1) {
+      continue;
+    }
+    removePendingHandshake(server, pending);
+    // Hung up, or sent more than any handshake without ending it
+    if (end == NULL) {
+      close(client_fd);
+      continue;
+    }
+
+    type = CONNECTION_PLAYER;
+    room_id = -1;
+    if (sscanf(handshake, "%d %d %d %d", &operation, &version, &type, &room_id) >= 3
+        && operation == GAME && type == CONNECTION_SPECTATOR) {
+      // Spectators send nothing else, the handshake is answered by their thread
+      if (recv(client_fd, handshake, end - handshake + 1, 0) == -1
+          || (channel = findChannel(server, room_id)) == NULL) {
+        close(client_fd);
+        continue;
       }
+      addSpectator(&server->broadcast, channel, client_fd);
+      continue;
+    }
+
+    // The room started, the workers own it from now on
+    if (roomAddConnection(getOpenRoom(server), client_fd)) {
+      server->open_room = NULL;
     }
   }
 }
 
 /*
-    Hear the request from the client, wait for every player and start game
+    The room receiving the next players, opening a new one if needed
 */
-void * attentionThread(void * arg) {
-  // Receive the client data, mutexes and socket file descriptor
-  thread_data_t * connection_data = arg;
-  int poll_response;
-  int timeout = 10;		// Time in milliseconds
-  char buffer[BUFFER_SIZE];
-  direction_t direction;
-  operation_t op;
-  int disconnected = 0;
-  char * compressed = NULL;
-  int sleep_time = connection_data->game_data->speed >= 10000 
-    ? connection_data->game_data->speed : 10000;
-
-  recvString(connection_data->connection_fd, buffer, BUFFER_SIZE);
-  sscanf(buffer, "%d", &op);
-  if (op != GAME) {
-    // error
+room_t * getOpenRoom(server_t * server) {
+  if (server->open_room == NULL) {
+    server->open_room = createRoom(server->next_room_id, server->player_count,
+      server->board_width, server->board_height, server->view_radius, server->speed,
+      server->simulation_threads, server->lag_budget, &server->broadcast,
+      server->seed + server->next_room_id, server->log_directory);
+    server->next_room_id++;
+    addRoomToPool(&server->pool, server->open_room);
   }
-  sprintf(buffer, "%d,%d,%d",
-    connection_data->game_data->players->player_count,
-    connection_data->game_data->board->width,
-    connection_data->game_data->board->width);
-  sendString(connection_data->connection_fd, buffer);
-
-  // Wait for every player to connect
-  while (!connection_data->game_data->status && !interrupted) {
-    usleep(SLEEP);
-    printf("Player %d is waiting for all players to connect.\n", connection_data->player_number);
+  return server->open_room;
+}
+
+/*
+    Close the connections that didn't send their handshake in time
+*/
+void expireHandshakes(server_t * server, long long now) {
+  int client_fd;
+
+  while (server->oldest_pending != NULL && server->oldest_pending->deadline <= now) {
+    client_fd = server->oldest_pending->fd;
+    logMessage(LEVEL_DEBUG, "Closing a connection that sent no handshake");
+    removePendingHandshake(server, server->oldest_pending);
+    close(client_fd);
   }
+}
 
-  // Loop to listen for messages from the client
-  while (!interrupted && !disconnected) {
-    //// POLL
-    // Create a structure array to hold the file descriptors to poll
-    struct pollfd test_fds[1];
-    // Fill in the structure
-    test_fds[0].fd = connection_data->connection_fd;
-    test_fds[0].events = POLLIN;    // Check for incomming data
-    // Check if there is any incomming communication
-    poll_response = poll(test_fds, 1, timeout);
-    // Error when polling
-    if (poll_response == -1) {
-      // Test if the error was caused by an interruption
-      if (errno == EINTR) {
-        printf("Poll did not finish. The program was interrupted");
-        break;
-      } else {
-        fatalError("ERROR: poll");
-      }
+/*
+    Stop watching a connection for its handshake and forget it
+    The socket stays open
+*/
+void removePendingHandshake(server_t * server, pending_handshake_t * pending) {
+  epoll_ctl(server->handshake_fd, EPOLL_CTL_DEL, pending->fd, NULL);
+  if (pending->previous != NULL) {
+    pending->previous->next = pending->next;
+  } else {
+    server->oldest_pending = pending->next;
+  }
+  if (pending->next != NULL) {
+    pending->next->previous = pending->previous;
+  } else {
+    server->newest_pending = pending->previous;
+  }
+  free(pending);
+}
+
+/*
+    Take a reference to the spectator channel of room room_id, or of the
+    game that started last when room_id is -1, the open room if none did
+    Returns NULL if there is no such room
+*/
+broadcast_channel_t * findChannel(server_t * server, int room_id) {
+  worker_pool_t * pool = &server->pool;
+  broadcast_channel_t * channel = NULL;
+  room_t * found = NULL;
+  room_t * room;
+
+  // Rooms leave the list before they are closed, so they stay open while
+  // the list is locked. Only the main thread starts games
+  pthread_mutex_lock(&pool->rooms_lock);
+  for (int i = 0; i < pool->room_count; i++) {
+    room = pool->rooms[i];
+    if (room_id == -1 ? room->game_data.status && (found == NULL || room->id > found->id)
+                      : room->id == room_id) {
+      found = room;
     }
-    // Timeout finished without reading anything
-    else if (poll_response == 0) {
-      //printf("No response on thread %d\n", connection_data->connection_fd);
-    } else {
-      // There is something ready at the socket
-      // Check the type of event detected
-      if (test_fds[0].revents & POLLIN) {
-        // Receive the request
-        recvString(connection_data->connection_fd, buffer, BUFFER_SIZE);
-        // Process the request being careful of data consistency
-        sscanf(buffer, "%d", &direction);
-        connection_data->game_data->
-          stati[connection_data->player_number - 1].current_direction = direction;
-        #ifdef DEBUG
-          printf("Received %d from player %d\n", direction, connection_data->player_number);
-        #endif
-        pthread_mutex_lock(&connection_data->data_locks->count_mutex);
-          connection_data->game_data->players->players_ready++;
-        pthread_mutex_unlock(&connection_data->data_locks->count_mutex);
-        // The server sets count to 0 once all players are ready
-        while (connection_data->game_data->players->players_ready != 0
-               && !interrupted) {
-          // Check if there is any incomming communication
-          poll_response = poll(test_fds, 1, timeout);
-          if (poll_response == 0) {
-            #ifdef DEBUG
-              printf("%d", connection_data->player_number);
-            #endif
-            fflush(stdout);
-          } else {
-            printf("BREAK\n");
-            disconnected = 1;
-            break;
-          }
+  }
+  if (found != NULL) {
+    channel = retainChannel(found->channel);
+  }
+  pthread_mutex_unlock(&pool->rooms_lock);
+
+  if (found == NULL && room_id == -1) {
+    channel = retainChannel(getOpenRoom(server)->channel);
+  }
+  return channel;
+}
+
+/*
+    Open the UDP socket for the connect frames and watch it from the main loop
+    Once accepted, the clients talk to the socket of their room instead
+*/
+void initDatagramListener(server_t * server, char * port) {
+  struct epoll_event event;
+
+  server->udp_fd = initUdpSocket(port);
+  server->incoming = malloc(sizeof(*server->incoming));
+  server->outgoing = malloc(sizeof(*server->outgoing));
+  server->outgoing->count = 0;
+  server->outgoing->bytes_sent = 0;
+  server->recent_next = 0;
+  memset(server->recent, 0, sizeof(server->recent));
+
+  event.events = EPOLLIN;
+  event.data.ptr = &server->udp_fd;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->udp_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+  logMessage(LEVEL_INFO, "Taking players over UDP on port %s", port);
+}
+
+/*
+    Answer every connect frame waiting on the UDP socket
+    A client repeats its connect frame until an accept arrives, so a repeat
+    gets the same accept again instead of a second seat
+*/
+void receiveConnects(server_t * server) {
+  datagram_batch_t * batch = server->incoming;
+  frame_header_t header;
+  recent_accept_t * recent;
+  accept_t accept;
+  long long now = monotonicMicros();
+  int received;
+
+  do {
+    received = receiveDatagrams(server->udp_fd, batch);
+    if (received == -1) {
+      logMessage(LEVEL_ERROR, "recvmmsg: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < received; i++) {
+      if (decodeHeader(batch->buffers[i], batch->messages[i].msg_len, &header) != 1
+          || header.type != MSG_CONNECT) {
+        continue;
+      }
+      recent = findRecentAccept(server, &batch->addresses[i], now);
+      if (recent == NULL) {
+        recent = &server->recent[server->recent_next];
+        server->recent_next = (server->recent_next + 1) % RECENT_ACCEPTS;
+        memcpy(&recent->address, &batch->addresses[i], sizeof(recent->address));
+        recent->time = now;
+        // The room started, the workers own it from now on
+        if (roomAddDatagramPeer(getOpenRoom(server), &batch->addresses[i],
+            batch->messages[i].msg_hdr.msg_namelen, &accept)) {
+          server->open_room = NULL;
         }
-        compressed = compressGame(connection_data->game_data);
-        #ifdef DEBUG
-          printf("Sending message %s to %d\n",compressed, connection_data->player_number);
-        #endif
-        sendString(connection_data->connection_fd, compressed);
-        ///printf("After send: %s\n", compressed);
-        free(compressed);
-        usleep(sleep_time);
+        encodeAccept(&accept, recent->frame);
       }
+      queueDatagram(server->udp_fd, server->outgoing, &batch->addresses[i],
+        batch->messages[i].msg_hdr.msg_namelen, recent->frame, sizeof(recent->frame), NULL, 0);
     }
-  }
-  // Let server know the client disconnected
-  connection_data->game_data->players->connected_players--;
-  // Free memory allocated by parent
-  free(connection_data);
-  pthread_exit(NULL);
+  } while (received == DATAGRAM_BATCH);
+  sendDatagrams(server->udp_fd, server->outgoing);
 }
 
-void manageGame(game_t * game_data, locks_t * data_locks) {
-  while (!interrupted) {
-    usleep(1000);
-    if (game_data->players->players_ready >= game_data->players->connected_players) {
-      game_simulation(game_data->board, game_data->stati, game_data->players->player_count);
-      #ifdef DEBUG
-        print_board(game_data->board);
-      #endif
-      pthread_mutex_lock(&data_locks->count_mutex);
-        game_data->players->players_ready = 0;
-      pthread_mutex_unlock(&data_locks->count_mutex);
-    }
-    if (game_data->players->connected_players == 0) {
-      printf("Game finished\n");
-      return;
+/*
+    The accept frame sent lately to a client at address, NULL if there is none
+*/
+recent_accept_t * findRecentAccept(server_t * server, const struct sockaddr_storage * address, long long now) {
+  const struct sockaddr_in * from = (const struct sockaddr_in *)address;
+
+  for (int i = 0; i < RECENT_ACCEPTS; i++) {
+    if (server->recent[i].time != 0 && now - server->recent[i].time < ACCEPT_MEMORY
+        && server->recent[i].address.sin_port == from->sin_port
+        && server->recent[i].address.sin_addr.s_addr == from->sin_addr.s_addr) {
+      return &server->recent[i];
     }
   }
+  return NULL;
 }
 
 /*
-    Free all the memory used for the bank data
+    Stop the workers, close every room and the epoll instance
 */
-void closeGame(game_t * player_data, locks_t * data_locks) {
-    #ifdef DEBUG
-      printf("DEBUG: Clearing the memory for the thread\n");
-    #endif
-    free_board(player_data->board);
-    free(player_data->stati);
-    free(player_data->players);
+void closeServerLoop(server_t * server) {
+  stopWorkerPool(&server->pool);
+  // The rooms are closed, so nothing wakes up the spectator threads anymore
+  stopBroadcast(&server->broadcast);
+  // The connections still waiting for their handshake
+  while (server->oldest_pending != NULL) {
+    close(server->oldest_pending->fd);
+    removePendingHandshake(server, server->oldest_pending);
+  }
+  close(server->handshake_fd);
+  close(server->epoll_fd);
+  if (server->udp_fd != -1) {
+    close(server->udp_fd);
+    free(server->incoming);
+    free(server->outgoing);
+  }
 }
@@ -0,0 +1,41 @@
+/*
+ * Immutable, reference counted byte buffers.
+ *
+ * The server serializes every snapshot once per tick into one of these and
+ * every connection queues a reference to it, so broadcasting to N players
+ * costs N references instead of N copies. The count is atomic so buffers can
+ * be shared with other threads.
+ */
+#include "shared_buffer.h"
+
+// Allocate a buffer for length bytes with a single reference
+shared_buffer_t * createSharedBuffer(size_t length) {
+  shared_buffer_t * buffer = malloc(sizeof(*buffer) + length);
+  if (buffer == NULL) {
+    fatalError("ERROR: malloc");
+  }
+  buffer->references = 1;
+  buffer->length = length;
+  return buffer;
+}
+
+// Create a buffer with a copy of a string, including its '\0'
+shared_buffer_t * sharedBufferFromString(const char * string) {
+  size_t length = strlen(string) + 1;
+  shared_buffer_t * buffer = createSharedBuffer(length);
+  memcpy(buffer->data, string, length);
+  return buffer;
+}
+
+// Add an owner to the buffer
+shared_buffer_t * retainSharedBuffer(shared_buffer_t * buffer) {
+  __atomic_add_fetch(&buffer->references, 1, __ATOMIC_RELAXED);
+  return buffer;
+}
+
+// Drop an owner, freeing the buffer when it was the last one
+void releaseSharedBuffer(shared_buffer_t * buffer) {
+  if (__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(buffer);
+  }
+}
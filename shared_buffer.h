@@ -0,0 +1,39 @@
+/*
+ * Immutable, reference counted byte buffers.
+ *
+ * The server serializes every snapshot once per tick into one of these and
+ * every connection queues a reference to it, so broadcasting to N players
+ * costs N references instead of N copies. The count is atomic so buffers can
+ * be shared with other threads.
+ */
+
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatal_error.h"
+
+typedef struct shared_buffer_struct {
+  // Number of owners, the buffer is freed when it reaches 0
+  int references;
+  // Bytes used in data
+  size_t length;
+  // The contents, never modified once the buffer is shared
+  char data[];
+} shared_buffer_t;
+
+// Allocate a buffer for length bytes with a single reference
+shared_buffer_t * createSharedBuffer(size_t length);
+
+// Create a buffer with a copy of a string, including its '\0'
+shared_buffer_t * sharedBufferFromString(const char * string);
+
+// Add an owner to the buffer
+shared_buffer_t * retainSharedBuffer(shared_buffer_t * buffer);
+
+// Drop an owner, freeing the buffer when it was the last one
+void releaseSharedBuffer(shared_buffer_t * buffer);
+
+#endif
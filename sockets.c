@@ -5,12 +5,19 @@
     - Printing the local addresses
     - Creation of a socket on a client
     - Error validation when sending or receiving messages
+    - Buffered streams that split the bytes received into framed messages
+      and queue outgoing buffers across partial writes
+    - UDP sockets sending and receiving batches of datagrams, with an
+      optional loss and latency simulator for testing on loopback
 
     Gilberto Echeverria
     gilecheverria@yahoo.com
     31/03/2018
 */
 
+#include <time.h>
+#include <pthread.h>
+
 #include "sockets.h"
 
 /*
@@ -208,3 +215,841 @@ void sendString(int connection_fd, char * buffer)
         fatalError("ERROR: send");
     }
 }
+
+/*
+    Send a block of bytes with error validation
+    Keeps sending until the whole block was written
+*/
+void sendBuffer(int connection_fd, const void * buffer, size_t length)
+{
+    ssize_t chars_sent;
+
+    while ( length > 0 )
+    {
+        chars_sent = send(connection_fd, buffer, length, 0);
+        if ( chars_sent == -1 )
+        {
+            fatalError("ERROR: send");
+        }
+        buffer = (const char *)buffer + chars_sent;
+        length -= chars_sent;
+    }
+}
+
+/*
+    Switch a file descriptor to non-blocking mode
+    Used for the sockets managed by the server event loop
+*/
+void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if ( flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+    {
+        fatalError("ERROR: fcntl");
+    }
+}
+
+/*
+    Send small writes right away instead of waiting to coalesce them
+    Snapshots, inputs and pings are all tiny and latency bound
+*/
+void setNoDelay(int fd)
+{
+    int enable = 1;
+
+    if ( setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable) == -1 )
+    {
+        perror("setsockopt TCP_NODELAY");
+    }
+}
+
+/*
+    Prepare a stream for a connected socket
+    The stream starts with FRAME_STRING framing
+*/
+void initStream(stream_t * stream, int fd, size_t capacity)
+{
+    size_t power = 64;
+
+    // The ring indexes with a mask, so round up to a power of 2
+    while ( power < capacity )
+    {
+        power *= 2;
+    }
+
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->framing = FRAME_STRING;
+    stream->max_message = power;
+    stream->in_capacity = power;
+    stream->in_data = malloc(stream->in_capacity);
+    stream->out_capacity = 8;
+    stream->out_queue = malloc(stream->out_capacity * sizeof(*stream->out_queue));
+    stream->out_tags = malloc(stream->out_capacity * sizeof(*stream->out_tags));
+    if ( stream->in_data == NULL || stream->out_queue == NULL || stream->out_tags == NULL )
+    {
+        fatalError("ERROR: malloc");
+    }
+}
+
+/*
+    Change how the next messages are framed
+    For FRAME_LENGTH_PREFIXED, the length found at length_offset counts the
+    bytes after the header; longer messages than max_message are errors
+*/
+void setStreamFraming(stream_t * stream, framing_t framing, size_t header_size,
+                      size_t length_offset, size_t max_message)
+{
+    stream->framing = framing;
+    stream->header_size = header_size;
+    stream->length_offset = length_offset;
+    stream->max_message = max_message;
+    stream->in_scanned = 0;
+}
+
+/*
+    Copy length bytes starting offset bytes after the head of the ring
+*/
+static void copyFromRing(stream_t * stream, size_t offset, char * destination, size_t length)
+{
+    size_t start = (stream->in_head + offset) & (stream->in_capacity - 1);
+    size_t first = stream->in_capacity - start;
+
+    if ( first >= length )
+    {
+        memcpy(destination, stream->in_data + start, length);
+    }
+    else
+    {
+        memcpy(destination, stream->in_data + start, first);
+        memcpy(destination + first, stream->in_data, length - first);
+    }
+}
+
+/*
+    Double the ring, moving the buffered bytes to the start
+*/
+static void growRing(stream_t * stream)
+{
+    char * data = malloc(stream->in_capacity * 2);
+
+    if ( data == NULL )
+    {
+        fatalError("ERROR: malloc");
+    }
+    copyFromRing(stream, 0, data, stream->in_length);
+    free(stream->in_data);
+    stream->in_data = data;
+    stream->in_head = 0;
+    stream->in_capacity *= 2;
+}
+
+/*
+    Read once from the socket into the free space of the ring
+    Returns the bytes read, 0 if the connection has finished,
+    or -1 with errno set (EAGAIN when nothing was available)
+*/
+ssize_t streamFill(stream_t * stream)
+{
+    struct iovec vector[2];
+    size_t tail;
+    int vector_count;
+    ssize_t chars_read;
+
+    if ( stream->in_length == stream->in_capacity )
+    {
+        growRing(stream);
+    }
+
+    // The free space is at most two pieces: after the data and before the head
+    tail = (stream->in_head + stream->in_length) & (stream->in_capacity - 1);
+    vector[0].iov_base = stream->in_data + tail;
+    if ( tail >= stream->in_head )
+    {
+        vector[0].iov_len = stream->in_capacity - tail;
+        vector[1].iov_base = stream->in_data;
+        vector[1].iov_len = stream->in_head;
+        vector_count = stream->in_head > 0 ? 2 : 1;
+    }
+    else
+    {
+        vector[0].iov_len = stream->in_head - tail;
+        vector_count = 1;
+    }
+
+    do
+    {
+        chars_read = readv(stream->fd, vector, vector_count);
+    } while ( chars_read == -1 && errno == EINTR );
+
+    if ( chars_read > 0 )
+    {
+        stream->in_length += chars_read;
+    }
+    return chars_read;
+}
+
+/*
+    Consume the next length bytes and return them contiguously
+*/
+static char * takeFromRing(stream_t * stream, size_t length)
+{
+    char * message;
+
+    // The message wraps around the end of the ring, copy it
+    if ( stream->in_head + length > stream->in_capacity )
+    {
+        if ( stream->scratch_capacity < length )
+        {
+            stream->scratch_capacity = length;
+            stream->scratch = realloc(stream->scratch, stream->scratch_capacity);
+            if ( stream->scratch == NULL )
+            {
+                fatalError("ERROR: realloc");
+            }
+        }
+        copyFromRing(stream, 0, stream->scratch, length);
+        message = stream->scratch;
+    }
+    else
+    {
+        message = stream->in_data + stream->in_head;
+    }
+
+    stream->in_head = (stream->in_head + length) & (stream->in_capacity - 1);
+    stream->in_length -= length;
+    stream->in_scanned = 0;
+    if ( stream->in_length == 0 )
+    {
+        stream->in_head = 0;
+    }
+    return message;
+}
+
+/*
+    Extract the next complete message
+    Returns 1 and points message to it (valid until the next call to
+    streamFill or streamNextMessage), 0 when no complete message is buffered,
+    or -1 when the bytes don't follow the framing
+*/
+int streamNextMessage(stream_t * stream, char ** message, size_t * length)
+{
+    unsigned char header[16];
+    size_t message_length;
+    size_t index;
+
+    if ( stream->framing == FRAME_STRING )
+    {
+        // Continue the search for the '\0' where the last one stopped
+        for ( index = stream->in_scanned; index < stream->in_length; index++ )
+        {
+            if ( stream->in_data[(stream->in_head + index) & (stream->in_capacity - 1)] == '\0' )
+            {
+                *length = index + 1;
+                *message = takeFromRing(stream, *length);
+                return 1;
+            }
+        }
+        stream->in_scanned = stream->in_length;
+        return stream->in_length > stream->max_message ? -1 : 0;
+    }
+
+    if ( stream->in_length < stream->header_size )
+    {
+        return 0;
+    }
+    copyFromRing(stream, stream->length_offset, (char *)header, 4);
+    message_length = stream->header_size + ((size_t)header[0] << 24 | (size_t)header[1] << 16
+        | (size_t)header[2] << 8 | header[3]);
+    if ( message_length > stream->max_message )
+    {
+        return -1;
+    }
+    if ( stream->in_length < message_length )
+    {
+        return 0;
+    }
+    *length = message_length;
+    *message = takeFromRing(stream, message_length);
+    return 1;
+}
+
+/*
+    Add a reference to a buffer at the end of the write queue
+*/
+void streamQueue(stream_t * stream, shared_buffer_t * buffer)
+{
+    streamQueueTagged(stream, buffer, 0);
+}
+
+/*
+    Same as streamQueue for a frame that may be dropped, tag is never 0
+    (0 is how the untagged buffers are kept)
+*/
+void streamQueueTagged(stream_t * stream, shared_buffer_t * buffer, uint32_t tag)
+{
+    shared_buffer_t ** queue;
+    uint32_t * tags;
+    int slot;
+
+    // Grow the ring, unwrapping it into the new array
+    if ( stream->out_count == stream->out_capacity )
+    {
+        queue = malloc(2 * stream->out_capacity * sizeof(*queue));
+        tags = malloc(2 * stream->out_capacity * sizeof(*tags));
+        if ( queue == NULL || tags == NULL )
+        {
+            fatalError("ERROR: malloc");
+        }
+        for ( int i = 0; i < stream->out_count; i++ )
+        {
+            queue[i] = stream->out_queue[(stream->out_head + i) % stream->out_capacity];
+            tags[i] = stream->out_tags[(stream->out_head + i) % stream->out_capacity];
+        }
+        free(stream->out_queue);
+        free(stream->out_tags);
+        stream->out_queue = queue;
+        stream->out_tags = tags;
+        stream->out_head = 0;
+        stream->out_capacity *= 2;
+    }
+    slot = (stream->out_head + stream->out_count) % stream->out_capacity;
+    stream->out_queue[slot] = retainSharedBuffer(buffer);
+    stream->out_tags[slot] = tag;
+    stream->out_count++;
+}
+
+/*
+    Drop the tagged buffers that didn't start being written yet,
+    the untagged ones keep their order
+    Returns the number of buffers dropped
+*/
+int streamDropStale(stream_t * stream)
+{
+    int kept = 0;
+    int dropped = 0;
+    int from, to;
+
+    for ( int i = 0; i < stream->out_count; i++ )
+    {
+        from = (stream->out_head + i) % stream->out_capacity;
+        // The oldest one may be half written, it must be finished
+        if ( stream->out_tags[from] != 0 && !(i == 0 && stream->out_offset > 0) )
+        {
+            releaseSharedBuffer(stream->out_queue[from]);
+            dropped++;
+            continue;
+        }
+        to = (stream->out_head + kept) % stream->out_capacity;
+        stream->out_queue[to] = stream->out_queue[from];
+        stream->out_tags[to] = stream->out_tags[from];
+        kept++;
+    }
+    stream->out_count = kept;
+    return dropped;
+}
+
+/*
+    Tag of the newest tagged buffer that started being written
+*/
+uint32_t streamStartedTag(stream_t * stream)
+{
+    return stream->out_started_tag;
+}
+
+/*
+    Write as much of the queued buffers as the socket accepts
+    Returns 1 on success (some data may remain queued), or 0 on error
+*/
+int streamFlush(stream_t * stream)
+{
+    struct iovec vector[STREAM_IOVEC];
+    shared_buffer_t * buffer;
+    ssize_t chars_sent;
+    int vector_count;
+
+    while ( stream->out_count > 0 )
+    {
+        vector_count = stream->out_count < STREAM_IOVEC ? stream->out_count : STREAM_IOVEC;
+        for ( int i = 0; i < vector_count; i++ )
+        {
+            buffer = stream->out_queue[(stream->out_head + i) % stream->out_capacity];
+            vector[i].iov_base = buffer->data;
+            vector[i].iov_len = buffer->length;
+        }
+        // The first buffer may have been partially sent
+        vector[0].iov_base = (char *)vector[0].iov_base + stream->out_offset;
+        vector[0].iov_len -= stream->out_offset;
+
+        chars_sent = writev(stream->fd, vector, vector_count);
+        if ( chars_sent == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return 1;
+            }
+            perror("writev");
+            return 0;
+        }
+
+        stream->out_total += chars_sent;
+        // Release the buffers that were completely sent
+        for ( int i = 0; i < vector_count && (size_t)chars_sent >= vector[i].iov_len; i++ )
+        {
+            chars_sent -= vector[i].iov_len;
+            if ( stream->out_tags[stream->out_head] != 0 )
+            {
+                stream->out_started_tag = stream->out_tags[stream->out_head];
+            }
+            releaseSharedBuffer(stream->out_queue[stream->out_head]);
+            stream->out_head = (stream->out_head + 1) % stream->out_capacity;
+            stream->out_count--;
+            stream->out_offset = 0;
+        }
+        stream->out_offset += chars_sent;
+        if ( stream->out_offset > 0 && stream->out_tags[stream->out_head] != 0 )
+        {
+            stream->out_started_tag = stream->out_tags[stream->out_head];
+        }
+    }
+    return 1;
+}
+
+/*
+    Number of buffers still waiting to be written
+*/
+int streamPending(stream_t * stream)
+{
+    return stream->out_count;
+}
+
+/*
+    Free the buffers of the stream, the socket is not closed
+*/
+void closeStream(stream_t * stream)
+{
+    while ( stream->out_count > 0 )
+    {
+        releaseSharedBuffer(stream->out_queue[stream->out_head]);
+        stream->out_head = (stream->out_head + 1) % stream->out_capacity;
+        stream->out_count--;
+    }
+    free(stream->out_queue);
+    free(stream->out_tags);
+    free(stream->in_data);
+    free(stream->scratch);
+    stream->out_queue = NULL;
+    stream->out_tags = NULL;
+    stream->in_data = NULL;
+    stream->scratch = NULL;
+}
+
+/*
+    Get the address of a server in the format used by connect
+    Returns 0 if it could not be resolved
+*/
+static int resolveAddress(char * address, char * port, int socktype,
+                          struct sockaddr_storage * result, socklen_t * result_length)
+{
+    struct addrinfo hints;
+    struct addrinfo * server_info = NULL;
+
+    bzero(&hints, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = socktype;
+    if ( getaddrinfo(address, port, &hints, &server_info) != 0 )
+    {
+        return 0;
+    }
+    memcpy(result, server_info->ai_addr, server_info->ai_addrlen);
+    *result_length = server_info->ai_addrlen;
+    freeaddrinfo(server_info);
+    return 1;
+}
+
+/*
+    Open a non-blocking UDP socket bound to a local port
+    NULL takes any free port, see getSocketPort
+*/
+int initUdpSocket(char * port)
+{
+    struct addrinfo hints;
+    struct addrinfo * server_info = NULL;
+    int socket_fd;
+    int reuse = 1;
+
+    bzero(&hints, sizeof hints);
+    hints.ai_family = AF_INET;
+    // Use datagram sockets
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ( getaddrinfo(NULL, port == NULL ? "0" : port, &hints, &server_info) != 0 )
+    {
+        fatalError("ERROR: getaddrinfo");
+    }
+
+    socket_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
+    if ( socket_fd == -1 )
+    {
+        fatalError("ERROR: socket");
+    }
+    if ( setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (int)) == -1 )
+    {
+        fatalError("ERROR: setsockopt");
+    }
+    if ( bind(socket_fd, server_info->ai_addr, server_info->ai_addrlen) == -1 )
+    {
+        fatalError("ERROR: bind");
+    }
+    freeaddrinfo(server_info);
+
+    setNonBlocking(socket_fd);
+    return socket_fd;
+}
+
+/*
+    Open a non-blocking UDP socket that only talks to the given server
+    Datagrams from any other address are discarded by the kernel
+*/
+int connectUdpSocket(char * address, char * port)
+{
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if ( socket_fd == -1 )
+    {
+        fatalError("ERROR: socket");
+    }
+    redirectUdpSocket(socket_fd, address, atoi(port));
+    setNonBlocking(socket_fd);
+    return socket_fd;
+}
+
+/*
+    Make a connected UDP socket talk to another port of the same server
+    The local port stays the same, so the server still knows the client
+*/
+void redirectUdpSocket(int fd, char * address, int port)
+{
+    struct sockaddr_storage server;
+    socklen_t server_length;
+    char port_string[16];
+
+    sprintf(port_string, "%d", port);
+    if ( !resolveAddress(address, port_string, SOCK_DGRAM, &server, &server_length) )
+    {
+        fatalError("ERROR: getaddrinfo");
+    }
+    if ( connect(fd, (struct sockaddr *)&server, server_length) == -1 )
+    {
+        fatalError("ERROR: connect");
+    }
+}
+
+// Local port of a socket
+int getSocketPort(int fd)
+{
+    struct sockaddr_in local;
+    socklen_t length = sizeof local;
+
+    if ( getsockname(fd, (struct sockaddr *)&local, &length) == -1 )
+    {
+        fatalError("ERROR: getsockname");
+    }
+    return ntohs(local.sin_port);
+}
+
+///// LOSS AND LATENCY SIMULATOR
+
+// A datagram held back by the simulator until its time comes
+typedef struct delayed_datagram_struct {
+    long long due;
+    int fd;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    size_t length;
+    struct delayed_datagram_struct * next;
+    unsigned char data[];
+} delayed_datagram_t;
+
+// Settings read from TRON_NETEM, shared by every socket of the process
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    int enabled;
+    // Percentage of datagrams dropped
+    int loss;
+    // Delay and extra random delay in us
+    long long delay;
+    long long jitter;
+    unsigned int seed;
+    // Held datagrams, the earliest due first
+    delayed_datagram_t * delayed;
+} netem = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER };
+
+static long long netemNow()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void readNetemSettings()
+{
+    char * settings = getenv("TRON_NETEM");
+    char * copy;
+    char * option;
+    char * saveptr;
+    long value;
+
+    if ( settings == NULL || *settings == '\0' )
+    {
+        return;
+    }
+    copy = strdup(settings);
+    for ( option = strtok_r(copy, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr) )
+    {
+        if ( sscanf(option, "loss=%ld", &value) == 1 )
+        {
+            netem.loss = value;
+        }
+        else if ( sscanf(option, "delay=%ld", &value) == 1 )
+        {
+            netem.delay = value * 1000;
+        }
+        else if ( sscanf(option, "jitter=%ld", &value) == 1 )
+        {
+            netem.jitter = value * 1000;
+        }
+        else
+        {
+            fprintf(stderr, "TRON_NETEM: unknown option '%s'\n", option);
+        }
+    }
+    free(copy);
+    netem.seed = getpid() ^ netemNow();
+    netem.enabled = netem.loss > 0 || netem.delay > 0 || netem.jitter > 0;
+    if ( netem.enabled )
+    {
+        fprintf(stderr, "TRON_NETEM: %d%% loss, %lld ms delay, %lld ms jitter\n",
+                netem.loss, netem.delay / 1000, netem.jitter / 1000);
+    }
+}
+
+static int netemEnabled()
+{
+    pthread_once(&netem.once, readNetemSettings);
+    return netem.enabled;
+}
+
+/*
+    Drop or hold back a datagram about to be sent
+    The netem lock must be held
+*/
+static void netemSend(int fd, struct msghdr * message)
+{
+    delayed_datagram_t * datagram;
+    delayed_datagram_t ** position;
+    size_t length = 0;
+
+    if ( rand_r(&netem.seed) % 100 < netem.loss )
+    {
+        return;
+    }
+    for ( size_t i = 0; i < message->msg_iovlen; i++ )
+    {
+        length += message->msg_iov[i].iov_len;
+    }
+    datagram = malloc(sizeof *datagram + length);
+    datagram->due = netemNow() + netem.delay;
+    if ( netem.jitter > 0 )
+    {
+        datagram->due += rand_r(&netem.seed) % netem.jitter;
+    }
+    datagram->fd = fd;
+    datagram->address_length = message->msg_namelen;
+    if ( message->msg_name != NULL )
+    {
+        memcpy(&datagram->address, message->msg_name, message->msg_namelen);
+    }
+    datagram->length = 0;
+    for ( size_t i = 0; i < message->msg_iovlen; i++ )
+    {
+        memcpy(datagram->data + datagram->length, message->msg_iov[i].iov_base, message->msg_iov[i].iov_len);
+        datagram->length += message->msg_iov[i].iov_len;
+    }
+
+    // Keep the list sorted by due time, jitter reorders the datagrams
+    position = &netem.delayed;
+    while ( *position != NULL && (*position)->due <= datagram->due )
+    {
+        position = &(*position)->next;
+    }
+    datagram->next = *position;
+    *position = datagram;
+}
+
+/*
+    Send the datagrams held back by the simulator that are due
+    Datagrams of sockets closed meanwhile just fail to send
+*/
+void flushDelayedDatagrams()
+{
+    delayed_datagram_t * datagram;
+    long long now;
+
+    if ( !netemEnabled() )
+    {
+        return;
+    }
+    now = netemNow();
+    pthread_mutex_lock(&netem.lock);
+    while ( netem.delayed != NULL && netem.delayed->due <= now )
+    {
+        datagram = netem.delayed;
+        netem.delayed = datagram->next;
+        sendto(datagram->fd, datagram->data, datagram->length, MSG_DONTWAIT,
+               datagram->address_length > 0 ? (struct sockaddr *)&datagram->address : NULL,
+               datagram->address_length);
+        free(datagram);
+    }
+    pthread_mutex_unlock(&netem.lock);
+}
+
+///// DATAGRAM BATCHES
+
+/*
+    Receive every datagram waiting, up to DATAGRAM_BATCH, with one recvmmsg
+    Returns the number of datagrams, 0 if there were none, or -1 on error
+*/
+int receiveDatagrams(int fd, datagram_batch_t * batch)
+{
+    int received;
+
+    flushDelayedDatagrams();
+    for ( int i = 0; i < DATAGRAM_BATCH; i++ )
+    {
+        batch->iovecs[i][0].iov_base = batch->buffers[i];
+        batch->iovecs[i][0].iov_len = MAX_DATAGRAM;
+        batch->messages[i].msg_hdr = (struct msghdr){
+            .msg_name = &batch->addresses[i],
+            .msg_namelen = sizeof batch->addresses[i],
+            .msg_iov = batch->iovecs[i],
+            .msg_iovlen = 1
+        };
+    }
+    received = recvmmsg(fd, batch->messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+    if ( received == -1 )
+    {
+        // Errors queued by earlier sends to closed ports don't matter for UDP
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED ? 0 : -1;
+    }
+    batch->count = received;
+    return received;
+}
+
+/*
+    Add a datagram to a batch, sending the batch first if it is full
+    The prefix is copied, the body must stay valid until the batch is sent
+*/
+void queueDatagram(int fd, datagram_batch_t * batch, const struct sockaddr_storage * address,
+                   socklen_t address_length, const void * prefix, size_t prefix_length,
+                   const void * body, size_t body_length)
+{
+    int i;
+
+    if ( batch->count == DATAGRAM_BATCH )
+    {
+        sendDatagrams(fd, batch);
+    }
+    i = batch->count++;
+    memcpy(batch->buffers[i], prefix, prefix_length);
+    batch->iovecs[i][0] = (struct iovec){ batch->buffers[i], prefix_length };
+    batch->iovecs[i][1] = (struct iovec){ (void *)body, body_length };
+    if ( address != NULL )
+    {
+        batch->addresses[i] = *address;
+    }
+    batch->messages[i].msg_hdr = (struct msghdr){
+        .msg_name = address != NULL ? &batch->addresses[i] : NULL,
+        .msg_namelen = address != NULL ? address_length : 0,
+        .msg_iov = batch->iovecs[i],
+        .msg_iovlen = body_length > 0 ? 2 : 1
+    };
+}
+
+/*
+    Send every queued datagram with sendmmsg and empty the batch
+    Datagrams the socket can't take are dropped, like on the network
+*/
+void sendDatagrams(int fd, datagram_batch_t * batch)
+{
+    int sent = 0;
+    int result;
+
+    if ( netemEnabled() )
+    {
+        pthread_mutex_lock(&netem.lock);
+        for ( int i = 0; i < batch->count; i++ )
+        {
+            netemSend(fd, &batch->messages[i].msg_hdr);
+            for ( size_t j = 0; j < batch->messages[i].msg_hdr.msg_iovlen; j++ )
+            {
+                batch->bytes_sent += batch->messages[i].msg_hdr.msg_iov[j].iov_len;
+            }
+        }
+        pthread_mutex_unlock(&netem.lock);
+        batch->count = 0;
+        flushDelayedDatagrams();
+        return;
+    }
+
+    while ( sent < batch->count )
+    {
+        result = sendmmsg(fd, batch->messages + sent, batch->count - sent, MSG_DONTWAIT);
+        if ( result == -1 )
+        {
+            // A full socket buffer or an unreachable client: skip that datagram
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED )
+            {
+                perror("sendmmsg");
+            }
+            result = 1;
+        }
+        else
+        {
+            for ( int i = 0; i < result; i++ )
+            {
+                batch->bytes_sent += batch->messages[sent + i].msg_len;
+            }
+        }
+        sent += result;
+    }
+    batch->count = 0;
+}
+
+// Send a single datagram on a connected socket
+void sendDatagram(int fd, const void * data, size_t length)
+{
+    struct iovec iovec = { (void *)data, length };
+    struct msghdr message = { .msg_iov = &iovec, .msg_iovlen = 1 };
+
+    if ( netemEnabled() )
+    {
+        pthread_mutex_lock(&netem.lock);
+        netemSend(fd, &message);
+        pthread_mutex_unlock(&netem.lock);
+        flushDelayedDatagrams();
+        return;
+    }
+    if ( sendmsg(fd, &message, MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != ECONNREFUSED )
+    {
+        perror("sendmsg");
+    }
+}
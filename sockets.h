@@ -5,6 +5,10 @@
     - Printing the local addresses
     - Creation of a socket on a client
     - Error validation when sending or receiving messages
+    - Buffered streams that split the bytes received into framed messages
+      and queue outgoing buffers across partial writes
+    - UDP sockets sending and receiving batches of datagrams, with an
+      optional loss and latency simulator for testing on loopback
 
     Gilberto Echeverria
     gilecheverria@yahoo.com
@@ -17,13 +21,96 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 // Socket libraries
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
 
 #include "fatal_error.h"
+#include "shared_buffer.h"
+
+// Most buffers handed to a single writev call
+#define STREAM_IOVEC 64
+// Largest datagram sent or received, fits an Ethernet frame
+// A keyframe of every player must fit in one, so a game played over UDP can
+// have at most 291 players (views don't help, the snapshot at the end has
+// every player too), the server refuses -u for larger games
+#define MAX_DATAGRAM 1472
+// Most datagrams moved by a single recvmmsg or sendmmsg call
+#define DATAGRAM_BATCH 64
+
+// How the bytes of a stream are split into messages
+typedef enum framing_type {
+    // Every message ends with a '\0', as sent by sendString
+    FRAME_STRING,
+    // Every message starts with a header holding a big endian uint32 length
+    FRAME_LENGTH_PREFIXED
+} framing_t;
+
+/*
+    Buffered connection used by the event loop
+    Incoming bytes go to a growable ring buffer, so several messages can be
+    extracted from a single read and incomplete ones wait for the rest
+    Outgoing shared buffers are queued and written with writev, continuing
+    from where a partial write stopped
+    A buffer queued with a tag is a frame the next tagged one makes stale:
+    the ones not started yet can be dropped, so a slow reader only gets the
+    newest frame instead of every frame it fell behind on
+*/
+typedef struct stream_struct {
+    int fd;
+    // Framing of the incoming messages
+    framing_t framing;
+    size_t header_size;
+    size_t length_offset;
+    size_t max_message;
+    // Ring buffer of received bytes, capacity is a power of 2
+    char * in_data;
+    size_t in_capacity;
+    size_t in_head;
+    size_t in_length;
+    // Bytes already searched for a '\0' without finding one
+    size_t in_scanned;
+    // Copy of the last message when it wrapped around the ring
+    char * scratch;
+    size_t scratch_capacity;
+    // Shared buffers waiting to be written, oldest first, and their tags
+    shared_buffer_t ** out_queue;
+    uint32_t * out_tags;
+    int out_head;
+    int out_count;
+    int out_capacity;
+    // Bytes of the oldest buffer already written
+    size_t out_offset;
+    // Tag of the newest tagged buffer that started being written, 0 for none
+    uint32_t out_started_tag;
+    // Bytes written so far
+    unsigned long long out_total;
+} stream_t;
+
+/*
+    Datagrams received together, or waiting to be sent together
+    A datagram to send is a small prefix copied into the batch followed
+    by a body that stays owned by the caller until the batch is sent,
+    so a snapshot shared by every client is never copied
+*/
+typedef struct datagram_batch_struct {
+    struct mmsghdr messages[DATAGRAM_BATCH];
+    struct iovec iovecs[DATAGRAM_BATCH][2];
+    struct sockaddr_storage addresses[DATAGRAM_BATCH];
+    // Received datagrams, or the prefixes of the ones to send
+    unsigned char buffers[DATAGRAM_BATCH][MAX_DATAGRAM];
+    int count;
+    // Bytes of every datagram sent with the batch so far
+    unsigned long long bytes_sent;
+} datagram_batch_t;
 
 /*
 	Show the local IP addresses, to allow testing
@@ -59,4 +146,133 @@ int recvString(int connection_fd, char * buffer, int size);
 */
 void sendString(int connection_fd, char * buffer);
 
+/*
+    Send a block of bytes with error validation
+    Keeps sending until the whole block was written
+*/
+void sendBuffer(int connection_fd, const void * buffer, size_t length);
+
+/*
+    Switch a file descriptor to non-blocking mode
+    Used for the sockets managed by the server event loop
+*/
+void setNonBlocking(int fd);
+
+/*
+    Send small writes right away instead of waiting to coalesce them
+    Snapshots, inputs and pings are all tiny and latency bound
+*/
+void setNoDelay(int fd);
+
+/*
+    Prepare a stream for a connected socket
+    The stream starts with FRAME_STRING framing
+*/
+void initStream(stream_t * stream, int fd, size_t capacity);
+
+/*
+    Change how the next messages are framed
+    For FRAME_LENGTH_PREFIXED, the length found at length_offset counts the
+    bytes after the header; longer messages than max_message are errors
+*/
+void setStreamFraming(stream_t * stream, framing_t framing, size_t header_size,
+                      size_t length_offset, size_t max_message);
+
+/*
+    Read once from the socket into the free space of the ring
+    Returns the bytes read, 0 if the connection has finished,
+    or -1 with errno set (EAGAIN when nothing was available)
+*/
+ssize_t streamFill(stream_t * stream);
+
+/*
+    Extract the next complete message
+    Returns 1 and points message to it (valid until the next call to
+    streamFill or streamNextMessage), 0 when no complete message is buffered,
+    or -1 when the bytes don't follow the framing
+*/
+int streamNextMessage(stream_t * stream, char ** message, size_t * length);
+
+// Add a reference to a buffer at the end of the write queue
+void streamQueue(stream_t * stream, shared_buffer_t * buffer);
+
+// Same as streamQueue for a frame that may be dropped, tag is never 0
+void streamQueueTagged(stream_t * stream, shared_buffer_t * buffer, uint32_t tag);
+
+/*
+    Drop the tagged buffers that didn't start being written yet,
+    the untagged ones keep their order
+    Returns the number of buffers dropped
+*/
+int streamDropStale(stream_t * stream);
+
+/*
+    Tag of the newest tagged buffer that started being written, it is sure
+    to be delivered before anything queued later, 0 if none did
+*/
+uint32_t streamStartedTag(stream_t * stream);
+
+/*
+    Write as much of the queued buffers as the socket accepts
+    Returns 1 on success (some data may remain queued), or 0 on error
+*/
+int streamFlush(stream_t * stream);
+
+// Number of buffers still waiting to be written
+int streamPending(stream_t * stream);
+
+// Free the buffers of the stream, the socket is not closed
+void closeStream(stream_t * stream);
+
+/*
+    Open a non-blocking UDP socket bound to a local port
+    NULL takes any free port, see getSocketPort
+*/
+int initUdpSocket(char * port);
+
+/*
+    Open a non-blocking UDP socket that only talks to the given server
+*/
+int connectUdpSocket(char * address, char * port);
+
+// Make a connected UDP socket talk to another port of the same server
+void redirectUdpSocket(int fd, char * address, int port);
+
+// Local port of a socket
+int getSocketPort(int fd);
+
+/*
+    Receive every datagram waiting, up to DATAGRAM_BATCH, with one recvmmsg
+    Datagram i is batch->buffers[i], its length is batch->messages[i].msg_len
+    and its sender is batch->addresses[i]
+    Returns the number of datagrams, 0 if there were none, or -1 on error
+*/
+int receiveDatagrams(int fd, datagram_batch_t * batch);
+
+/*
+    Add a datagram to a batch, sending the batch first if it is full
+    address may be NULL for connected sockets
+*/
+void queueDatagram(int fd, datagram_batch_t * batch, const struct sockaddr_storage * address,
+                   socklen_t address_length, const void * prefix, size_t prefix_length,
+                   const void * body, size_t body_length);
+
+/*
+    Send every queued datagram with sendmmsg and empty the batch
+    Datagrams the socket can't take are dropped, like on the network
+*/
+void sendDatagrams(int fd, datagram_batch_t * batch);
+
+// Send a single datagram on a connected socket
+void sendDatagram(int fd, const void * data, size_t length);
+
+/*
+    The loss and latency simulator is configured with the environment
+    variable TRON_NETEM, for example "loss=10,delay=50,jitter=20": 10% of the
+    datagrams sent are dropped, the rest are delayed 50 ms plus up to 20 ms
+    more (which also reorders them). Delayed datagrams leave when the process
+    next sends or receives datagrams.
+*/
+void flushDelayedDatagrams();
+
 #endif
@@ -0,0 +1,211 @@
+/*
+ * Kernels of a simulation step over a player store.
+ *
+ * The scalar kernel runs everywhere. On x86 the AVX2 kernel moves 8 players
+ * per instruction, and tests 4 targets at once against the trails with
+ * gathers: first the pointers to the chunks, then the rows of those chunks.
+ */
+#include <pthread.h>
+
+#include "step_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+static void scalar_targets(player_store_t *store, int start, int end, int width, int height){
+  for (int i = start; i < end; i++) {
+    store->target_x[i] = store->x[i];
+    store->target_y[i] = store->y[i];
+    switch (store->direction[i]) {
+      case UP:
+        store->target_y[i] = getCoord(store->y[i] - 1, height);
+        break;
+      case LEFT:
+        store->target_x[i] = getCoord(store->x[i] - 1, width);
+        break;
+      case DOWN:
+        store->target_y[i] = getCoord(store->y[i] + 1, height);
+        break;
+      case RIGHT:
+        store->target_x[i] = getCoord(store->x[i] + 1, width);
+        break;
+    }
+  }
+}
+
+static void scalar_occupancy(board_t *board, player_store_t *store, int start, int end){
+  for (int i = start; i < end; i++) {
+    store->crashed[i] = store->alive[i]
+      && board_is_occupied(board, store->target_x[i], store->target_y[i]);
+  }
+}
+
+static int scalar_commit(player_store_t *store, int start, int end){
+  int alive = 0;
+  for (int i = start; i < end; i++) {
+    if (!store->alive[i]) {
+      continue;
+    }
+    store->x[i] = store->target_x[i];
+    store->y[i] = store->target_y[i];
+    if (store->crashed[i]) {
+      store->alive[i] = 0;
+    } else {
+      alive++;
+    }
+  }
+  return alive;
+}
+
+static const step_kernel_t scalar_kernel = {
+  "scalar", scalar_targets, scalar_occupancy, scalar_commit
+};
+
+#ifdef HAVE_AVX2_KERNEL
+
+// The store is padded to STORE_LANES players, so these run on whole vectors
+// past end when end is the last player
+__attribute__((target("avx2")))
+static void avx2_targets(player_store_t *store, int start, int end, int width, int height){
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i up = _mm256_set1_epi32(UP), down = _mm256_set1_epi32(DOWN);
+  const __m256i left = _mm256_set1_epi32(LEFT), right = _mm256_set1_epi32(RIGHT);
+  const __m256i w = _mm256_set1_epi32(width), h = _mm256_set1_epi32(height);
+  const __m256i last_x = _mm256_set1_epi32(width - 1), last_y = _mm256_set1_epi32(height - 1);
+  __m256i d, x, y;
+
+  for (int i = start; i < end; i += 8) {
+    d = _mm256_loadu_si256((const __m256i *)(store->direction + i));
+    x = _mm256_loadu_si256((const __m256i *)(store->x + i));
+    y = _mm256_loadu_si256((const __m256i *)(store->y + i));
+    // The comparisons give -1 where true
+    x = _mm256_add_epi32(x, _mm256_sub_epi32(_mm256_cmpeq_epi32(d, left), _mm256_cmpeq_epi32(d, right)));
+    y = _mm256_add_epi32(y, _mm256_sub_epi32(_mm256_cmpeq_epi32(d, up), _mm256_cmpeq_epi32(d, down)));
+    // Wrap around like getCoord
+    x = _mm256_add_epi32(x, _mm256_and_si256(_mm256_cmpgt_epi32(zero, x), w));
+    x = _mm256_sub_epi32(x, _mm256_and_si256(_mm256_cmpgt_epi32(x, last_x), w));
+    y = _mm256_add_epi32(y, _mm256_and_si256(_mm256_cmpgt_epi32(zero, y), h));
+    y = _mm256_sub_epi32(y, _mm256_and_si256(_mm256_cmpgt_epi32(y, last_y), h));
+    _mm256_storeu_si256((__m256i *)(store->target_x + i), x);
+    _mm256_storeu_si256((__m256i *)(store->target_y + i), y);
+  }
+}
+
+__attribute__((target("avx2")))
+static void avx2_occupancy(board_t *board, player_store_t *store, int start, int end){
+  const __m128i mask = _mm_set1_epi32(CHUNK_MASK);
+  const __m128i columns = _mm_set1_epi32(board->chunk_columns);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  __m128i x, y, chunk;
+  __m256i alive, chunks, rows, bits;
+
+  for (int i = start; i < end; i += 4) {
+    x = _mm_loadu_si128((const __m128i *)(store->target_x + i));
+    y = _mm_loadu_si128((const __m128i *)(store->target_y + i));
+    // Only the players alive are looked up, the others never crash
+    alive = _mm256_cvtepi32_epi64(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(store->alive + i)),
+      _mm_setzero_si128()));
+    chunk = _mm_add_epi32(_mm_mullo_epi32(_mm_srli_epi32(y, CHUNK_SHIFT), columns),
+      _mm_srli_epi32(x, CHUNK_SHIFT));
+    chunks = _mm256_mask_i32gather_epi64(zero, (const long long *)board->occupied, chunk, alive, 8);
+    // A chunk never allocated has no trails
+    alive = _mm256_andnot_si256(_mm256_cmpeq_epi64(chunks, zero), alive);
+    chunks = _mm256_add_epi64(chunks, _mm256_cvtepi32_epi64(_mm_slli_epi32(_mm_and_si128(y, mask), 3)));
+    rows = _mm256_mask_i64gather_epi64(zero, NULL, chunks, alive, 1);
+    bits = _mm256_and_si256(_mm256_srlv_epi64(rows, _mm256_cvtepi32_epi64(_mm_and_si128(x, mask))), one);
+    _mm_storeu_si128((__m128i *)(store->crashed + i),
+      _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bits, low_halves)));
+  }
+}
+
+__attribute__((target("avx2")))
+static int avx2_commit(player_store_t *store, int start, int end){
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i alive, moving, crashed, count = zero;
+  __m128i sum;
+
+  for (int i = start; i < end; i += 8) {
+    alive = _mm256_loadu_si256((const __m256i *)(store->alive + i));
+    crashed = _mm256_loadu_si256((const __m256i *)(store->crashed + i));
+    moving = _mm256_cmpgt_epi32(alive, zero);
+    _mm256_storeu_si256((__m256i *)(store->x + i), _mm256_blendv_epi8(
+      _mm256_loadu_si256((const __m256i *)(store->x + i)),
+      _mm256_loadu_si256((const __m256i *)(store->target_x + i)), moving));
+    _mm256_storeu_si256((__m256i *)(store->y + i), _mm256_blendv_epi8(
+      _mm256_loadu_si256((const __m256i *)(store->y + i)),
+      _mm256_loadu_si256((const __m256i *)(store->target_y + i)), moving));
+    // Both are 1 or 0
+    alive = _mm256_andnot_si256(crashed, alive);
+    _mm256_storeu_si256((__m256i *)(store->alive + i), alive);
+    count = _mm256_add_epi32(count, alive);
+  }
+  sum = _mm_add_epi32(_mm256_castsi256_si128(count), _mm256_extracti128_si256(count, 1));
+  sum = _mm_hadd_epi32(sum, sum);
+  sum = _mm_hadd_epi32(sum, sum);
+  return _mm_cvtsi128_si32(sum);
+}
+
+static const step_kernel_t avx2_kernel = {
+  "avx2", avx2_targets, avx2_occupancy, avx2_commit
+};
+
+#endif
+
+static const step_kernel_t *kernel = &scalar_kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// Whether this CPU can run the kernel
+static int kernel_supported(const step_kernel_t *candidate){
+#ifdef HAVE_AVX2_KERNEL
+  if (candidate == &avx2_kernel) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return candidate == &scalar_kernel;
+}
+
+// Kernel with this name that this CPU can run, NULL if none
+static const step_kernel_t *find_kernel(const char *name){
+  const step_kernel_t *kernels[] = {
+#ifdef HAVE_AVX2_KERNEL
+    &avx2_kernel,
+#endif
+    &scalar_kernel
+  };
+  for (int i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+    if (strcmp(kernels[i]->name, name) == 0 && kernel_supported(kernels[i])) {
+      return kernels[i];
+    }
+  }
+  return NULL;
+}
+
+static void pick_kernel(void){
+  const char *forced = getenv("TRON_KERNEL");
+  if (forced != NULL && find_kernel(forced) != NULL) {
+    kernel = find_kernel(forced);
+  } else if (find_kernel("avx2") != NULL) {
+    kernel = find_kernel("avx2");
+  }
+}
+
+const step_kernel_t *get_step_kernel(void){
+  pthread_once(&kernel_once, pick_kernel);
+  return kernel;
+}
+
+int select_step_kernel(const char *name){
+  const step_kernel_t *selected = find_kernel(name);
+  // Pick the default first, so it never replaces this one later
+  pthread_once(&kernel_once, pick_kernel);
+  if (selected == NULL) {
+    return 0;
+  }
+  kernel = selected;
+  return 1;
+}
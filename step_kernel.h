@@ -0,0 +1,38 @@
+/*
+ * Kernels of a simulation step over a player store.
+ *
+ * The work a step does for every player on its own (finding its target,
+ * testing that cell against the trails, moving it) is done here, on a
+ * store of players kept field by field, so it can run on several players
+ * with each instruction. Every kernel gives exactly the same results as the
+ * plain C one. The widest kernel the CPU supports is picked the first time
+ * a step runs; setting TRON_KERNEL=scalar in the environment forces the
+ * plain C one.
+ */
+
+#ifndef STEP_KERNEL_H
+#define STEP_KERNEL_H
+
+#include "tron_simulation.h"
+
+// Every function works on players start to end - 1, start a multiple of
+// STORE_LANES, so several threads can share a store
+typedef struct step_kernel_struct{
+    const char *name;
+    // The cell every player moves to, wrapping around the board
+    void (*targets)(player_store_t *store, int start, int end, int width, int height);
+    // Mark as crashed the players alive whose target is taken
+    void (*occupancy)(board_t *board, player_store_t *store, int start, int end);
+    // Move the players alive to their targets, the crashed ones stop there
+    // Returns the number of players still alive
+    int (*commit)(player_store_t *store, int start, int end);
+} step_kernel_t;
+
+// Kernel used by step_players
+const step_kernel_t *get_step_kernel(void);
+
+// Use the kernel with this name from now on
+// Returns 0 if there is no such kernel or the CPU can't run it
+int select_step_kernel(const char *name);
+
+#endif
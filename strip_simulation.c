@@ -0,0 +1,205 @@
+/*
+ * Simulation of one board by several threads.
+ * See strip_simulation.h for the phases of a step.
+ */
+#include "strip_simulation.h"
+#include "step_kernel.h"
+
+static void *strip_thread(void *arg);
+static void run_step(strip_worker_t *worker);
+
+strip_simulation_t *create_strip_simulation(board_t *board, int threads){
+  strip_simulation_t *simulation = calloc(1, sizeof(*simulation));
+  strip_worker_t *worker;
+
+  if (threads > board->chunk_rows) {
+    threads = board->chunk_rows;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  simulation->board = board;
+  simulation->threads = threads;
+  // Strips as even as whole rows of chunks allow
+  simulation->strip_of_row = malloc(board->chunk_rows * sizeof(*simulation->strip_of_row));
+  for (int s = 0; s < threads; s++) {
+    for (int row = s * board->chunk_rows / threads; row < (s + 1) * board->chunk_rows / threads; row++) {
+      simulation->strip_of_row[row] = s;
+    }
+  }
+  simulation->workers = calloc(threads, sizeof(*simulation->workers));
+  pthread_barrier_init(&simulation->barrier, NULL, threads);
+  for (int i = 0; i < threads; i++) {
+    worker = &simulation->workers[i];
+    worker->simulation = simulation;
+    worker->index = i;
+    worker->strip_start = malloc((threads + 1) * sizeof(*worker->strip_start));
+    if (i > 0) {
+      pthread_create(&worker->thread, NULL, strip_thread, worker);
+    }
+  }
+  return simulation;
+}
+
+void free_strip_simulation(strip_simulation_t *simulation){
+  simulation->stop = 1;
+  pthread_barrier_wait(&simulation->barrier);
+  for (int i = 0; i < simulation->threads; i++) {
+    if (i > 0) {
+      pthread_join(simulation->workers[i].thread, NULL);
+    }
+    free(simulation->workers[i].order);
+    free(simulation->workers[i].strip_start);
+    free_target_table(&simulation->workers[i].targets);
+  }
+  pthread_barrier_destroy(&simulation->barrier);
+  free_player_store(&simulation->store);
+  free(simulation->workers);
+  free(simulation->strip_of_row);
+  free(simulation);
+}
+
+int strip_simulation(strip_simulation_t *simulation, player_status_t *players, int player_c){
+  int alive = 0;
+  int range;
+
+  load_players(&simulation->store, players, player_c);
+  // Ranges of whole vectors, so the kernels of two threads never share one
+  range = (player_c + simulation->threads - 1) / simulation->threads;
+  simulation->range = (range + STORE_LANES - 1) / STORE_LANES * STORE_LANES;
+  for (int i = 0; i < simulation->threads; i++) {
+    if (simulation->workers[i].order_capacity < simulation->range) {
+      free(simulation->workers[i].order);
+      simulation->workers[i].order = malloc(simulation->range * sizeof(int));
+      simulation->workers[i].order_capacity = simulation->range;
+    }
+  }
+
+  // Start the others, do the share of thread 0 and wait for them
+  pthread_barrier_wait(&simulation->barrier);
+  run_step(&simulation->workers[0]);
+  pthread_barrier_wait(&simulation->barrier);
+
+  for (int i = 0; i < simulation->threads; i++) {
+    alive += simulation->workers[i].alive;
+  }
+  save_players(&simulation->store, players);
+  return alive > 1 || (player_c == 1 && alive == 1);
+}
+
+// Every thread but the caller runs a step each time the caller does
+static void *strip_thread(void *arg){
+  strip_worker_t *worker = arg;
+
+  while (1) {
+    pthread_barrier_wait(&worker->simulation->barrier);
+    if (worker->simulation->stop) {
+      break;
+    }
+    run_step(worker);
+    pthread_barrier_wait(&worker->simulation->barrier);
+  }
+  return NULL;
+}
+
+// Counting sort of the range of the worker by the strip of the row of
+// every player alive, in x and y
+static void sort_by_strip(strip_worker_t *worker, int start, int end, int32_t *y){
+  strip_simulation_t *simulation = worker->simulation;
+  player_store_t *store = &simulation->store;
+  int *strip_start = worker->strip_start;
+  int strip;
+
+  memset(strip_start, 0, (simulation->threads + 1) * sizeof(*strip_start));
+  for (int i = start; i < end; i++) {
+    if (store->alive[i]) {
+      strip_start[simulation->strip_of_row[y[i] >> CHUNK_SHIFT]]++;
+    }
+  }
+  // Where every strip ends, for now
+  for (int s = 1; s < simulation->threads; s++) {
+    strip_start[s] += strip_start[s - 1];
+  }
+  strip_start[simulation->threads] = strip_start[simulation->threads - 1];
+  // Filled back to front, so each strip keeps the players in order and
+  // strip_start ends up where it starts
+  for (int i = end - 1; i >= start; i--) {
+    if (store->alive[i]) {
+      strip = simulation->strip_of_row[y[i] >> CHUNK_SHIFT];
+      worker->order[--strip_start[strip]] = i;
+    }
+  }
+}
+
+static void run_step(strip_worker_t *worker){
+  strip_simulation_t *simulation = worker->simulation;
+  board_t *board = simulation->board;
+  player_store_t *store = &simulation->store;
+  const step_kernel_t *kernel = get_step_kernel();
+  int start = worker->index * simulation->range;
+  int end = start + simulation->range;
+  int strip = worker->index;
+  int i, slot, incoming = 0;
+  strip_worker_t *source;
+
+  if (end > store->count) {
+    end = store->count;
+  }
+  if (start > end) {
+    start = end;
+  }
+
+  // The cells being left become part of the trails, before anybody moves
+  sort_by_strip(worker, start, end, store->y);
+  pthread_barrier_wait(&simulation->barrier);
+  for (int w = 0; w < simulation->threads; w++) {
+    source = &simulation->workers[w];
+    for (int j = source->strip_start[strip]; j < source->strip_start[strip + 1]; j++) {
+      i = source->order[j];
+      board_occupy(board, store->x[i], store->y[i], store->owner[i]);
+    }
+  }
+  pthread_barrier_wait(&simulation->barrier);
+
+  // Nothing is written to the board until every target is tested
+  if (start < end) {
+    kernel->targets(store, start, end, board->width, board->height);
+    kernel->occupancy(board, store, start, end);
+  }
+  sort_by_strip(worker, start, end, store->target_y);
+  pthread_barrier_wait(&simulation->barrier);
+
+  // Merge the players coming into this strip, the order doesn't change
+  // the result but keeps the table the same on every run
+  for (int w = 0; w < simulation->threads; w++) {
+    source = &simulation->workers[w];
+    incoming += source->strip_start[strip + 1] - source->strip_start[strip];
+  }
+  clear_target_table(&worker->targets, incoming);
+  for (int w = 0; w < simulation->threads; w++) {
+    source = &simulation->workers[w];
+    for (int j = source->strip_start[strip]; j < source->strip_start[strip + 1]; j++) {
+      i = source->order[j];
+      slot = target_table_slot(&worker->targets, board->width, store->target_x[i], store->target_y[i]);
+      store->slots[i] = slot;
+      worker->targets.counts[slot]++;
+    }
+  }
+  // Move everybody, the ones that crashed stop there and only the
+  // survivors take their new cell
+  worker->alive = 0;
+  for (int w = 0; w < simulation->threads; w++) {
+    source = &simulation->workers[w];
+    for (int j = source->strip_start[strip]; j < source->strip_start[strip + 1]; j++) {
+      i = source->order[j];
+      store->x[i] = store->target_x[i];
+      store->y[i] = store->target_y[i];
+      if (store->crashed[i] || worker->targets.counts[store->slots[i]] > 1) {
+        store->alive[i] = 0;
+      } else {
+        board_occupy(board, store->x[i], store->y[i], store->owner[i]);
+        worker->alive++;
+      }
+    }
+  }
+}
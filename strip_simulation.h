@@ -0,0 +1,73 @@
+/*
+ * Simulation of one board by several threads.
+ *
+ * The board is split into horizontal strips of whole chunk rows, one per
+ * thread, so no two threads ever write to the same chunk. A step goes
+ * through the phases of step_players, each one split between the threads,
+ * with a barrier in between:
+ *  - The players are sorted by the strip of the cell they are in, each
+ *    thread sorting a range of them.
+ *  - Every thread takes the cells of the players in its strip.
+ *  - Every thread finds the targets of its range of players and tests them
+ *    against the trails (the board is only read here), sorting them again
+ *    by the strip of their target.
+ *  - Every thread merges the players coming into its strip, from every
+ *    range in order, finds the ones that meet in the same cell, moves them
+ *    and takes the cells of the survivors.
+ * No result depends on which thread finishes first, so the games are the
+ * same bit by bit as with game_simulation.
+ */
+
+#ifndef STRIP_SIMULATION_H
+#define STRIP_SIMULATION_H
+
+#include <pthread.h>
+
+#include "tron_simulation.h"
+
+typedef struct strip_simulation_struct strip_simulation_t;
+
+// What every thread keeps, thread 0 is the one calling strip_simulation
+typedef struct strip_worker_struct{
+    strip_simulation_t *simulation;
+    int index;
+    pthread_t thread;
+    // Its range of players sorted by strip: the ones in strip s are
+    // order[strip_start[s]] to order[strip_start[s + 1] - 1]
+    int *order;
+    int *strip_start;
+    int order_capacity;
+    // Targets coming into its strip
+    target_table_t targets;
+    // Players alive in its strip after the step
+    int alive;
+} strip_worker_t;
+
+struct strip_simulation_struct{
+    board_t *board;
+    int threads;
+    // Strip of every row of chunks
+    int *strip_of_row;
+    strip_worker_t *workers;
+    pthread_barrier_t barrier;
+    player_store_t store;
+    // Players in the range of each thread, a multiple of STORE_LANES
+    int range;
+    // Set to make the other threads exit
+    int stop;
+};
+
+/*
+ * Prepare threads - 1 threads to simulate board along with the caller
+ * There are never more strips than rows of chunks, so a small board may
+ * get fewer threads
+ */
+strip_simulation_t *create_strip_simulation(board_t *board, int threads);
+
+// Stop the threads and free the simulation, not the board
+void free_strip_simulation(strip_simulation_t *simulation);
+
+// Same as game_simulation on the board of the simulation
+int strip_simulation(strip_simulation_t *simulation, player_status_t *players, int player_c);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Fixed-rate tick scheduler for the authoritative game loop.
+ *
+ * Ticks are driven by a timerfd armed on absolute CLOCK_MONOTONIC deadlines,
+ * so the file descriptor can be watched by the same epoll loop as the sockets.
+ * Every expiration records how late it was served (jitter) and how many
+ * deadlines were missed completely (overruns).
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tick_scheduler.h"
+
+// Current time of the monotonic clock in microseconds
+long long monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Convert microseconds to the structure used by the timer
+static struct timespec microsToTimespec(long long micros) {
+  struct timespec result;
+  result.tv_sec = micros / 1000000;
+  result.tv_nsec = (micros % 1000000) * 1000;
+  return result;
+}
+
+// Create the timerfd, it won't fire until startTickScheduler is called
+void initTickScheduler(tick_scheduler_t * scheduler, long long period) {
+  memset(scheduler, 0, sizeof(*scheduler));
+  scheduler->period = period > 0 ? period : 1;
+  scheduler->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (scheduler->timer_fd == -1) {
+    fatalError("ERROR: timerfd_create");
+  }
+}
+
+// Arm the timer, the first tick fires one period from now
+void startTickScheduler(tick_scheduler_t * scheduler) {
+  struct itimerspec timer;
+
+  scheduler->start = monotonicMicros();
+  scheduler->tick = 0;
+  timer.it_value = microsToTimespec(scheduler->start + scheduler->period);
+  timer.it_interval = microsToTimespec(scheduler->period);
+  if (timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1) {
+    fatalError("ERROR: timerfd_settime");
+  }
+}
+
+/*
+    Consume the pending expirations of the timer
+    Returns the number of the tick to simulate, or -1 if the timer had not fired
+    Deadlines that were missed are counted as overruns and not simulated
+*/
+long long nextTick(tick_scheduler_t * scheduler) {
+  uint64_t expirations;
+  long long deadline;
+  long long jitter;
+
+  if (read(scheduler->timer_fd, &expirations, sizeof expirations) != sizeof expirations) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return -1;
+    }
+    fatalError("ERROR: read timerfd");
+  }
+
+  // Skip the deadlines that were missed, only the latest one is served
+  scheduler->tick += expirations - 1;
+  scheduler->window_overruns += expirations - 1;
+  scheduler->total_overruns += expirations - 1;
+
+  deadline = scheduler->start + (long long)(scheduler->tick + 1) * scheduler->period;
+  jitter = monotonicMicros() - deadline;
+  if (jitter < 0) {
+    jitter = 0;
+  }
+  scheduler->window_jitter_sum += jitter;
+  if (jitter > scheduler->window_jitter_max) {
+    scheduler->window_jitter_max = jitter;
+  }
+  if (jitter > scheduler->total_jitter_max) {
+    scheduler->total_jitter_max = jitter;
+  }
+  scheduler->window_ticks++;
+
+  return scheduler->tick++;
+}
+
+long long tickWindowLength(tick_scheduler_t * scheduler) {
+  return (long long)(scheduler->window_ticks + scheduler->window_overruns) * scheduler->period;
+}
+
+int formatTickStats(tick_scheduler_t * scheduler, char * buffer, size_t size) {
+  if (scheduler->window_ticks == 0) {
+    return 0;
+  }
+  snprintf(buffer, size, "tick %llu: %llu ticks, jitter avg %lld us max %lld us, %llu overruns",
+    scheduler->tick, scheduler->window_ticks,
+    scheduler->window_jitter_sum / (long long)scheduler->window_ticks,
+    scheduler->window_jitter_max, scheduler->window_overruns);
+  scheduler->window_ticks = 0;
+  scheduler->window_overruns = 0;
+  scheduler->window_jitter_sum = 0;
+  scheduler->window_jitter_max = 0;
+  return 1;
+}
+
+void closeTickScheduler(tick_scheduler_t * scheduler) {
+  close(scheduler->timer_fd);
+}
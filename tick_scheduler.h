@@ -0,0 +1,66 @@
+/*
+ * Fixed-rate tick scheduler for the authoritative game loop.
+ *
+ * Ticks are driven by a timerfd armed on absolute CLOCK_MONOTONIC deadlines,
+ * so the file descriptor can be watched by the same epoll loop as the sockets.
+ * Every expiration records how late it was served (jitter) and how many
+ * deadlines were missed completely (overruns).
+ */
+
+#ifndef TICK_SCHEDULER_H
+#define TICK_SCHEDULER_H
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "fatal_error.h"
+
+typedef struct tick_scheduler_struct {
+  // The timerfd to register in the event loop
+  int timer_fd;
+  // Time between ticks in microseconds
+  long long period;
+  // Time of tick 0 in microseconds of the monotonic clock
+  long long start;
+  // Number of the next tick to be served
+  unsigned long long tick;
+  // Statistics since the last report
+  unsigned long long window_ticks;
+  unsigned long long window_overruns;
+  long long window_jitter_sum;
+  long long window_jitter_max;
+  // Statistics since the scheduler was started
+  unsigned long long total_overruns;
+  long long total_jitter_max;
+} tick_scheduler_t;
+
+// Current time of the monotonic clock in microseconds
+long long monotonicMicros();
+
+// Create the timerfd, it won't fire until startTickScheduler is called
+void initTickScheduler(tick_scheduler_t * scheduler, long long period);
+
+// Arm the timer, the first tick fires one period from now
+void startTickScheduler(tick_scheduler_t * scheduler);
+
+/*
+    Consume the pending expirations of the timer
+    Returns the number of the tick to simulate, or -1 if the timer had not fired
+    Deadlines that were missed are counted as overruns and not simulated
+*/
+long long nextTick(tick_scheduler_t * scheduler);
+
+// Time the ticks since the last report cover, served or missed, in us
+long long tickWindowLength(tick_scheduler_t * scheduler);
+
+/*
+    Write the jitter and overruns since the last report to buffer and start
+    a new window
+    Returns 0, and writes nothing, if no tick was served since then
+*/
+int formatTickStats(tick_scheduler_t * scheduler, char * buffer, size_t size);
+
+void closeTickScheduler(tick_scheduler_t * scheduler);
+
+#endif
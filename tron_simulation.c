@@ -8,11 +8,10 @@
  * 9/Nov/2018
  */
 #include "tron_simulation.h"
+#include "step_kernel.h"
 
 // Create and allocate board
 board_t *create_board(int size_x, int size_y){
-  srand (time(NULL));
-  
   // Allocate pointer to stuct
   board_t* board = malloc(sizeof(board_t));
   
@@ -20,29 +19,78 @@ board_t *create_board(int size_x, int size_y){
   board->width = size_x;
   board->height = size_y;
   
-  // Allocate index of the stucts pixel
-  board->spaces = (int**)malloc(size_y * sizeof(int*));
-  
-  // Allocate all necesary spaces for the board stuct
-  board->spaces[0] = (int*)calloc(size_x * size_y, sizeof(int));
-  for(int i = 0; i < (board->height); i++){
-    board->spaces[i] = board->spaces[0] + board->width * i;
+  // Only the table of chunks, they are allocated as the trails reach them
+  board->chunk_columns = (size_x + CHUNK_MASK) >> CHUNK_SHIFT;
+  board->chunk_rows = (size_y + CHUNK_MASK) >> CHUNK_SHIFT;
+  board->occupied = calloc(board->chunk_columns * board->chunk_rows, sizeof(*board->occupied));
+  board->chunk_count = 0;
+  // Owners are only allocated when needed
+  board->owners = NULL;
+  // So is the scratch space of the simulation
+  memset(&board->store, 0, sizeof(board->store));
+  memset(&board->targets, 0, sizeof(board->targets));
+  return board;
+}
+
+void board_allocate_chunk(board_t *board, int chunk){
+  board->occupied[chunk] = calloc(CHUNK_SIZE, sizeof(uint64_t));
+  if (board->owners != NULL) {
+    board->owners[chunk] = calloc(CHUNK_SIZE * CHUNK_SIZE, sizeof(uint16_t));
   }
-  
-  // Initialize to zeros
-  for(int i = 0; i < (size_x * size_y); i++){
-    board->spaces[0][i] = 0;
+  // Strips of the board simulated by different threads allocate at once
+  __atomic_fetch_add(&board->chunk_count, 1, __ATOMIC_RELAXED);
+}
+
+// Keep an owner id for every cell
+void enable_owners(board_t * board){
+  int chunks = board->chunk_columns * board->chunk_rows;
+  if (board->owners == NULL) {
+    board->owners = calloc(chunks, sizeof(*board->owners));
+    // The chunks taken so far need owners too
+    for (int i = 0; i < chunks; i++) {
+      if (board->occupied[i] != NULL) {
+        board->owners[i] = calloc(CHUNK_SIZE * CHUNK_SIZE, sizeof(uint16_t));
+      }
+    }
   }
-  return board;
 }
 
 // Free the data 
 void free_board(board_t * board){
-  free(board->spaces[0]);
-  free(board->spaces);
+  int chunks = board->chunk_columns * board->chunk_rows;
+  for (int i = 0; i < chunks; i++) {
+    free(board->occupied[i]);
+    if (board->owners != NULL) {
+      free(board->owners[i]);
+    }
+  }
+  free(board->occupied);
+  free(board->owners);
+  free_player_store(&board->store);
+  free_target_table(&board->targets);
   free(board);
 }
 
+void clear_board(board_t * board){
+  int chunks = board->chunk_columns * board->chunk_rows;
+  for (int i = 0; i < chunks; i++) {
+    if (board->occupied[i] != NULL) {
+      memset(board->occupied[i], 0, CHUNK_SIZE * sizeof(uint64_t));
+      if (board->owners != NULL) {
+        memset(board->owners[i], 0, CHUNK_SIZE * CHUNK_SIZE * sizeof(uint16_t));
+      }
+    }
+  }
+}
+
+void board_set_owner(board_t *board, int x, int y, int owner){
+  int chunk = board_chunk(board, x, y);
+  if (board->occupied[chunk] == NULL) {
+    board_allocate_chunk(board, chunk);
+  }
+  board->owners[chunk][(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)] = owner;
+}
+
 // Read board from a file
 board_t* board_from_file(char* filename){
   int size_x = 0, size_y = 0;
@@ -56,23 +104,19 @@ board_t* board_from_file(char* filename){
   
   // Create board of that size
   board_t* board = create_board(size_x, size_y);
+  enable_owners(board);
   
   // Read file into board
   int buffer = 0;
   for (int i = 0; i < size_y; i++){
     for (int j = 0; j < size_x; j++){
       fscanf(file, "%i", &buffer);
-      // 1 == Player1
-      if(buffer == 1){
-        board->spaces[i][j] = 1;
-      }
-      // 2 ==  Player2
-      else if(buffer == 2){
-        board->spaces[i][j] = 2;
+      // A player number marks the start position of that player,
+      // the cell stays free
+      if(buffer == 1 || buffer == 2){
+        board_set_owner(board, j, i, buffer);
       }
       // Any other number will be taken as EMPTY
-      else
-        board->spaces[i][j] = EMPTY;
     }
   }
   fclose(file);
@@ -97,7 +141,13 @@ char encode(int val){
 void print_board(board_t *board){
     for(int i = 0; i < board->height; i++){
         for(int j = 0; j < board->width; j++){
-            printf("%c|", encode(board->spaces[i][j]));
+            if (!board_is_occupied(board, j, i)) {
+                printf("%c|", encode(EMPTY));
+            } else if (board_owner(board, j, i) > 0) {
+                printf("%d|", board_owner(board, j, i) % 10);
+            } else {
+                printf("%c|", encode(PLAYER_TRAIL));
+            }
         }
         printf("\n");
     }
@@ -111,18 +161,18 @@ Enumeration for the position
     3         DOWN
 */
 
-void getNewCoordinates(player_status_t *player){
+void getNewCoordinates(player_status_t *player, int width, int height){
   if(player->current_direction == UP){
-    player->coordinates.y_position = getCoord(player->coordinates.y_position - 1, BOARD_HEIGHT);
+    player->coordinates.y_position = getCoord(player->coordinates.y_position - 1, height);
   }
   else if(player->current_direction == LEFT){
-    player->coordinates.x_position = getCoord(player->coordinates.x_position - 1, BOARD_WIDTH);
+    player->coordinates.x_position = getCoord(player->coordinates.x_position - 1, width);
   }
   else if(player->current_direction == DOWN){
-    player->coordinates.y_position = getCoord(player->coordinates.y_position + 1, BOARD_HEIGHT);
+    player->coordinates.y_position = getCoord(player->coordinates.y_position + 1, height);
   }
   else if(player->current_direction == RIGHT){
-    player->coordinates.x_position = getCoord(player->coordinates.x_position + 1, BOARD_WIDTH);
+    player->coordinates.x_position = getCoord(player->coordinates.x_position + 1, width);
   }
   else{
       //error
@@ -138,62 +188,224 @@ int getCoord(int coord, int max) {
   return coord;
 }
 
-// Actual game simulation
-void game_simulation(board_t *board, player_status_t * players, int player_c) {
+// Empty the hash table of the targets, making it a power of 2 at least
+// twice as large as the players
+void clear_target_table(target_table_t *table, int player_c){
+  int capacity = 16;
+  while (capacity < 2 * player_c) {
+    capacity *= 2;
+  }
+  if (capacity > table->capacity) {
+    free(table->keys);
+    free(table->counts);
+    table->keys = malloc(capacity * sizeof(*table->keys));
+    table->counts = malloc(capacity * sizeof(*table->counts));
+    table->capacity = capacity;
+  }
+  memset(table->keys, 0, table->capacity * sizeof(*table->keys));
+}
+
+int target_table_slot(target_table_t *table, int width, int x, int y){
+  // Never 0, which marks the free slots
+  uint64_t key = (uint64_t)y * width + x + 1;
+  int mask = table->capacity - 1;
+  int slot = (key * 0x9E3779B97F4A7C15ULL) >> 40 & mask;
+
+  while (table->keys[slot] != 0 && table->keys[slot] != key) {
+    slot = (slot + 1) & mask;
+  }
+  if (table->keys[slot] == 0) {
+    table->keys[slot] = key;
+    table->counts[slot] = 0;
+  }
+  return slot;
+}
+
+void free_target_table(target_table_t *table){
+  free(table->keys);
+  free(table->counts);
+  memset(table, 0, sizeof(*table));
+}
+
+// Make room in the scratch space for player_c players, padded to whole
+// lanes, and copy them in
+void load_players(player_store_t *store, const player_status_t *players, int player_c){
+  int capacity = (player_c + STORE_LANES - 1) / STORE_LANES * STORE_LANES;
+  int32_t **arrays[] = {&store->x, &store->y, &store->direction, &store->alive, &store->owner,
+    &store->target_x, &store->target_y, &store->crashed, &store->slots};
+  int array_c = sizeof(arrays) / sizeof(*arrays);
+
+  if (capacity > store->capacity) {
+    for (int i = 0; i < array_c; i++) {
+      free(*arrays[i]);
+      *arrays[i] = malloc(capacity * sizeof(int32_t));
+    }
+    store->capacity = capacity;
+  }
+  store->count = player_c;
   for (int i = 0; i < player_c; i++) {
-    board->spaces[players[i].coordinates.y_position][players[i].coordinates.x_position] = PLAYER_TRAIL;
-    
-    getNewCoordinates(&players[i]);
+    store->x[i] = players[i].coordinates.x_position;
+    store->y[i] = players[i].coordinates.y_position;
+    store->direction[i] = players[i].current_direction;
+    store->alive[i] = players[i].status != 0;
+    store->owner[i] = players[i].player_number;
+  }
+  // Padding players, never alive
+  for (int i = player_c; i < capacity; i++) {
+    store->x[i] = 0;
+    store->y[i] = 0;
+    store->direction[i] = UP;
+    store->alive[i] = 0;
+    store->owner[i] = 0;
+  }
+}
+
+void save_players(player_store_t *store, player_status_t *players){
+  for (int i = 0; i < store->count; i++) {
+    players[i].coordinates.x_position = store->x[i];
+    players[i].coordinates.y_position = store->y[i];
+    players[i].current_direction = store->direction[i];
+    players[i].status = store->alive[i];
+  }
+}
+
+void free_player_store(player_store_t *store){
+  free(store->x);
+  free(store->y);
+  free(store->direction);
+  free(store->alive);
+  free(store->owner);
+  free(store->target_x);
+  free(store->target_y);
+  free(store->crashed);
+  free(store->slots);
+  memset(store, 0, sizeof(*store));
+}
 
-    if (board->spaces[players[i].coordinates.y_position][players[i].coordinates.x_position] != EMPTY) {
-      printf("Game has ended\n");
-      exit(EXIT_SUCCESS);
+// In phases so no player sees the moves of the others: find where every
+// player goes, then move them all. The kernel does the work that is the
+// same for every player, the table of shared targets stays here
+int step_players(board_t *board, player_store_t *store){
+  const step_kernel_t *kernel = get_step_kernel();
+  int alive;
+
+  clear_target_table(&board->targets, store->count);
+
+  // The cells being left become part of the trails, before anybody moves
+  for (int i = 0; i < store->count; i++) {
+    if (store->alive[i]) {
+      board_occupy(board, store->x[i], store->y[i], store->owner[i]);
+    }
+  }
+  kernel->targets(store, 0, store->count, board->width, board->height);
+  // A target taken by a trail, checked before any new cell is taken
+  kernel->occupancy(board, store, 0, store->count);
+  // Count the players going to every cell
+  for (int i = 0; i < store->count; i++) {
+    if (store->alive[i]) {
+      store->slots[i] = target_table_slot(&board->targets, board->width,
+        store->target_x[i], store->target_y[i]);
+      board->targets.counts[store->slots[i]]++;
     }
+  }
+  for (int i = 0; i < store->count; i++) {
+    if (store->alive[i] && board->targets.counts[store->slots[i]] > 1) {
+      store->crashed[i] = 1;
+    }
+  }
+  // Move everybody, the ones that crashed stop there
+  alive = kernel->commit(store, 0, store->count);
+  // Only the survivors take their new cell, so the checks above never
+  // see a cell taken in this step
+  for (int i = 0; i < store->count; i++) {
+    if (store->alive[i]) {
+      board_occupy(board, store->x[i], store->y[i], store->owner[i]);
+    }
+  }
+  return alive;
+}
+
+// Actual game simulation, on a copy of the players in the store of the board
+int game_simulation(board_t *board, player_status_t * players, int player_c) {
+  int alive;
+
+  load_players(&board->store, players, player_c);
+  alive = step_players(board, &board->store);
+  save_players(&board->store, players);
+  return alive > 1 || (player_c == 1 && alive == 1);
+}
+
+// splitmix64, small and good enough to place the players
+void seed_random(uint64_t *random_state, uint64_t seed){
+  *random_state = seed;
+}
+
+uint32_t next_random(uint64_t *random_state){
+  uint64_t z = (*random_state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return (z ^ (z >> 31)) >> 32;
+}
 
-    board->spaces[players[i].coordinates.y_position][players[i].coordinates.x_position] = PLAYER;
+// FNV-1a over the rows of every chunk, row by row of the board,
+// with the chunks never allocated counting as empty
+uint64_t board_checksum(board_t *board){
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  uint64_t *chunk;
+  for (int y = 0; y < board->height; y++) {
+    for (int i = 0; i < board->chunk_columns; i++) {
+      chunk = board->occupied[(y >> CHUNK_SHIFT) * board->chunk_columns + i];
+      hash = (hash ^ (chunk != NULL ? chunk[y & CHUNK_MASK] : 0)) * 0x100000001B3ULL;
+    }
   }
+  return hash;
 }
 
-player_coordinates_t getStartPosition(board_t * board, int player_n) {
+player_coordinates_t getStartPosition(board_t * board, int player_n, uint64_t *random_state) {
   player_coordinates_t result;
-  result.x_position = rand() % BOARD_WIDTH;
-  result.y_position = rand() % BOARD_HEIGHT;
-  for(int i = 0; i < board->height; i++){
-    for(int j = 0; j < board->width; j++){
-      if (board->spaces[i][j] == player_n) {
-        result.y_position = i;
-        result.x_position = j;
-        return result;
+  // Use the start position marked in the board, if any
+  if (board->owners != NULL) {
+    for(int i = 0; i < board->height; i++){
+      for(int j = 0; j < board->width; j++){
+        if (board_owner(board, j, i) == player_n && !board_is_occupied(board, j, i)) {
+          result.y_position = i;
+          result.x_position = j;
+          return result;
+        }
       }
     }
   }
+  // Otherwise pick a random free cell
+  do {
+    result.x_position = next_random(random_state) % board->width;
+    result.y_position = next_random(random_state) % board->height;
+  } while (board_is_occupied(board, result.x_position, result.y_position));
   return result;
 }
 
-direction_t getStartDirection() {
-  direction_t start_direction = rand() % 3;
+direction_t getStartDirection(uint64_t *random_state) {
+  direction_t start_direction = next_random(random_state) % 3;
   return start_direction;
 }
 
 char * compressGame(game_t * game) {
-  // Needed space (assuming max heigh/width 99):
-  // - Per player
-  //  + X coord 2 chars
+  // Needed space per player, with coordinates up to 5 digits:
+  //  + X coord 5 chars
   //  + . 1 char
-  //  + Y coord 2 chars
+  //  + Y coord 5 chars
   //  + . 1 char
   //  + Dir 1 chars
   //  + . 1 char
-  // Equals 8 chars per player
+  // Equals 14 chars per player, plus the final '\0'
   int player_size = 16;
-  char * message = calloc(player_size * game->players->player_count, sizeof(*message));
-  char * tmp_message = malloc(player_size * sizeof(*tmp_message));
+  char * message = malloc(player_size * game->players->player_count + 1);
+  char * end = message;
+  *end = '\0';
+  // Write after the last record instead of searching for the end every time
   for (int i = 0; i < game->players->player_count; i++) {
-    sprintf(tmp_message, "%d.%d.%d.", game->stati[i].coordinates.x_position,
+    end += sprintf(end, "%d.%d.%d.", game->stati[i].coordinates.x_position,
       game->stati[i].coordinates.y_position, game->stati[i].current_direction);
-    strcat(message, tmp_message);
   }
-  free(tmp_message);
   //printf("Compressed: %s\n", message);
   return message;
 }
@@ -37,24 +37,121 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "codes.h"
 
 #define BOARD_WIDTH 80
 #define BOARD_HEIGHT 80
+// Largest side of a board, positions travel as 16 bit numbers
+#define MAX_BOARD_SIZE 16384
 
-typedef struct board_struct{
-    int height;
-    int width;
-    int **spaces;
-} board_t;
+// The board is split in square chunks of CHUNK_SIZE x CHUNK_SIZE cells
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
 
 typedef struct player_coordinates{
     int x_position;
     int y_position;
 }player_coordinates_t;
 
+// Players moved at once by the widest step kernel, the arrays of a
+// player store are padded to a multiple of this
+#define STORE_LANES 8
+
+/*
+ * Players stored field by field, so a step kernel can move several of them
+ * with each instruction. The padding players are not alive and stand on
+ * cell (0, 0), so the kernels never need a special case for the last ones.
+ */
+typedef struct player_store_struct{
+    int count;
+    int capacity;
+    int32_t *x;
+    int32_t *y;
+    int32_t *direction;
+    // 1 or 0
+    int32_t *alive;
+    // Number the player marks its cells with
+    int32_t *owner;
+    // Filled by a step: the cell every player moves to, whether that cell
+    // is taken or shared (1 or 0), and its slot in the hash table of targets
+    int32_t *target_x;
+    int32_t *target_y;
+    int32_t *crashed;
+    int32_t *slots;
+} player_store_t;
+
+// Hash table of the cells players move to, with open addressing,
+// a key of 0 marking a free slot
+typedef struct target_table_struct{
+    uint64_t *keys;
+    int *counts;
+    int capacity;
+} target_table_t;
+
+/*
+ * Board split in chunks of 64x64 cells. A chunk is only allocated once one
+ * of its cells is taken, so a huge board with a few trails costs a few
+ * chunks (512 bytes each) plus one pointer per chunk. In a chunk, every row
+ * is one uint64_t with one bit per cell. Boards that need to know who owns
+ * each cell (spawn points read from a file, rendering) also keep one small
+ * owner id per cell, 0 meaning nobody, in chunks allocated along with the
+ * others.
+ */
+typedef struct board_struct{
+    int height;
+    int width;
+    // Chunks in a row and in a column of the board
+    int chunk_columns;
+    int chunk_rows;
+    // chunk_rows x chunk_columns chunks, NULL until a cell is taken
+    uint64_t **occupied;
+    // NULL unless enable_owners was called
+    uint16_t **owners;
+    // Chunks allocated so far
+    int chunk_count;
+    // Scratch space of game_simulation, grown to the number of players:
+    // the players in a store and the cells they move to
+    player_store_t store;
+    target_table_t targets;
+} board_t;
+
+// Position of the chunk of a cell in the chunk arrays
+static inline int board_chunk(board_t *board, int x, int y) {
+  return (y >> CHUNK_SHIFT) * board->chunk_columns + (x >> CHUNK_SHIFT);
+}
+
+// Allocate an empty chunk, for cells about to be written
+void board_allocate_chunk(board_t *board, int chunk);
+
+static inline int board_is_occupied(board_t *board, int x, int y) {
+  uint64_t *chunk = board->occupied[board_chunk(board, x, y)];
+  return chunk != NULL && (chunk[y & CHUNK_MASK] >> (x & CHUNK_MASK)) & 1;
+}
+
+// Take a cell, recording its owner when the board keeps them
+static inline void board_occupy(board_t *board, int x, int y, int owner) {
+  int chunk = board_chunk(board, x, y);
+  if (board->occupied[chunk] == NULL) {
+    board_allocate_chunk(board, chunk);
+  }
+  board->occupied[chunk][y & CHUNK_MASK] |= (uint64_t)1 << (x & CHUNK_MASK);
+  if (board->owners != NULL) {
+    board->owners[chunk][(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)] = owner;
+  }
+}
+
+static inline int board_owner(board_t *board, int x, int y) {
+  int chunk = board_chunk(board, x, y);
+  if (board->owners == NULL || board->owners[chunk] == NULL) {
+    return 0;
+  }
+  return board->owners[chunk][(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)];
+}
+
 typedef struct player_status_struct{
     int player_number;
     int current_direction;
@@ -67,8 +164,7 @@ typedef struct player_struct {
   int player_count;
   // How many players are currently connected
   int connected_players;
-  // Used as barrier to ensure every player is ready at every frame
-  // Protected by count_mutex
+  // How many players sent a move for the last tick
   int players_ready;
 } player_t;
 
@@ -81,27 +177,81 @@ typedef struct game_struct {
   player_t * players;
   // Players status
   player_status_t * stati;
-  // Speed of game (wait time between frames in ms)
+  // Speed of game (time between ticks in us)
   int speed;
+  // State of the random numbers of this game, see seed_random
+  uint64_t random_state;
 } game_t;
 
 board_t *create_board(int size_x, int size_y);
 
 void free_board(board_t * board);
 
+// Empty every cell, the chunks stay allocated for the next game
+void clear_board(board_t * board);
+
+// Set the owner of a free cell, used to mark the start of a player
+void board_set_owner(board_t *board, int x, int y, int owner);
+
+void enable_owners(board_t * board);
+
 board_t *board_from_file(char* filename);
 
 char encode(int val);
 
 void print_board(board_t *board);
 
-void game_simulation(board_t *board, player_status_t * players, int player_c);
+/*
+ * One step of the game, the same whatever the order of the players:
+ * every player still alive leaves a trail on its cell and then moves one
+ * cell. A player moving into a trail or into the same cell as another one
+ * is eliminated, so two players meeting head on both lose. Eliminated
+ * players still move into the cell they crashed on, without taking it, and
+ * never move again.
+ * Returns 1 while the game goes on: more than one player alive, or the only
+ * player of a game for one
+ */
+int game_simulation(board_t *board, player_status_t * players, int player_c);
+
+// Copy the players into a store, growing it if needed
+void load_players(player_store_t *store, const player_status_t *players, int player_c);
+
+// Copy the positions, directions and status of a store back to the players
+void save_players(player_store_t *store, player_status_t *players);
+
+void free_player_store(player_store_t *store);
+
+// Empty the table, making room for the targets of player_c players
+void clear_target_table(target_table_t *table, int player_c);
+
+// Slot of cell (x, y) in the table, adding it with a count of 0 if missing
+int target_table_slot(target_table_t *table, int width, int x, int y);
+
+void free_target_table(target_table_t *table);
+
+/*
+ * The step of game_simulation on players already in a store, with the
+ * kernel picked for this CPU (see step_kernel.h)
+ * Returns the number of players alive after the step
+ */
+int step_players(board_t *board, player_store_t *store);
+
+// Every game draws from its own generator, so the same seed
+// always places the players in the same cells
+void seed_random(uint64_t *random_state, uint64_t seed);
+
+uint32_t next_random(uint64_t *random_state);
+
+// Hash of the taken cells, equal boards give equal checksums
+// however their chunks were allocated
+uint64_t board_checksum(board_t *board);
 
-player_coordinates_t getStartPosition(board_t * board, int player_n);
+player_coordinates_t getStartPosition(board_t * board, int player_n, uint64_t *random_state);
 
-direction_t getStartDirection();
+direction_t getStartDirection(uint64_t *random_state);
 
-void getNewCoordinates(player_status_t *player);
+// Move a player one cell, wrapping around a board of width x height
+void getNewCoordinates(player_status_t *player, int width, int height);
 
 int getCoord(int coord, int max);
 
@@ -0,0 +1,144 @@
+/*
+ * Area of interest of the players.
+ *
+ * See view.h for how the grid is used.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "view.h"
+#include "protocol.h"
+
+void initViewGrid(view_grid_t * grid, int width, int height, int player_count, int radius) {
+  memset(grid, 0, sizeof(*grid));
+  grid->width = width;
+  grid->height = height;
+  grid->player_count = player_count;
+  grid->radius = radius > 0 ? radius : 1;
+  // Cells as wide as the view, but no more cells than a few per player so
+  // building the grid costs the same on any board
+  for (grid->cell_size = grid->radius; ; grid->cell_size *= 2) {
+    grid->columns = (width + grid->cell_size - 1) / grid->cell_size;
+    grid->rows = (height + grid->cell_size - 1) / grid->cell_size;
+    if (grid->columns * grid->rows <= 4 * player_count + 64) {
+      break;
+    }
+  }
+  grid->cell_start = malloc((grid->columns * grid->rows + 1) * sizeof(*grid->cell_start));
+  grid->order = malloc(player_count * sizeof(*grid->order));
+  grid->cells = malloc(player_count * sizeof(*grid->cells));
+  grid->minimap_columns = width < MINIMAP_SIZE ? width : MINIMAP_SIZE;
+  grid->minimap_rows = height < MINIMAP_SIZE ? height : MINIMAP_SIZE;
+  grid->minimap = calloc(grid->minimap_columns * grid->minimap_rows, sizeof(*grid->minimap));
+}
+
+void closeViewGrid(view_grid_t * grid) {
+  free(grid->cell_start);
+  free(grid->order);
+  free(grid->cells);
+  free(grid->minimap);
+}
+
+int viewCulls(view_grid_t * grid) {
+  return 2 * grid->radius + 1 < grid->width || 2 * grid->radius + 1 < grid->height;
+}
+
+void buildViewGrid(view_grid_t * grid, const player_status_t * stati) {
+  int cell_count = grid->columns * grid->rows;
+  int x, y;
+  uint8_t * area;
+
+  // Counting sort of the players by cell
+  memset(grid->cell_start, 0, (cell_count + 1) * sizeof(*grid->cell_start));
+  memset(grid->minimap, 0, grid->minimap_columns * grid->minimap_rows * sizeof(*grid->minimap));
+  for (int i = 0; i < grid->player_count; i++) {
+    x = stati[i].coordinates.x_position;
+    y = stati[i].coordinates.y_position;
+    grid->cells[i] = (y / grid->cell_size) * grid->columns + x / grid->cell_size;
+    grid->cell_start[grid->cells[i] + 1]++;
+    if (stati[i].status) {
+      area = &grid->minimap[(y * grid->minimap_rows / grid->height) * grid->minimap_columns
+                            + x * grid->minimap_columns / grid->width];
+      if (*area < 255) {
+        (*area)++;
+      }
+    }
+  }
+  for (int i = 0; i < cell_count; i++) {
+    grid->cell_start[i + 1] += grid->cell_start[i];
+  }
+  // Fill every cell from its end, cell_start ends up pointing at the start
+  for (int i = grid->player_count - 1; i >= 0; i--) {
+    grid->order[--grid->cell_start[grid->cells[i] + 1]] = i;
+  }
+  memmove(grid->cell_start, grid->cell_start + 1, cell_count * sizeof(*grid->cell_start));
+  grid->cell_start[cell_count] = grid->player_count;
+}
+
+// Add the cells covering [low, high] to the list, unless already there
+static int addCells(int * cells, int count, int low, int high, int cell_size) {
+  int found;
+
+  for (int cell = low / cell_size; cell <= high / cell_size; cell++) {
+    found = 0;
+    for (int i = 0; i < count && !found; i++) {
+      found = cells[i] == cell;
+    }
+    if (!found) {
+      cells[count++] = cell;
+    }
+  }
+  return count;
+}
+
+// Cells covering position - radius to position + radius, wrapping around size
+static int coveringCells(int * cells, int position, int radius, int size, int cell_size) {
+  if (2 * radius + 1 >= size) {
+    return addCells(cells, 0, 0, size - 1, cell_size);
+  }
+  if (position - radius < 0) {
+    return addCells(cells, addCells(cells, 0, 0, position + radius, cell_size),
+                    position - radius + size, size - 1, cell_size);
+  }
+  if (position + radius >= size) {
+    return addCells(cells, addCells(cells, 0, position - radius, size - 1, cell_size),
+                    0, position + radius - size, cell_size);
+  }
+  return addCells(cells, 0, position - radius, position + radius, cell_size);
+}
+
+// Distance along one axis going the shortest way around the board
+static int wrappedDistance(int from, int to, int size) {
+  int distance = abs(to - from);
+  return distance < size - distance ? distance : size - distance;
+}
+
+int queryView(view_grid_t * grid, const player_status_t * stati, int self, uint16_t * players, int capacity) {
+  int columns[VIEW_SPAN], rows[VIEW_SPAN];
+  int column_count, row_count;
+  int x = stati[self].coordinates.x_position;
+  int y = stati[self].coordinates.y_position;
+  int cell, other;
+  int count = 0;
+
+  if (capacity <= 0) {
+    return 0;
+  }
+  players[count++] = self;
+  column_count = coveringCells(columns, x, grid->radius, grid->width, grid->cell_size);
+  row_count = coveringCells(rows, y, grid->radius, grid->height, grid->cell_size);
+  for (int i = 0; i < row_count; i++) {
+    for (int j = 0; j < column_count; j++) {
+      cell = rows[i] * grid->columns + columns[j];
+      for (int k = grid->cell_start[cell]; k < grid->cell_start[cell + 1]; k++) {
+        other = grid->order[k];
+        if (other != self && count < capacity
+            && wrappedDistance(x, stati[other].coordinates.x_position, grid->width) <= grid->radius
+            && wrappedDistance(y, stati[other].coordinates.y_position, grid->height) <= grid->radius) {
+          players[count++] = other;
+        }
+      }
+    }
+  }
+  return count;
+}
@@ -0,0 +1,65 @@
+/*
+ * Area of interest of the players.
+ *
+ * On large boards a client is only sent the players whose heads are within
+ * a view radius of its own head, plus a minimap with how many players are
+ * alive in each part of the board. To find them without looking at every
+ * player, the server sorts the heads into a uniform grid once per step,
+ * with cells as wide as the view radius: the players in view of a head are
+ * always in the few cells around it. Distances wrap around the board, like
+ * the players do.
+ */
+
+#ifndef VIEW_H
+#define VIEW_H
+
+#include <stdint.h>
+
+#include "codes.h"
+#include "tron_simulation.h"
+
+// Cells a player sees in every direction unless the server says otherwise
+#define VIEW_RADIUS 64
+// Most cells of the grid a query looks at along each axis
+#define VIEW_SPAN 8
+
+typedef struct view_grid_struct {
+  int width;
+  int height;
+  int player_count;
+  // Players further than this in either axis are not in view
+  int radius;
+  // Side of the cells of the grid, and the number of cells
+  int cell_size;
+  int columns;
+  int rows;
+  // The players of cell i are order[cell_start[i]] to order[cell_start[i + 1] - 1]
+  int * cell_start;
+  int * order;
+  // Cell of every player in the last step
+  int * cells;
+  // Players alive in each part of the board, row by row, 255 at most
+  int minimap_columns;
+  int minimap_rows;
+  uint8_t * minimap;
+} view_grid_t;
+
+// Prepare the grid for player_count players on a board of width x height
+void initViewGrid(view_grid_t * grid, int width, int height, int player_count, int radius);
+
+void closeViewGrid(view_grid_t * grid);
+
+// Whether some player can be out of view of another one
+int viewCulls(view_grid_t * grid);
+
+// Sort the heads of the players into the grid and count them for the minimap
+void buildViewGrid(view_grid_t * grid, const player_status_t * stati);
+
+/*
+    Write into players the indexes of the players in view of player self,
+    self first, at most capacity of them
+    Returns the number of players written
+*/
+int queryView(view_grid_t * grid, const player_status_t * stati, int self, uint16_t * players, int capacity);
+
+#endif
@@ -0,0 +1,282 @@
+/* TRON Multiplayer Server worker pool.
+ * A fixed set of worker threads, one per core, services the rooms that have
+ * pending events. Every worker owns a deque of ready rooms: it takes the most
+ * recent one from its own deque and, when that is empty, steals the oldest
+ * room of another worker, so busy rooms never wait behind an idle core.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include "worker_pool.h"
+#include "fatal_error.h"
+
+///// FUNCTION DECLARATIONS
+static void * workerThread(void * arg);
+static void pushRoom(room_deque_t * deque, room_t * room);
+static room_t * popNewest(room_deque_t * deque);
+static room_t * popOldest(room_deque_t * deque);
+static room_t * findRoom(worker_t * worker);
+static void armRoom(worker_pool_t * pool, room_t * room, int operation);
+static void finishRoom(worker_pool_t * pool, room_t * room);
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Start worker_count threads (one per core when 0)
+    The rooms are registered on master_epoll_fd with EPOLLONESHOT,
+    the workers re-arm them after servicing
+*/
+void initWorkerPool(worker_pool_t * pool, int worker_count, int master_epoll_fd) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+  sigset_t signals;
+  sigset_t previous;
+
+  if (worker_count <= 0) {
+    worker_count = cores > 0 ? cores : 1;
+  }
+  pool->worker_count = worker_count;
+  pool->master_epoll_fd = master_epoll_fd;
+  pool->queued = 0;
+  pool->stopping = 0;
+  pool->room_count = 0;
+  pool->room_capacity = 64;
+  pool->rooms = malloc(pool->room_capacity * sizeof(*pool->rooms));
+  pthread_mutex_init(&pool->rooms_lock, NULL);
+  pthread_mutex_init(&pool->idle_lock, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+
+  pool->workers = calloc(worker_count, sizeof(*pool->workers));
+  for (int i = 0; i < worker_count; i++) {
+    worker_t * worker = &pool->workers[i];
+    worker->id = i;
+    worker->pool = pool;
+    pthread_mutex_init(&worker->deque.lock, NULL);
+    worker->deque.capacity = 64;
+    worker->deque.rooms = malloc(worker->deque.capacity * sizeof(*worker->deque.rooms));
+  }
+  // Signals must wake up the main thread, the workers inherit this mask
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  // Start the threads once every deque exists, they steal from each other
+  for (int i = 0; i < worker_count; i++) {
+    worker_t * worker = &pool->workers[i];
+    int status = pthread_create(&worker->tid, NULL, &workerThread, worker);
+    if (status) {
+      fprintf(stderr, "ERROR: pthread_create %d\n", status);
+      exit(EXIT_FAILURE);
+    }
+    // Keep each worker on its own core when there are enough of them
+    if (cores > 1 && worker_count <= cores) {
+      CPU_ZERO(&cpus);
+      CPU_SET(i, &cpus);
+      pthread_setaffinity_np(worker->tid, sizeof cpus, &cpus);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/*
+    Register a new room on the master epoll instance
+*/
+void addRoomToPool(worker_pool_t * pool, room_t * room) {
+  pthread_mutex_lock(&pool->rooms_lock);
+  if (pool->room_count == pool->room_capacity) {
+    pool->room_capacity *= 2;
+    pool->rooms = realloc(pool->rooms, pool->room_capacity * sizeof(*pool->rooms));
+  }
+  room->pool_index = pool->room_count;
+  pool->rooms[pool->room_count++] = room;
+  pthread_mutex_unlock(&pool->rooms_lock);
+
+  armRoom(pool, room, EPOLL_CTL_ADD);
+}
+
+/*
+    Queue a room with pending events on the deque of its home worker
+*/
+void submitRoom(worker_pool_t * pool, room_t * room) {
+  pushRoom(&pool->workers[room->id % pool->worker_count].deque, room);
+
+  pthread_mutex_lock(&pool->idle_lock);
+  pool->queued++;
+  pthread_cond_signal(&pool->idle_cond);
+  pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*
+    Print how many rooms each worker ran and stole
+*/
+void reportWorkerPool(worker_pool_t * pool, FILE * stream) {
+  pthread_mutex_lock(&pool->rooms_lock);
+  fprintf(stream, "Rooms open: %d\n", pool->room_count);
+  pthread_mutex_unlock(&pool->rooms_lock);
+  for (int i = 0; i < pool->worker_count; i++) {
+    fprintf(stream, "\tWorker %d: %llu rooms serviced, %llu stolen\n", i,
+      __atomic_load_n(&pool->workers[i].rooms_run, __ATOMIC_RELAXED),
+      __atomic_load_n(&pool->workers[i].steals, __ATOMIC_RELAXED));
+  }
+}
+
+/*
+    Wait for the workers to finish and close the rooms that are left
+*/
+void stopWorkerPool(worker_pool_t * pool) {
+  pthread_mutex_lock(&pool->idle_lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->idle_cond);
+  pthread_mutex_unlock(&pool->idle_lock);
+
+  for (int i = 0; i < pool->worker_count; i++) {
+    pthread_join(pool->workers[i].tid, NULL);
+  }
+  for (int i = 0; i < pool->worker_count; i++) {
+    pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    free(pool->workers[i].deque.rooms);
+  }
+  free(pool->workers);
+
+  while (pool->room_count > 0) {
+    finishRoom(pool, pool->rooms[pool->room_count - 1]);
+  }
+  free(pool->rooms);
+  pthread_mutex_destroy(&pool->rooms_lock);
+  pthread_mutex_destroy(&pool->idle_lock);
+  pthread_cond_destroy(&pool->idle_cond);
+}
+
+/*
+    Service ready rooms until the pool stops
+*/
+static void * workerThread(void * arg) {
+  worker_t * worker = arg;
+  worker_pool_t * pool = worker->pool;
+  room_t * room;
+
+  while (1) {
+    room = findRoom(worker);
+    if (room == NULL) {
+      // Nothing to run anywhere, sleep until a room is submitted
+      pthread_mutex_lock(&pool->idle_lock);
+      while (pool->queued <= 0 && !pool->stopping) {
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+      }
+      if (pool->stopping) {
+        pthread_mutex_unlock(&pool->idle_lock);
+        break;
+      }
+      pthread_mutex_unlock(&pool->idle_lock);
+      continue;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->idle_lock);
+    __atomic_add_fetch(&worker->rooms_run, 1, __ATOMIC_RELAXED);
+
+    if (serviceRoom(room)) {
+      armRoom(pool, room, EPOLL_CTL_MOD);
+    } else {
+      finishRoom(pool, room);
+    }
+  }
+  pthread_exit(NULL);
+}
+
+/*
+    Take the newest room of the worker, or steal the oldest room of another
+*/
+static room_t * findRoom(worker_t * worker) {
+  worker_pool_t * pool = worker->pool;
+  room_t * room = popNewest(&worker->deque);
+
+  for (int i = 1; room == NULL && i < pool->worker_count; i++) {
+    room = popOldest(&pool->workers[(worker->id + i) % pool->worker_count].deque);
+    if (room != NULL) {
+      __atomic_add_fetch(&worker->steals, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return room;
+}
+
+static void pushRoom(room_deque_t * deque, room_t * room) {
+  room_t ** rooms;
+
+  pthread_mutex_lock(&deque->lock);
+  // Grow the ring, unwrapping it into the new array
+  if (deque->count == deque->capacity) {
+    rooms = malloc(2 * deque->capacity * sizeof(*rooms));
+    for (int i = 0; i < deque->count; i++) {
+      rooms[i] = deque->rooms[(deque->head + i) % deque->capacity];
+    }
+    free(deque->rooms);
+    deque->rooms = rooms;
+    deque->head = 0;
+    deque->capacity *= 2;
+  }
+  deque->rooms[(deque->head + deque->count) % deque->capacity] = room;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+// The owner works on the most recent room, its data is likely still in cache
+static room_t * popNewest(room_deque_t * deque) {
+  room_t * room = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    room = deque->rooms[(deque->head + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return room;
+}
+
+// Thieves take the room that has been waiting the longest
+static room_t * popOldest(room_deque_t * deque) {
+  room_t * room = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    room = deque->rooms[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return room;
+}
+
+/*
+    Watch the epoll instance of the room for a single notification
+*/
+static void armRoom(worker_pool_t * pool, room_t * room, int operation) {
+  struct epoll_event event;
+
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = room;
+  if (epoll_ctl(pool->master_epoll_fd, operation, room->epoll_fd, &event) == -1) {
+    fatalError("ERROR: epoll_ctl");
+  }
+}
+
+/*
+    Remove a room from the pool and close it
+*/
+static void finishRoom(worker_pool_t * pool, room_t * room) {
+  epoll_ctl(pool->master_epoll_fd, EPOLL_CTL_DEL, room->epoll_fd, NULL);
+
+  pthread_mutex_lock(&pool->rooms_lock);
+  pool->room_count--;
+  pool->rooms[room->pool_index] = pool->rooms[pool->room_count];
+  pool->rooms[room->pool_index]->pool_index = room->pool_index;
+  pthread_mutex_unlock(&pool->rooms_lock);
+
+  closeRoom(room);
+}
@@ -0,0 +1,78 @@
+/* TRON Multiplayer Server worker pool.
+ * A fixed set of worker threads, one per core, services the rooms that have
+ * pending events. Every worker owns a deque of ready rooms: it takes the most
+ * recent one from its own deque and, when that is empty, steals the oldest
+ * room of another worker, so busy rooms never wait behind an idle core.
+ *
+ * Christian Aguilar
+ * Salomon Levy
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+#include "room.h"
+
+// Ready rooms of one worker
+typedef struct room_deque_struct {
+  pthread_mutex_t lock;
+  room_t ** rooms;
+  // Index of the oldest room, where thieves take from
+  int head;
+  int count;
+  int capacity;
+} room_deque_t;
+
+struct worker_pool_struct;
+
+typedef struct worker_struct {
+  int id;
+  pthread_t tid;
+  room_deque_t deque;
+  struct worker_pool_struct * pool;
+  // Rooms serviced and rooms taken from other workers
+  unsigned long long rooms_run;
+  unsigned long long steals;
+} worker_t;
+
+typedef struct worker_pool_struct {
+  int worker_count;
+  worker_t * workers;
+  // The epoll instance watching every room, rooms are re-armed on it
+  int master_epoll_fd;
+  // Idle workers sleep on the condition until a room is submitted
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  // Rooms submitted and not taken yet, protected by idle_lock. It is only
+  // counted after the push, so it may briefly be -1
+  int queued;
+  int stopping;
+  // Every room still open, protected by rooms_lock
+  pthread_mutex_t rooms_lock;
+  room_t ** rooms;
+  int room_count;
+  int room_capacity;
+} worker_pool_t;
+
+/*
+    Start worker_count threads (one per core when 0)
+    The rooms are registered on master_epoll_fd with EPOLLONESHOT,
+    the workers re-arm them after servicing
+*/
+void initWorkerPool(worker_pool_t * pool, int worker_count, int master_epoll_fd);
+
+// Register a new room on the master epoll instance
+void addRoomToPool(worker_pool_t * pool, room_t * room);
+
+// Queue a room with pending events on the deque of its home worker
+void submitRoom(worker_pool_t * pool, room_t * room);
+
+// Print how many rooms each worker ran and stole
+void reportWorkerPool(worker_pool_t * pool, FILE * stream);
+
+// Wait for the workers to finish and close the rooms that are left
+void stopWorkerPool(worker_pool_t * pool);
+
+#endif